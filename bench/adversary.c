@@ -0,0 +1,89 @@
+/*
+ * adversary.c
+ *
+ * Mao programs built to hit the slow paths of the interpreter.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "infra/qstring.h"
+#include "adversary.h"
+
+void
+adversary_plus_chain(FILE *fp, size_t n)
+{
+    fputs("int a;\na = 1", fp);
+    for (size_t i = 1; i < n; ++i) {
+        fputs(i % 16 ? " + 1" : " + 1\n", fp);
+    }
+    fputs(";\n", fp);
+}
+
+void
+adversary_paren_nest(FILE *fp, size_t n)
+{
+    fputs("int a;\na = ", fp);
+    for (size_t i = 0; i < n; ++i) {
+        fputc('(', fp);
+    }
+    fputc('1', fp);
+    for (size_t i = 0; i < n; ++i) {
+        fputc(')', fp);
+    }
+    fputs(";\n", fp);
+}
+
+void
+adversary_long_literal(FILE *fp, size_t n)
+{
+    fputs("print(\"", fp);
+    for (size_t i = 0; i < n; ++i) {
+        fputc('a' + i % 26, fp);
+    }
+    fputs("\");\n", fp);
+}
+
+/*
+ * Names k0, k1, ... in order, skipping those outside bucket 0 when
+ * buckets is nonzero. About buckets names are tried for each one kept.
+ */
+static char **
+adversary_names(size_t n, uint64_t seed, size_t buckets)
+{
+    char   **res = malloc(n * sizeof(char *));
+    char     buf[32];
+    uint64_t k = 0;
+    
+    if (buckets != 0) {
+        qstr_hash_seed(seed);
+    }
+    for (size_t i = 0; i < n; ++k) {
+        int len = snprintf(buf, sizeof(buf), "k%llu", (unsigned long long)k);
+        if (buckets != 0 && qstr_view_hash(qstr_view_n(buf, len)) % buckets != 0) {
+            continue;
+        }
+        res[i++] = strcpy(malloc(len + 1), buf);
+    }
+    return res;
+}
+
+void
+adversary_idents(FILE *fp, size_t n, uint64_t seed, size_t buckets)
+{
+    char **names = adversary_names(n, seed, buckets);
+    
+    for (size_t i = 0; i < n; i += 8) {
+        fputs("int ", fp);
+        for (size_t j = i; j < i + 8 && j < n; ++j) {
+            fprintf(fp, j > i ? ", %s" : "%s", names[j]);
+        }
+        fputs(";\n", fp);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        fprintf(fp, "%s = %s + 1;\n", names[i], names[(i * 7 + 3) % n]);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        free(names[i]);
+    }
+    free(names);
+}
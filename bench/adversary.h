@@ -0,0 +1,40 @@
+/*
+ * adversary.h
+ *
+ * Mao programs built to hit the slow paths of the interpreter, with
+ * a size n to grow them by. See bench/complexity.c.
+ */
+
+#ifndef MAOLANG_ADVERSARY_H_
+#define MAOLANG_ADVERSARY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * `a = 1 + 1 + ... + 1;` with n operands. Every operator has the same
+ * priority, so each level of mao_parse_expr splits off one operand.
+ */
+void adversary_plus_chain(FILE *fp, size_t n);
+
+/*
+ * `a = ((...(1)...));` nested n deep. Each level of mao_parse_expr
+ * strips one pair.
+ */
+void adversary_paren_nest(FILE *fp, size_t n);
+
+/*
+ * print("...") of a literal n characters long.
+ */
+void adversary_long_literal(FILE *fp, size_t n);
+
+/*
+ * n variables declared, then each assigned from another one.
+ *
+ * With buckets nonzero, the names are chosen so that all of them fall
+ * into bucket 0 of a table of that many buckets, under hash seed seed.
+ * This sets the seed of qstr_hash, so set it again before running.
+ */
+void adversary_idents(FILE *fp, size_t n, uint64_t seed, size_t buckets);
+
+#endif //MAOLANG_ADVERSARY_H_
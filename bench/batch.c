@@ -0,0 +1,242 @@
+/*
+ * batch.c
+ *
+ * Throughput of mao --jobs against one process per script. Many small
+ * workloads are generated into a temporary directory, then run both
+ * ways with the same number of scripts at a time: once by starting a
+ * mao process for each of them, once by a single mao --jobs. Output
+ * goes to /dev/null in both.
+ *
+ * The report is one JSON document on standard output, with the time
+ * of each way for one job and for --jobs jobs. Times are the best of
+ * all repetitions.
+ */
+
+/* For mkdtemp, which -std=c11 alone hides */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "workload.h"
+
+#ifndef MAO_REVISION
+#define MAO_REVISION "unknown"
+#endif
+
+/* Small scripts, where starting a process costs the most */
+#define BATCH_WORKLOAD \
+    { "small", 20, 100, 1, 3, 30, 10, 10, 1 }
+
+static double
+batch_now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Start argv[0] with its output and errors going to devnull.
+ */
+static pid_t
+batch_spawn(char *const argv[], int devnull)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+/*
+ * Wait for a child, giving -1 if it could not run at all. Scripts
+ * stopped by their own errors are not a failure of the benchmark.
+ */
+static int
+batch_wait(void)
+{
+    int status;
+    if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * One process for each of paths, at most jobs of them at a time.
+ */
+static double
+batch_processes(const char *mao, char **paths, size_t count, unsigned jobs, int devnull)
+{
+    double   t0 = batch_now();
+    unsigned running = 0;
+    int      failed = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        char *argv[] = { (char *)mao, paths[i], NULL };
+        if (running == jobs) {
+            failed |= batch_wait();
+            --running;
+        }
+        batch_spawn(argv, devnull);
+        ++running;
+    }
+    while (running-- > 0) {
+        failed |= batch_wait();
+    }
+    if (failed) {
+        fprintf(stderr, "batch: cannot run %s\n", mao);
+        exit(1);
+    }
+    return batch_now() - t0;
+}
+
+static double
+batch_jobs(const char *mao, const char *manifest, unsigned jobs, int devnull)
+{
+    char   jobs_arg[32], manifest_arg[4096];
+    char  *argv[] = { (char *)mao, jobs_arg, manifest_arg, NULL };
+    double t0 = batch_now();
+
+    snprintf(jobs_arg, sizeof(jobs_arg), "--jobs=%u", jobs);
+    snprintf(manifest_arg, sizeof(manifest_arg), "--manifest=%s", manifest);
+    batch_spawn(argv, devnull);
+    if (batch_wait() != 0) {
+        fprintf(stderr, "batch: cannot run %s\n", mao);
+        exit(1);
+    }
+    return batch_now() - t0;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--mao=PATH] [--scripts=N] [--jobs=N] [--repeat=N] "
+            "[key=value]...\n"
+            "key=value sets a parameter of the workload of each script, "
+            "see bench/workload.h\n", name);
+    exit(1);
+}
+
+int main(int argc, const char * argv[])
+{
+    struct workload w = BATCH_WORKLOAD;
+    const char *mao = "build/mao";
+    size_t      count = 2000;
+    long        online = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned    jobs = online > 0 ? (unsigned)online : 1;
+    unsigned    repeat = 3;
+    char        dir[] = "/tmp/mao-batch-XXXXXX";
+    char        manifest[sizeof(dir) + 16];
+    char      **paths;
+    FILE       *list;
+    int         devnull = open("/dev/null", O_WRONLY);
+
+    for (int i = 1; i < argc; ++i) {
+        const char *eq = strchr(argv[i], '=');
+
+        if (!strncmp(argv[i], "--mao=", 6)) {
+            mao = argv[i] + 6;
+        } else if (!strncmp(argv[i], "--scripts=", 10)) {
+            count = (size_t)atol(argv[i] + 10);
+        } else if (!strncmp(argv[i], "--jobs=", 7)) {
+            jobs = (unsigned)atoi(argv[i] + 7);
+        } else if (!strncmp(argv[i], "--repeat=", 9)) {
+            repeat = (unsigned)atoi(argv[i] + 9);
+        } else if (argv[i][0] != '-' && eq != NULL && eq - argv[i] < 32) {
+            char key[32];
+            memcpy(key, argv[i], eq - argv[i]);
+            key[eq - argv[i]] = '\0';
+            if (workload_set(&w, key, eq + 1) != 0) {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (count == 0 || jobs == 0 || repeat == 0) {
+        usage(argv[0]);
+    }
+    if (devnull < 0 || mkdtemp(dir) == NULL) {
+        perror("batch");
+        return 1;
+    }
+
+    /* Each script is the same workload with a seed of its own */
+    snprintf(manifest, sizeof(manifest), "%s/manifest", dir);
+    if ((list = fopen(manifest, "w")) == NULL) {
+        perror(manifest);
+        return 1;
+    }
+    paths = malloc(count * sizeof(char *));
+    for (size_t i = 0; i < count; ++i) {
+        struct workload script = w;
+        FILE *fp;
+
+        paths[i] = malloc(sizeof(dir) + 32);
+        snprintf(paths[i], sizeof(dir) + 32, "%s/%zu.mao", dir, i);
+        if ((fp = fopen(paths[i], "w")) == NULL) {
+            perror(paths[i]);
+            return 1;
+        }
+        script.seed = w.seed + i;
+        workload_write(fp, &script);
+        fclose(fp);
+        fprintf(list, "%s\n", paths[i]);
+    }
+    fclose(list);
+
+    printf("{ \"revision\": \"%s\", \"repeat\": %u, \"scripts\": %zu,\n"
+           "  \"params\": { \"decls\": %u, \"assigns\": %u, \"depth\": %u, \"width\": %u, "
+           "\"literal\": %u, \"comment\": %u, \"print\": %u, \"seed\": %llu },\n"
+           "  \"runs\": [\n",
+           MAO_REVISION, repeat, count, w.decls, w.assigns, w.depth, w.width,
+           w.literal, w.comment, w.print, (unsigned long long)w.seed);
+    for (unsigned k = 0; k < 2; ++k) {
+        unsigned n = k == 0 ? 1 : jobs;
+        double   process_best = 0, jobs_best = 0;
+
+        if (k == 1 && jobs == 1) {
+            break;
+        }
+        for (unsigned r = 0; r < repeat; ++r) {
+            double t = batch_processes(mao, paths, count, n, devnull);
+            if (r == 0 || t < process_best) {
+                process_best = t;
+            }
+            t = batch_jobs(mao, manifest, n, devnull);
+            if (r == 0 || t < jobs_best) {
+                jobs_best = t;
+            }
+        }
+        printf("%s    { \"jobs\": %u, \"process_sec\": %.6f, \"batch_sec\": %.6f, "
+               "\"process_scripts_per_sec\": %.0f, \"batch_scripts_per_sec\": %.0f, "
+               "\"speedup\": %.2f }",
+               k == 0 ? "" : ",\n", n, process_best, jobs_best,
+               count / process_best, count / jobs_best, process_best / jobs_best);
+        fflush(stdout);
+    }
+    printf("\n  ]\n}\n");
+
+    for (size_t i = 0; i < count; ++i) {
+        unlink(paths[i]);
+        free(paths[i]);
+    }
+    free(paths);
+    unlink(manifest);
+    rmdir(dir);
+    close(devnull);
+    return 0;
+}
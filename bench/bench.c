@@ -0,0 +1,249 @@
+/*
+ * bench.c
+ *
+ * Benchmark harness of Mao. Each workload is generated into a
+ * temporary file, then lexed and run several times in a process of
+ * its own, so the peak RSS reported belongs to that workload alone.
+ *
+ * Lexing is timed apart from the rest. Parsing and executing are
+ * timed together, as statements run while they are parsed.
+ *
+ * With --pipeline, each workload is also run as mao --pipeline does,
+ * the lexer on a thread of its own feeding the parser, and that time
+ * is compared with lexing and running one after the other.
+ *
+ * The report is one JSON document on standard output:
+ *
+ *     { "revision": ..., "repeat": ..., "workloads": [ {...}, ... ] }
+ *
+ * Times are the best of all repetitions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "lex.h"
+#include "workload.h"
+#include "harness.h"
+
+#ifndef MAO_REVISION
+#define MAO_REVISION "unknown"
+#endif
+
+static const struct workload bench_suite[] = {
+    /* name         decls assigns depth width lit comment print seed */
+    { "declare",    50000,      0,    0,    1,  0,     0,    0,   1 },
+    { "assign",      1000, 200000,    0,    4, 30,     0,    0,   2 },
+    { "nested",       500,  20000,    3,    3, 30,     0,    0,   3 },
+    { "literal",      500, 100000,    1,    3, 90,     0,    0,   4 },
+    { "comment",      500, 100000,    0,    3, 30,    80,    0,   5 },
+    { "print",        500, 100000,    0,    2, 30,     0,   80,   6 },
+};
+
+#define BENCH_SUITE_LEN (sizeof(bench_suite) / sizeof(bench_suite[0]))
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Run w repeat times and print its JSON object. Called in the child.
+ */
+static void
+bench_run(const struct workload *w, unsigned repeat, bool pipeline, const char *sep)
+{
+    FILE   *fp = tmpfile();
+    int     devnull = open("/dev/null", O_WRONLY);
+    double  lex_best = 0, run_best = 0, total_best = 0, pipeline_best = 0;
+    size_t  tokens = 0, statements = 0;
+    int     errors = 0;
+    long    bytes;
+    struct rusage usage;
+
+    if (fp == NULL || devnull < 0) {
+        perror("bench");
+        exit(1);
+    }
+    workload_write(fp, w);
+    bytes = ftell(fp);
+
+    for (unsigned r = 0; r < repeat; ++r) {
+        qwriter_t out = qwriter_create(devnull);
+        double    t0, t1, t2;
+        qmem_t    stream;
+        mao_state st = harness_setup(out);
+
+        rewind(fp);
+        t0 = bench_now();
+        stream = mao_lex_analyze(st, fp);
+        t1 = bench_now();
+        mao_parse(st, stream);
+        qwriter_flush(out);
+        t2 = bench_now();
+
+        if (r == 0 || t1 - t0 < lex_best) {
+            lex_best = t1 - t0;
+        }
+        if (r == 0 || t2 - t1 < run_best) {
+            run_best = t2 - t1;
+        }
+        if (r == 0 || t2 - t0 < total_best) {
+            total_best = t2 - t0;
+        }
+        /* The END token is not counted */
+        tokens = qmem_len(stream) - 1;
+        statements = 0;
+        for (qmem_iter_t i = qmem_iter_new(stream); !qmem_iter_end(i); qmem_iter_forward(&i)) {
+            statements += qmem_iter_getval(i, struct token).type == TOKEN_SEMICOLON;
+        }
+        errors = mao_errors(st);
+        qwriter_free(out);
+        harness_teardown(st, stream);
+
+        if (pipeline) {
+            out = qwriter_create(devnull);
+            st = harness_setup(out);
+            rewind(fp);
+            t0 = bench_now();
+            mao_parse_pipelined(st, fp);
+            qwriter_flush(out);
+            t1 = bench_now();
+            if (r == 0 || t1 - t0 < pipeline_best) {
+                pipeline_best = t1 - t0;
+            }
+            qwriter_free(out);
+            harness_teardown(st, NULL);
+        }
+    }
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%s    { \"name\": \"%s\", "
+           "\"params\": { \"decls\": %u, \"assigns\": %u, \"depth\": %u, \"width\": %u, "
+           "\"literal\": %u, \"comment\": %u, \"print\": %u, \"seed\": %llu },\n"
+           "      \"bytes\": %ld, \"tokens\": %zu, \"statements\": %zu, "
+           "\"errors\": %d,\n"
+           "      \"lex_sec\": %.6f, \"run_sec\": %.6f, "
+           "\"tokens_per_sec\": %.0f, \"statements_per_sec\": %.0f, "
+           "\"peak_rss_kib\": %ld",
+           sep, w->name, w->decls, w->assigns, w->depth, w->width,
+           w->literal, w->comment, w->print, (unsigned long long)w->seed,
+           bytes, tokens, statements, errors,
+           lex_best, run_best,
+           lex_best > 0 ? tokens / lex_best : 0,
+           run_best > 0 ? statements / run_best : 0,
+           usage.ru_maxrss);
+    if (pipeline) {
+        printf(",\n      \"total_sec\": %.6f, \"pipeline_sec\": %.6f, "
+               "\"pipeline_speedup\": %.2f",
+               total_best, pipeline_best,
+               pipeline_best > 0 ? total_best / pipeline_best : 0);
+    }
+    printf(" }");
+    fflush(stdout);
+    close(devnull);
+    fclose(fp);
+}
+
+/*
+ * The child prints the separator before its object, so a workload
+ * failing halfway leaves the document valid.
+ */
+static int
+bench_fork(const struct workload *w, unsigned repeat, bool pipeline, const char *sep)
+{
+    int status;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        bench_run(w, repeat, pipeline, sep);
+        exit(0);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: workload '%s' failed\n", w->name);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--repeat=N] [--scale=F] [--only=NAME] [--pipeline] "
+            "[key=value]...\n"
+            "key=value sets a parameter of a single custom workload, "
+            "see bench/workload.h\n", name);
+    exit(1);
+}
+
+int main(int argc, const char * argv[])
+{
+    struct workload custom = WORKLOAD_DEFAULT;
+    bool        use_custom = false;
+    bool        pipeline = false;
+    unsigned    repeat = 3;
+    double      scale = 1.0;
+    const char *only = NULL;
+    int         status = 0;
+    bool        first = true;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *eq = strchr(argv[i], '=');
+
+        if (!strncmp(argv[i], "--repeat=", 9)) {
+            repeat = (unsigned)atoi(argv[i] + 9);
+        } else if (!strncmp(argv[i], "--scale=", 8)) {
+            scale = atof(argv[i] + 8);
+        } else if (!strncmp(argv[i], "--only=", 7)) {
+            only = argv[i] + 7;
+        } else if (!strcmp(argv[i], "--pipeline")) {
+            pipeline = true;
+        } else if (argv[i][0] != '-' && eq != NULL && eq - argv[i] < 32) {
+            char key[32];
+            memcpy(key, argv[i], eq - argv[i]);
+            key[eq - argv[i]] = '\0';
+            if (workload_set(&custom, key, eq + 1) != 0) {
+                usage(argv[0]);
+            }
+            use_custom = true;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (repeat == 0 || scale <= 0) {
+        usage(argv[0]);
+    }
+
+    printf("{ \"revision\": \"%s\", \"repeat\": %u, \"scale\": %g, \"pipeline\": %s,\n"
+           "  \"workloads\": [\n",
+           MAO_REVISION, repeat, scale, pipeline ? "true" : "false");
+    for (size_t i = 0; i < (use_custom ? 1 : BENCH_SUITE_LEN); ++i) {
+        struct workload w = use_custom ? custom : bench_suite[i];
+
+        if (only != NULL && strcmp(only, w.name)) {
+            continue;
+        }
+        w.decls = (unsigned)(w.decls * scale);
+        w.assigns = (unsigned)(w.assigns * scale);
+        if (bench_fork(&w, repeat, pipeline, first ? "" : ",\n") != 0) {
+            status = 1;
+        } else {
+            first = false;
+        }
+    }
+    printf("\n  ]\n}\n");
+    return status;
+}
@@ -0,0 +1,283 @@
+/*
+ * complexity.c
+ *
+ * Complexity regression suite of Mao. Each case is an adversarial
+ * input (see adversary.h) run at doubling sizes. The exponent k of
+ * time ~ n^k is fitted for each phase by least squares on log time
+ * against log n, and the suite fails if any exponent is above the
+ * bound of its phase by more than --slack.
+ *
+ * A bound above 1 is what the code does today, not what it should do;
+ * the reason is printed with it. Such a case still catches a change
+ * that makes it worse.
+ *
+ * Times are the best of --repeat runs. The exit status is 1 if any
+ * case failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lex.h"
+#include "harness.h"
+#include "adversary.h"
+
+#define CX_STEPS_MAX 8
+
+enum { CX_LEX, CX_RUN, CX_PHASES };
+
+static const char *cx_phase_names[CX_PHASES] = { "lex", "run" };
+
+/* Bucket count of variable_list, see mao_state_create */
+#define CX_BUCKETS QCMAP_LEN_DEFAULT
+
+/* Seed of the colliding names, and the one the script runs under */
+#define CX_ATTACK_SEED 0x5eed
+#define CX_RUN_SEED    0x9e3779b97f4a7c15ull
+
+struct cx_case {
+    const char         *name;
+    size_t             first;	/* sizes are first, 2 * first, ... */
+    unsigned           steps;
+    double bound[CX_PHASES];	/* expected exponent, 0 for not checked */
+    void (*write)(FILE *fp, size_t n);
+    void (*direct)(size_t n, double *sec);	/* instead of write, one phase */
+    const char         *note;
+};
+
+static void
+cx_idents(FILE *fp, size_t n)
+{
+    adversary_idents(fp, n, 0, 0);
+}
+
+static void
+cx_collide(FILE *fp, size_t n)
+{
+    adversary_idents(fp, n, CX_ATTACK_SEED, CX_BUCKETS);
+}
+
+static double
+cx_now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Search "aa...a" of n characters for "aa...ab" of m characters,
+ * which fails only at the last character of every window.
+ */
+static void
+cx_find(size_t n, size_t m, double *sec)
+{
+    qstr_t text = qstr_create(QSTR_INIT_BYNONE);
+    qstr_t pattern = qstr_create(QSTR_INIT_BYNONE);
+    double t0;
+
+    for (size_t i = 0; i < n; ++i) {
+        qstr_push(text, 'a');
+    }
+    for (size_t i = 1; i < m; ++i) {
+        qstr_push(pattern, 'a');
+    }
+    qstr_push(pattern, 'b');
+    t0 = cx_now();
+    if (qstr_find_qstr(text, pattern) != -1) {
+        fprintf(stderr, "complexity: qstr_find_qstr found a pattern not there\n");
+        exit(1);
+    }
+    *sec = cx_now() - t0;
+    qstr_free(text);
+    qstr_free(pattern);
+}
+
+static void
+cx_find_short(size_t n, double *sec)
+{
+    cx_find(n, 16, sec);
+}
+
+static void
+cx_find_long(size_t n, double *sec)
+{
+    cx_find(n, n / 2, sec);
+}
+
+/*
+ * The parser recurses once for each operand or pair of parentheses,
+ * which bounds those cases by the stack rather than by time.
+ */
+static const struct cx_case cx_cases[] = {
+    { "plus_chain",     1000, 4, { 1, 2 }, adversary_plus_chain, NULL,
+      "each level of mao_parse_expr rescans the rest of the chain" },
+    { "paren_nest",     1000, 4, { 1, 2 }, adversary_paren_nest, NULL,
+      "each level of mao_parse_expr rescans the inner expression" },
+    { "long_literal", 1000000, 4, { 1, 0 }, adversary_long_literal, NULL, NULL },
+    { "idents",         4000, 4, { 1, 2 }, cx_idents, NULL,
+      "variable_list has a fixed number of buckets" },
+    { "collide",        1000, 4, { 1, 1 }, cx_collide, NULL, NULL },
+    { "find_short",  4000000, 4, { 0, 1 }, NULL, cx_find_short, NULL },
+    { "find_long",   4000000, 4, { 0, 1 }, NULL, cx_find_long, NULL },
+};
+
+#define CX_CASES (sizeof(cx_cases) / sizeof(cx_cases[0]))
+
+/*
+ * Run the script of c at size n once, giving the time of each phase.
+ */
+static void
+cx_run_script(const struct cx_case *c, size_t n, double sec[CX_PHASES])
+{
+    FILE     *fp = tmpfile();
+    int       devnull = open("/dev/null", O_WRONLY);
+    qwriter_t out;
+    qmem_t    stream;
+    mao_state st;
+    double    t0, t1, t2;
+
+    if (fp == NULL || devnull < 0) {
+        perror("complexity");
+        exit(1);
+    }
+    c->write(fp, n);
+    qstr_hash_seed(CX_RUN_SEED);
+    rewind(fp);
+    out = qwriter_create(devnull);
+    st = harness_setup(out);
+    t0 = cx_now();
+    stream = mao_lex_analyze(st, fp);
+    t1 = cx_now();
+    mao_parse(st, stream);
+    qwriter_flush(out);
+    t2 = cx_now();
+    if (mao_errors(st) != 0) {
+        fprintf(stderr, "complexity: script of '%s' at size %zu has errors\n", c->name, n);
+        exit(1);
+    }
+    sec[CX_LEX] = t1 - t0;
+    sec[CX_RUN] = t2 - t1;
+    qwriter_free(out);
+    harness_teardown(st, stream);
+    close(devnull);
+    fclose(fp);
+}
+
+/*
+ * Slope of the least squares line through (log n, log sec).
+ */
+static double
+cx_exponent(const size_t *n, const double *sec, unsigned count)
+{
+    double mx = 0, my = 0, sxy = 0, sxx = 0;
+
+    for (unsigned i = 0; i < count; ++i) {
+        mx += log((double)n[i]) / count;
+        my += log(sec[i]) / count;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        double dx = log((double)n[i]) - mx;
+        sxy += dx * (log(sec[i]) - my);
+        sxx += dx * dx;
+    }
+    return sxy / sxx;
+}
+
+/*
+ * Run all sizes of c and print a line for each phase checked. Gives
+ * the number of phases above their bound.
+ */
+static int
+cx_run_case(const struct cx_case *c, unsigned repeat, double slack)
+{
+    size_t n[CX_STEPS_MAX];
+    double sec[CX_PHASES][CX_STEPS_MAX];
+    int    failed = 0;
+
+    for (unsigned s = 0; s < c->steps; ++s) {
+        n[s] = c->first << s;
+        for (unsigned r = 0; r < repeat; ++r) {
+            double t[CX_PHASES] = { 0 };
+
+            if (c->direct != NULL) {
+                c->direct(n[s], &t[CX_RUN]);
+            } else {
+                cx_run_script(c, n[s], t);
+            }
+            for (int p = 0; p < CX_PHASES; ++p) {
+                if (r == 0 || t[p] < sec[p][s]) {
+                    sec[p][s] = t[p];
+                }
+            }
+        }
+    }
+    for (int p = 0; p < CX_PHASES; ++p) {
+        double k;
+        bool   ok;
+
+        if (c->bound[p] == 0) {
+            continue;
+        }
+        k = cx_exponent(n, sec[p], c->steps);
+        ok = k <= c->bound[p] + slack;
+        failed += !ok;
+        printf("%-14s %-4s %5.2f  (bound %.0f)  %-4s ", c->name, cx_phase_names[p],
+               k, c->bound[p], ok ? "ok" : "FAIL");
+        for (unsigned s = 0; s < c->steps; ++s) {
+            printf(" %zu:%.4fs", n[s], sec[p][s]);
+        }
+        putchar('\n');
+        if (c->note != NULL && c->bound[p] > 1) {
+            printf("%-14s      bound %.0f: %s\n", "", c->bound[p], c->note);
+        }
+        fflush(stdout);
+    }
+    return failed;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--repeat=N] [--slack=F] [--only=NAME]\n", name);
+    exit(1);
+}
+
+int main(int argc, const char * argv[])
+{
+    unsigned    repeat = 5;
+    double      slack = 0.4;
+    const char *only = NULL;
+    int         failed = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--repeat=", 9)) {
+            repeat = (unsigned)atoi(argv[i] + 9);
+        } else if (!strncmp(argv[i], "--slack=", 8)) {
+            slack = atof(argv[i] + 8);
+        } else if (!strncmp(argv[i], "--only=", 7)) {
+            only = argv[i] + 7;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (repeat == 0 || slack < 0) {
+        usage(argv[0]);
+    }
+
+    printf("%-14s %-4s %5s\n", "case", "phase", "exponent");
+    for (size_t i = 0; i < CX_CASES; ++i) {
+        if (only == NULL || !strcmp(only, cx_cases[i].name)) {
+            failed += cx_run_case(&cx_cases[i], repeat, slack);
+        }
+    }
+    if (failed != 0) {
+        printf("complexity: %d phase(s) grew faster than their bound\n", failed);
+        return 1;
+    }
+    return 0;
+}
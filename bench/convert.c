@@ -0,0 +1,286 @@
+/*
+ * convert.c
+ *
+ * Checks of the number formatting of qstring against the C library.
+ *
+ *   int32    qstr_fmt_int64 on every int32 value, or every --int-step-th
+ *            one, against a plain division loop, then on the int64
+ *            extremes and random int64 values against snprintf.
+ *   double   qstr_assign_double on random finite doubles, spread over
+ *            all exponents, and on short decimals such as 0.3 or
+ *            1.5e-7: strtod must give the same value back, from no
+ *            more digits than the shortest form %.*e finds.
+ *   fixed    qstr_fmt_fixed on random doubles of every size it writes
+ *            itself, with every precision, against snprintf "%.*f".
+ *
+ * The exit status is 1 if any case failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "infra/qstring.h"
+
+static uint64_t
+cv_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static size_t
+cv_ref_int(char *dst, int64_t value)
+{
+    char     buf[QSTR_FMT_INT_MAX];
+    uint64_t u = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    size_t   n = 0, len = 0;
+
+    do {
+        buf[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (value < 0) {
+        dst[len++] = '-';
+    }
+    while (n > 0) {
+        dst[len++] = buf[--n];
+    }
+    return len;
+}
+
+static int
+cv_check_int(int64_t value, size_t (*ref)(char *, int64_t))
+{
+    char got[QSTR_FMT_INT_MAX + 1], want[QSTR_FMT_INT_MAX + 1];
+    size_t n = qstr_fmt_int64(got, value), m = ref(want, value);
+
+    if (n != m || memcmp(got, want, n) != 0) {
+        got[n] = want[m] = '\0';
+        fprintf(stderr, "convert: %" PRId64 " written as '%s', not '%s'\n", value, got, want);
+        return 1;
+    }
+    return 0;
+}
+
+static size_t
+cv_snprintf_int(char *dst, int64_t value)
+{
+    char buf[32];
+    int  n = snprintf(buf, sizeof(buf), "%" PRId64, value);
+    memcpy(dst, buf, (size_t)n);
+    return (size_t)n;
+}
+
+static unsigned
+cv_int32(unsigned step, uint64_t seed)
+{
+    static const int64_t edges[] = {
+        0, 1, -1, 9, 10, 99, 100, INT64_MAX, INT64_MIN, INT64_MAX - 1, INT64_MIN + 1,
+        999999999999999999, 1000000000000000000, -1000000000000000000,
+    };
+    unsigned failed = 0;
+    uint64_t rng = seed;
+
+    for (int64_t v = INT32_MIN; v <= INT32_MAX && failed < 10; v += step) {
+        failed += cv_check_int(v, cv_ref_int);
+    }
+    failed += cv_check_int(INT32_MAX, cv_ref_int);
+    for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); ++i) {
+        failed += cv_check_int(edges[i], cv_snprintf_int);
+    }
+    for (int i = 0; i < 1000000 && failed < 10; ++i) {
+        /* As many short values as long ones */
+        uint64_t r = cv_random(&rng);
+        failed += cv_check_int((int64_t)(r >> (r % 64)), cv_snprintf_int);
+    }
+    return failed;
+}
+
+/*
+ * Significant digits of a decimal form, leading and trailing zeros
+ * left out.
+ */
+static int
+cv_digits(const char *s)
+{
+    const char *first = NULL, *last = NULL;
+
+    for (; *s != '\0' && *s != 'e'; ++s) {
+        if (*s >= '1' && *s <= '9') {
+            if (first == NULL) {
+                first = s;
+            }
+            last = s;
+        }
+    }
+    if (first == NULL) {
+        return 1;
+    }
+    /* The point between them is not a digit */
+    return (int)(last - first) + 1 - (memchr(first, '.', last - first) != NULL);
+}
+
+/*
+ * The fewest digits %.*e needs to read back as value. A form which
+ * reads back stays so with more digits, so they are found by halving.
+ */
+static int
+cv_shortest(double value)
+{
+    char buf[40];
+    int  lo = 0, hi = 16;
+
+    while (lo < hi) {
+        int prec = (lo + hi) / 2;
+        snprintf(buf, sizeof(buf), "%.*e", prec, value);
+        if (strtod(buf, NULL) == value) {
+            hi = prec;
+        } else {
+            lo = prec + 1;
+        }
+    }
+    snprintf(buf, sizeof(buf), "%.*e", lo, value);
+    return cv_digits(buf);
+}
+
+static unsigned
+cv_check_double(qstr_t s, double value)
+{
+    qstr_assign_double(s, value);
+    if (strtod(qstr_data(s), NULL) != value) {
+        fprintf(stderr, "convert: %.17g written as '%s'\n", value, qstr_data(s));
+        return 1;
+    }
+    if (cv_digits(qstr_data(s)) > cv_shortest(value)) {
+        fprintf(stderr, "convert: %.17g written as '%s', not the shortest\n",
+                value, qstr_data(s));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * 10^(1 + r % 17), the bound of a random decimal significand.
+ */
+static uint64_t
+cv_pow10_max(uint64_t r)
+{
+    uint64_t p = 10;
+    for (uint64_t n = r % 17; n > 0; --n) {
+        p *= 10;
+    }
+    return p;
+}
+
+static unsigned
+cv_double(unsigned long count, uint64_t seed)
+{
+    qstr_t   s = qstr_create(QSTR_INIT_BYNONE);
+    uint64_t rng = seed;
+    unsigned failed = 0;
+
+    for (unsigned long i = 0; i < count && failed < 10; ++i) {
+        uint64_t bits = cv_random(&rng);
+        double   value;
+        char     buf[40];
+
+        memcpy(&value, &bits, sizeof(value));
+        if (value == value && value - value == 0) {	/* not NaN or infinite */
+            failed += cv_check_double(s, value);
+        }
+        /* Up to 17 digits, any exponent */
+        snprintf(buf, sizeof(buf), "%" PRIu64 "e%d", bits % cv_pow10_max(bits >> 59),
+                 (int)(bits >> 40 & 0x3FF) - 340);
+        value = strtod(buf, NULL);
+        if (value != 0 && value - value == 0) {
+            failed += cv_check_double(s, value);
+        }
+    }
+    qstr_free(s);
+    return failed;
+}
+
+static unsigned
+cv_fixed(unsigned long count, uint64_t seed)
+{
+    char     got[QSTR_FMT_FIXED_MAX + 1], want[QSTR_FMT_FIXED_MAX + 1];
+    uint64_t rng = seed;
+    unsigned failed = 0;
+
+    for (unsigned long i = 0; i < count && failed < 10; ++i) {
+        uint64_t r = cv_random(&rng);
+        int      prec = (int)(r % (QSTR_FMT_PREC_MAX + 1));
+        /* Mostly below 2^64, where the digits are not left to snprintf */
+        double   value = (double)(int64_t)r / (double)(1ull << (r >> 58));
+        size_t   n = qstr_fmt_fixed(got, value, prec);
+
+        got[n] = '\0';
+        snprintf(want, sizeof(want), "%.*f", prec, value);
+        if (strcmp(got, want) != 0) {
+            fprintf(stderr, "convert: %.17g at %d written as '%s', not '%s'\n",
+                    value, prec, got, want);
+            ++failed;
+        }
+    }
+    return failed;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--int-step=N] [--doubles=N] [--seed=N] "
+            "[--only=NAME]\n", name);
+    exit(1);
+}
+
+int main(int argc, const char * argv[])
+{
+    unsigned      step = 1;
+    unsigned long doubles = 1000000;
+    uint64_t      seed = 0x9e3779b97f4a7c15ull;
+    const char   *only = NULL;
+    int           failed = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--int-step=", 11)) {
+            step = (unsigned)atoi(argv[i] + 11);
+        } else if (!strncmp(argv[i], "--doubles=", 10)) {
+            doubles = strtoul(argv[i] + 10, NULL, 10);
+        } else if (!strncmp(argv[i], "--seed=", 7)) {
+            seed = strtoull(argv[i] + 7, NULL, 0);
+        } else if (!strncmp(argv[i], "--only=", 7)) {
+            only = argv[i] + 7;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (step == 0 || seed == 0) {
+        usage(argv[0]);
+    }
+
+    if (only == NULL || !strcmp(only, "int32")) {
+        unsigned errors = cv_int32(step, seed);
+        printf("%-8s %llu values: %s\n", "int32",
+               ((1ull << 32) + step - 1) / step, errors == 0 ? "ok" : "FAILED");
+        failed += errors != 0;
+    }
+    if (only == NULL || !strcmp(only, "double")) {
+        unsigned errors = cv_double(doubles, seed);
+        printf("%-8s %lu values: %s\n", "double", doubles, errors == 0 ? "ok" : "FAILED");
+        failed += errors != 0;
+    }
+    if (only == NULL || !strcmp(only, "fixed")) {
+        unsigned errors = cv_fixed(doubles, seed);
+        printf("%-8s %lu values: %s\n", "fixed", doubles, errors == 0 ? "ok" : "FAILED");
+        failed += errors != 0;
+    }
+    if (failed != 0) {
+        printf("convert: %d case(s) failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
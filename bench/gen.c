@@ -0,0 +1,37 @@
+/*
+ * gen.c
+ *
+ * Write a synthetic Mao program to standard output, e.g.
+ *
+ *     mao-gen decls=500 assigns=20000 depth=2 print=5 > w.mao
+ *
+ * Parameters not given take the values of WORKLOAD_DEFAULT.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "workload.h"
+
+int main(int argc, const char * argv[])
+{
+    struct workload w = WORKLOAD_DEFAULT;
+    
+    for (int i = 1; i < argc; ++i) {
+        char key[32];
+        const char *eq = strchr(argv[i], '=');
+        
+        if (eq == NULL || (size_t)(eq - argv[i]) >= sizeof(key)) {
+            fprintf(stderr, "usage: %s [key=value]...\n", argv[0]);
+            return 1;
+        }
+        memcpy(key, argv[i], eq - argv[i]);
+        key[eq - argv[i]] = '\0';
+        if (workload_set(&w, key, eq + 1) != 0) {
+            fprintf(stderr, "%s: bad parameter '%s'\n", argv[0], argv[i]);
+            return 1;
+        }
+    }
+    workload_write(stdout, &w);
+    return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * harness.c
+ *
+ * Running scripts in-process for the benchmark programs.
+ */
+
+#include "lex.h"
+#include "harness.h"
+
+mao_state
+harness_setup(qwriter_t out)
+{
+    mao_state st = mao_state_create(stderr);
+    st->out = out;
+    return st;
+}
+
+void
+harness_teardown(mao_state st, qmem_t stream)
+{
+    if (stream != NULL) {
+        mao_lex_free(stream);
+    }
+    mao_state_destroy(st);
+}
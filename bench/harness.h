@@ -0,0 +1,27 @@
+/*
+ * harness.h
+ *
+ * Running scripts in-process for the benchmark programs, which time
+ * lexing apart from the rest and so do not go through mao_run.
+ */
+
+#ifndef MAOLANG_HARNESS_H_
+#define MAOLANG_HARNESS_H_
+
+#include "infra/qmemory.h"
+#include "infra/qwriter.h"
+#include "mao.h"
+
+/*
+ * A fresh interpreter printing to out, so the variables declared by
+ * the last script are gone. Fatal errors end the program.
+ */
+mao_state harness_setup(qwriter_t out);
+
+/*
+ * Free the token stream of a script and the interpreter it ran in.
+ * stream is NULL after a pipelined run, which frees its own tokens.
+ */
+void harness_teardown(mao_state st, qmem_t stream);
+
+#endif //MAOLANG_HARNESS_H_
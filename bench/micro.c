@@ -0,0 +1,1617 @@
+/*
+ * micro.c
+ *
+ * Microbenchmarks of the infra containers, each against a plain array
+ * or libc doing the same work, or against the code it replaced. Sizes go from 10 to 10^7 elements by
+ * powers of 10, up to the limit of each case.
+ *
+ * A sample times one operation over n elements. For small n it is
+ * done on enough instances at once that a sample covers about
+ * MICRO_BATCH_ELEMS elements, well above the clock resolution. After
+ * warming up, samples are taken until --min-time seconds have passed,
+ * and the median and 99th percentile are reported in ns per element.
+ *
+ * The heap taken by 10^6 variables and 10^7 expression nodes, from
+ * slabs and from qalloc_tag one by one, is reported in bytes where
+ * glibc can tell.
+ *
+ * Lookups in a qcmap_t shared by 1 to --threads threads are timed
+ * apart, against a qmap_t behind one mutex, and reported in lookups
+ * per second of all threads together.
+ *
+ * The report is one JSON document on standard output.
+ */
+
+/* For clock_gettime and pthread_barrier_t, which -std=c11 alone hides */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include "infra/qmemory.h"
+#include "infra/qstring.h"
+#include "infra/qmap.h"
+#include "infra/qcmap.h"
+#include "infra/qslab.h"
+#include "infra/qarena.h"
+#include "error.h"
+#include "expr.h"
+
+#ifndef MAO_REVISION
+#define MAO_REVISION "unknown"
+#endif
+
+#define MICRO_BATCH_ELEMS   100000
+#define MICRO_WARMUP        2
+#define MICRO_MIN_SAMPLES   7
+#define MICRO_MAX_SAMPLES   1000
+#define MICRO_SIZE_MAX      10000000
+#define MICRO_KEYS_MAX      1000000	/* each qstr_t held costs a few dozen bytes */
+#define MICRO_SUB_LEN       16
+#define MICRO_NAMES_MAX     100000	/* variables of a large script */
+#define MICRO_VARS_MAX      1000000
+#define MICRO_EXPRS_MAX     10000000
+#define MICRO_THREADS_MAX   32
+#define MICRO_SCALE_KEYS    1000	/* about a script's worth of variables */
+#define MICRO_SCALE_LOOKUPS 100000	/* by each thread, in one sample */
+#define MICRO_SCALE_SAMPLES 5
+
+/*
+ * Shared, read-only inputs of one size, and the instances of one
+ * sample.
+ */
+struct micro_env {
+    size_t            n;
+    size_t        batch;
+    char        **ckeys;	/* n distinct keys */
+    qstr_t        *keys;	/* the same as qstr_t */
+    qstr_t         text;	/* n characters */
+    qstr_t        other;	/* the same as text but the last character */
+    char         *ctext;
+    char        *cother;
+    qmem_t        fixed;	/* n ints */
+    qmem_t       vector;	/* the same in vector mode */
+    int          *array;	/* the same as an array */
+    qmap_t          map;	/* keys to their index */
+    struct ref_map *ref;	/* the same as the reference table */
+    char       **cnames;	/* n variable names sharing a long prefix */
+    qstr_t       *names;	/* the same as qstr_t */
+    qstr_t     *queries;	/* other copies of names */
+    qcmap_t        vars;	/* names to their index */
+    struct ref_map *refvars;	/* the same as the reference table */
+    void        **inst;	/* batch instances */
+    size_t       *instn;
+    volatile size_t sink;	/* keeps results alive */
+};
+
+struct micro_impl {
+    void (*prepare)(struct micro_env *env);	/* not timed */
+    void (*op)(struct micro_env *env);
+    void (*cleanup)(struct micro_env *env);	/* not timed */
+};
+
+struct micro_case {
+    const char        *name;
+    const char         *ref;	/* what the reference does */
+    size_t              max;	/* largest n */
+    struct micro_impl  impl;
+    struct micro_impl  base;
+};
+
+/*
+ * The reference for qmap_t: open addressing with linear probing and
+ * FNV-1a, keys owned by the table as for qmap_t.
+ */
+#define REF_DELETED ((char *)1)
+
+struct ref_map {
+    char   **keys;
+    int     *vals;
+    size_t    cap;	/* power of 2, at least twice the keys */
+};
+
+static uint64_t
+ref_hash(const char *s)
+{
+    uint64_t h = 1469598103934665603ull;
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 1099511628211ull;
+    }
+    return h;
+}
+
+static struct ref_map *
+ref_map_create(size_t n)
+{
+    struct ref_map *res = malloc(sizeof(struct ref_map));
+    res->cap = 16;
+    while (res->cap < 2 * n) {
+        res->cap *= 2;
+    }
+    res->keys = calloc(res->cap, sizeof(char *));
+    res->vals = malloc(res->cap * sizeof(int));
+    return res;
+}
+
+static char *
+ref_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return memcpy(malloc(len), s, len);
+}
+
+static void
+ref_map_add(struct ref_map *m, const char *key, int value)
+{
+    size_t i = ref_hash(key) & (m->cap - 1);
+    while (m->keys[i] != NULL && m->keys[i] != REF_DELETED) {
+        i = (i + 1) & (m->cap - 1);
+    }
+    m->keys[i] = ref_strdup(key);
+    m->vals[i] = value;
+}
+
+static int *
+ref_map_find(struct ref_map *m, const char *key)
+{
+    for (size_t i = ref_hash(key) & (m->cap - 1); m->keys[i] != NULL;
+         i = (i + 1) & (m->cap - 1)) {
+        if (m->keys[i] != REF_DELETED && !strcmp(m->keys[i], key)) {
+            return &m->vals[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+ref_map_delete(struct ref_map *m, const char *key)
+{
+    int *v = ref_map_find(m, key);
+    if (v != NULL) {
+        size_t i = v - m->vals;
+        free(m->keys[i]);
+        m->keys[i] = REF_DELETED;
+    }
+}
+
+static struct ref_map *
+ref_map_duplicate(const struct ref_map *m)
+{
+    struct ref_map *res = malloc(sizeof(struct ref_map));
+    res->cap = m->cap;
+    res->keys = malloc(m->cap * sizeof(char *));
+    res->vals = malloc(m->cap * sizeof(int));
+    for (size_t i = 0; i < m->cap; ++i) {
+        res->keys[i] = m->keys[i] == NULL || m->keys[i] == REF_DELETED
+            ? m->keys[i] : ref_strdup(m->keys[i]);
+    }
+    memcpy(res->vals, m->vals, m->cap * sizeof(int));
+    return res;
+}
+
+static void
+ref_map_free(struct ref_map *m)
+{
+    for (size_t i = 0; i < m->cap; ++i) {
+        if (m->keys[i] != NULL && m->keys[i] != REF_DELETED) {
+            free(m->keys[i]);
+        }
+    }
+    free(m->keys);
+    free(m->vals);
+    free(m);
+}
+
+static void
+nothing(struct micro_env *env)
+{
+}
+
+/*
+ * qmem_t
+ */
+static void
+qmem_append_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qmem_t m = qmem_create(int);
+        for (size_t i = 0; i < env->n; ++i) {
+            qmem_append(m, (int)i, int);
+        }
+        env->inst[b] = m;
+    }
+}
+
+static void
+qmem_free_all(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qmem_free((qmem_t)env->inst[b]);
+    }
+}
+
+static void
+array_append_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        size_t cap = 0, len = 0;
+        int   *arr = NULL;
+        for (size_t i = 0; i < env->n; ++i) {
+            if (len == cap) {
+                cap = cap != 0 ? 2 * cap : 16;
+                arr = realloc(arr, cap * sizeof(int));
+            }
+            arr[len++] = (int)i;
+        }
+        env->inst[b] = arr;
+    }
+}
+
+static void
+free_all(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        free(env->inst[b]);
+    }
+}
+
+static void
+qmem_iterate_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (qmem_iter_t i = qmem_iter_new(env->fixed); !qmem_iter_end(i); qmem_iter_forward(&i)) {
+            sum += qmem_iter_getval(i, int);
+        }
+    }
+    env->sink = sum;
+}
+
+static void
+array_iterate_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            sum += env->array[i];
+        }
+    }
+    env->sink = sum;
+}
+
+static void
+qmem_dup_prepare(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->inst[b] = qmem_duplicate(env->fixed);
+    }
+}
+
+static void
+qmem_lessen_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qmem_lessen((qmem_t)env->inst[b], env->n / 2);
+    }
+}
+
+static void
+array_dup_prepare(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->inst[b] = memcpy(malloc(env->n * sizeof(int)), env->array, env->n * sizeof(int));
+    }
+}
+
+static void
+array_lessen_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->inst[b] = realloc(env->inst[b], env->n / 2 * sizeof(int) + 1);
+    }
+}
+
+static void
+qmem_duplicate_op(struct micro_env *env)
+{
+    qmem_dup_prepare(env);
+}
+
+static void
+array_duplicate_op(struct micro_env *env)
+{
+    array_dup_prepare(env);
+}
+
+static void
+qmem_vector_append_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qmem_t m = qmem_create_vector(int);
+        for (size_t i = 0; i < env->n; ++i) {
+            qmem_append(m, (int)i, int);
+        }
+        env->inst[b] = m;
+    }
+}
+
+static void
+qmem_vector_at_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            sum += qmem_at(env->vector, i, int);
+        }
+    }
+    env->sink = sum;
+}
+
+static void
+qmem_append_n_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qmem_t m = qmem_create(int);
+        qmem_append_n(m, env->array, env->n);
+        env->inst[b] = m;
+    }
+}
+
+static void
+qmem_append_loop_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qmem_t m = qmem_create(int);
+        for (size_t i = 0; i < env->n; ++i) {
+            qmem_append(m, env->array[i], int);
+        }
+        env->inst[b] = m;
+    }
+}
+
+/*
+ * Indexes jump by a large prime, so that a step is rarely in the
+ * block of the step before.
+ */
+#define MICRO_STRIDE 1000003
+
+static void
+qmem_list_at_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0, k = 0; i < env->n; ++i, k = (k + MICRO_STRIDE) % env->n) {
+            sum += qmem_at(env->fixed, k, int);
+        }
+    }
+    env->sink = sum;
+}
+
+static void
+array_at_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0, k = 0; i < env->n; ++i, k = (k + MICRO_STRIDE) % env->n) {
+            sum += env->array[k];
+        }
+    }
+    env->sink = sum;
+}
+
+/*
+ * qstr_t
+ */
+static void
+qstr_create_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qstr_t *res = env->inst[b];
+        for (size_t i = 0; i < env->n; ++i) {
+            res[i] = qstr_create(QSTR_INIT_BYCSTR, env->ckeys[i]);
+        }
+    }
+}
+
+static void
+strs_prepare(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->inst[b] = malloc(env->n * sizeof(void *));
+    }
+}
+
+static void
+qstrs_free(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qstr_t *res = env->inst[b];
+        for (size_t i = 0; i < env->n; ++i) {
+            qstr_free(res[i]);
+        }
+        free(res);
+    }
+}
+
+static void
+cstr_create_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        char **res = env->inst[b];
+        for (size_t i = 0; i < env->n; ++i) {
+            res[i] = ref_strdup(env->ckeys[i]);
+        }
+    }
+}
+
+static void
+cstrs_free(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        char **res = env->inst[b];
+        for (size_t i = 0; i < env->n; ++i) {
+            free(res[i]);
+        }
+        free(res);
+    }
+}
+
+static void
+qstr_append_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qstr_t s = qstr_create(QSTR_INIT_BYNONE);
+        for (size_t i = 0; i < env->n; ++i) {
+            qstr_append(s, env->keys[i]);
+        }
+        env->inst[b] = s;
+    }
+}
+
+static void
+qstr_free_all(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qstr_free((qstr_t)env->inst[b]);
+    }
+}
+
+static void
+cstr_append_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        size_t cap = 32, len = 0;
+        char  *s = malloc(cap);
+        for (size_t i = 0; i < env->n; ++i) {
+            size_t add = strlen(env->ckeys[i]);
+            if (len + add + 1 > cap) {
+                while (len + add + 1 > cap) {
+                    cap *= 2;
+                }
+                s = realloc(s, cap);
+            }
+            memcpy(s + len, env->ckeys[i], add + 1);
+            len += add;
+        }
+        env->inst[b] = s;
+    }
+}
+
+static void
+qstr_append_cstr_n_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qstr_t s = qstr_create(QSTR_INIT_BYNONE);
+        qstr_append_cstr_n(s, env->ctext, env->n);
+        env->inst[b] = s;
+    }
+}
+
+static void
+qstr_push_loop_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qstr_t s = qstr_create(QSTR_INIT_BYNONE);
+        for (size_t i = 0; i < env->n; ++i) {
+            qstr_push(s, env->ctext[i]);
+        }
+        env->inst[b] = s;
+    }
+}
+
+static void
+qstr_sub_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            qstr_t s = qstr_sub(env->text, i, MICRO_SUB_LEN);
+            env->sink += qstr_len(s);
+            qstr_free(s);
+        }
+    }
+}
+
+static void
+cstr_sub_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            size_t len = env->n - i < MICRO_SUB_LEN ? env->n - i : MICRO_SUB_LEN;
+            char  *s = malloc(len + 1);
+            memcpy(s, env->ctext + i, len);
+            s[len] = '\0';
+            env->sink += len;
+            free(s);
+        }
+    }
+}
+
+static void
+qstr_find_char_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->sink += qstr_find_char(env->text, '#');
+    }
+}
+
+static void
+memchr_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->sink += (char *)memchr(env->ctext, '#', env->n) - env->ctext;
+    }
+}
+
+static void
+qstr_find_cstr_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->sink += qstr_find_cstr(env->text, "abcab#");
+    }
+}
+
+static void
+strstr_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->sink += strstr(env->ctext, "abcab#") - env->ctext;
+    }
+}
+
+/*
+ * qstr_find_char and qstr_find_cstr as they were before memchr and
+ * Two-Way, one character at a time through an iterator.
+ */
+static int
+old_find_char(const qstr_t item, const char pattern)
+{
+    int i = 0;
+    for (qstr_iter_t iter = qstr_iter_new(item);
+         !qstr_iter_end(iter); qstr_iter_forward(&iter), ++i) {
+        if (qstr_iter_getval(iter) == pattern) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int
+old_find_cstr(const qstr_t text, const char *pattern)
+{
+    if (strlen(pattern) > qstr_len(text)) {
+        return -1;
+    }
+    int i = 0;
+    for (qstr_iter_t match_tmp, iter = qstr_iter_new(text);
+         !qstr_iter_end(iter); qstr_iter_forward(&iter), ++i) {
+        match_tmp = iter;
+        for (int j = 0; j < strlen(pattern); ++j) {
+            if (qstr_iter_getval(match_tmp) != pattern[j]
+                || qstr_iter_end(match_tmp)) {
+                break;
+            }
+            qstr_iter_forward(&match_tmp);
+            if (j == strlen(pattern) - 1) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+static void
+old_find_char_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->sink += old_find_char(env->text, '#');
+    }
+}
+
+static void
+old_find_cstr_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->sink += old_find_cstr(env->text, "abcab#");
+    }
+}
+
+static void
+qstr_comp_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->sink += qstr_comp(env->text, env->other);
+    }
+}
+
+static void
+strcmp_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->sink += strcmp(env->ctext, env->cother);
+    }
+}
+
+/*
+ * Objects of the interpreter, taken and given back one by one. A
+ * variable is an mvar_struct and the mobject_struct it holds.
+ */
+static void
+ptrs_prepare(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->inst[b] = malloc(2 * env->n * sizeof(void *));
+    }
+}
+
+static void
+qslab_variable_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        void  **p = env->inst[b];
+        qslab_t vars = qslab_create(struct mvar_struct, QALLOC_OBJECT);
+        qslab_t objs = qslab_create(struct mobject_struct, QALLOC_OBJECT);
+        for (size_t i = 0; i < env->n; ++i) {
+            p[2 * i] = qslab_alloc(vars);
+            p[2 * i + 1] = qslab_alloc(objs);
+        }
+        for (size_t i = 0; i < 2 * env->n; ++i) {
+            qslab_release(p[i]);
+        }
+        qslab_destroy(vars);
+        qslab_destroy(objs);
+    }
+}
+
+static void
+qalloc_variable_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        void **p = env->inst[b];
+        for (size_t i = 0; i < env->n; ++i) {
+            p[2 * i] = qalloc_tag(sizeof(struct mvar_struct), QALLOC_OBJECT);
+            p[2 * i + 1] = qalloc_tag(sizeof(struct mobject_struct), QALLOC_OBJECT);
+        }
+        for (size_t i = 0; i < env->n; ++i) {
+            qfree(p[2 * i], sizeof(struct mvar_struct), QALLOC_OBJECT);
+            qfree(p[2 * i + 1], sizeof(struct mobject_struct), QALLOC_OBJECT);
+        }
+    }
+}
+
+static void
+qslab_expr_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        void  **p = env->inst[b];
+        qslab_t exprs = qslab_create(struct mao_expr_struct, QALLOC_EXPR);
+        for (size_t i = 0; i < env->n; ++i) {
+            p[i] = qslab_alloc(exprs);
+        }
+        for (size_t i = 0; i < env->n; ++i) {
+            qslab_release(p[i]);
+        }
+        qslab_destroy(exprs);
+    }
+}
+
+static void
+qalloc_expr_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        void **p = env->inst[b];
+        for (size_t i = 0; i < env->n; ++i) {
+            p[i] = qalloc_tag(sizeof(struct mao_expr_struct), QALLOC_EXPR);
+        }
+        for (size_t i = 0; i < env->n; ++i) {
+            qfree(p[i], sizeof(struct mao_expr_struct), QALLOC_EXPR);
+        }
+    }
+}
+
+/*
+ * Allocator backends, called directly as qalloc calls them: each
+ * block is freed right after it is taken, at sizes from 16 to 128
+ * bytes. The backend of qalloc itself is set once for the program, so
+ * it is left alone.
+ */
+static qallocator_t      micro_backend;
+static qarena_t          micro_arena;
+static struct qalloc_cap micro_cap;
+
+#define micro_pair_size(i) (16 * ((i) % 8 + 1))
+
+static void
+backend_pairs_op(struct micro_env *env)
+{
+    const qallocator_t *a = &micro_backend;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            void *p = a->alloc(a->ctx, micro_pair_size(i), 0);
+            *(volatile char *)p = 0;
+            a->free(a->ctx, p, micro_pair_size(i));
+        }
+    }
+}
+
+static void
+malloc_pairs_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            void *p = malloc(micro_pair_size(i));
+            /* Keeps the compiler from leaving the pair out */
+            *(volatile char *)p = 0;
+            free(p);
+        }
+    }
+}
+
+static void
+malloc_backend_prepare(struct micro_env *env)
+{
+    micro_backend = qalloc_malloc_backend;
+}
+
+static void
+arena_backend_prepare(struct micro_env *env)
+{
+    micro_arena = qarena_create(NULL, 0, false);
+    micro_backend = qarena_allocator(micro_arena);
+}
+
+static void
+shared_arena_backend_prepare(struct micro_env *env)
+{
+    micro_arena = qarena_create(NULL, 0, true);
+    micro_backend = qarena_allocator(micro_arena);
+}
+
+static void
+arena_backend_cleanup(struct micro_env *env)
+{
+    qarena_destroy(micro_arena);
+}
+
+static void
+capped_backend_prepare(struct micro_env *env)
+{
+    micro_backend = qalloc_capped(&micro_cap, &qalloc_malloc_backend, (size_t)1 << 30);
+}
+
+/*
+ * Numbers to text. The values run over many lengths and exponents, as
+ * printed results do.
+ */
+static int64_t
+micro_int_value(size_t i)
+{
+    return (int64_t)((i * 0x9e3779b97f4a7c15ull) >> (i % 64));
+}
+
+static double
+micro_double_value(size_t i)
+{
+    return (double)micro_int_value(i) / (double)(1 + i % 1000);
+}
+
+static void
+qstr_fmt_int64_op(struct micro_env *env)
+{
+    char buf[QSTR_FMT_INT_MAX];
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            env->sink += qstr_fmt_int64(buf, micro_int_value(i));
+        }
+    }
+}
+
+static void
+snprintf_int64_op(struct micro_env *env)
+{
+    char buf[32];
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            env->sink += snprintf(buf, sizeof(buf), "%lld", (long long)micro_int_value(i));
+        }
+    }
+}
+
+static void
+qstr_assign_double_op(struct micro_env *env)
+{
+    qstr_t s = qstr_create(QSTR_INIT_BYNONE);
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            qstr_assign_double(s, micro_double_value(i));
+            env->sink += qstr_len(s);
+        }
+    }
+    qstr_free(s);
+}
+
+static void
+snprintf_double_op(struct micro_env *env)
+{
+    char buf[32];
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            env->sink += snprintf(buf, sizeof(buf), "%.17g", micro_double_value(i));
+        }
+    }
+}
+
+/*
+ * qmap_t
+ */
+static qmap_t
+qmap_build(struct micro_env *env)
+{
+    qmap_t m = qmap_create(int);
+    for (size_t i = 0; i < env->n; ++i) {
+        qmap_add(m, env->keys[i], (int)i, int);
+    }
+    return m;
+}
+
+static struct ref_map *
+ref_map_build(struct micro_env *env)
+{
+    struct ref_map *m = ref_map_create(env->n);
+    for (size_t i = 0; i < env->n; ++i) {
+        ref_map_add(m, env->ckeys[i], (int)i);
+    }
+    return m;
+}
+
+static void
+qmap_add_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->inst[b] = qmap_build(env);
+    }
+}
+
+static void
+qmap_free_all(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        qmap_free((qmap_t)env->inst[b]);
+    }
+}
+
+static void
+ref_add_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->inst[b] = ref_map_build(env);
+    }
+}
+
+static void
+ref_free_all(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        ref_map_free(env->inst[b]);
+    }
+}
+
+static void
+qmap_fetch_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            sum += qmap_fetch(env->map, env->keys[i], int);
+        }
+    }
+    env->sink = sum;
+}
+
+static void
+ref_fetch_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            sum += *ref_map_find(env->ref, env->ckeys[i]);
+        }
+    }
+    env->sink = sum;
+}
+
+static void
+qmap_dup_prepare(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->inst[b] = qmap_duplicate(env->map);
+    }
+}
+
+static void
+qmap_delete_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            qmap_delete_item(env->inst[b], env->keys[i]);
+        }
+    }
+}
+
+static void
+ref_dup_prepare(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        env->inst[b] = ref_map_duplicate(env->ref);
+    }
+}
+
+static void
+ref_delete_op(struct micro_env *env)
+{
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            ref_map_delete(env->inst[b], env->ckeys[i]);
+        }
+    }
+}
+
+static void
+qmap_duplicate_op(struct micro_env *env)
+{
+    qmap_dup_prepare(env);
+}
+
+static void
+ref_duplicate_op(struct micro_env *env)
+{
+    ref_dup_prepare(env);
+}
+
+/*
+ * Names sharing a long prefix, the way variables of one kind often
+ * are, so an equal pair differs from the others only at the end.
+ * The reference is qstr_comp as it was before memcmp.
+ */
+static int
+old_comp(const qstr_t str1, const qstr_t str2)
+{
+    const char    *s1 = qstr_data(str1), *s2 = qstr_data(str2);
+    size_t         n = str1->len < str2->len ? str1->len : str2->len;
+    char           c1 = '\0', c2 = '\0';
+
+    for (size_t i = 0; i < n; ++i) {
+        c1 = s1[i], c2 = s2[i];
+        if (c1 != c2) {
+            return c1 - c2;
+        }
+    }
+    if (str1->len != str2->len) {
+        return str1->len == n ? 0 - c2 : c1;
+    }
+    return 0;
+}
+
+static void
+qstr_equal_prefix_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            sum += qstr_equal(env->names[i], env->queries[i]);
+        }
+    }
+    env->sink = sum;
+}
+
+static void
+old_equal_prefix_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            sum += old_comp(env->names[i], env->queries[i]) == 0;
+        }
+    }
+    env->sink = sum;
+}
+
+static void
+qcmap_find_prefix_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            sum += qcmap_fetch(env->vars, env->queries[i], int);
+        }
+    }
+    env->sink = sum;
+}
+
+static void
+ref_find_prefix_op(struct micro_env *env)
+{
+    size_t sum = 0;
+    for (size_t b = 0; b < env->batch; ++b) {
+        for (size_t i = 0; i < env->n; ++i) {
+            sum += *ref_map_find(env->refvars, env->cnames[i]);
+        }
+    }
+    env->sink = sum;
+}
+
+/*
+ * qmap_t and qcmap_t have a fixed number of buckets, so their lookups
+ * slow down linearly past a few thousand keys; they are not run where
+ * that would take minutes.
+ */
+static const struct micro_case micro_cases[] = {
+    { "qmem_append", "array append, realloc doubling", MICRO_SIZE_MAX,
+      { nothing, qmem_append_op, qmem_free_all },
+      { nothing, array_append_op, free_all } },
+    { "qmem_iterate", "array loop", MICRO_SIZE_MAX,
+      { nothing, qmem_iterate_op, nothing },
+      { nothing, array_iterate_op, nothing } },
+    { "qmem_append_n", "qmem_append loop", 1000000,
+      { nothing, qmem_append_n_op, qmem_free_all },
+      { nothing, qmem_append_loop_op, qmem_free_all } },
+    { "qmem_lessen", "realloc to half", MICRO_SIZE_MAX,
+      { qmem_dup_prepare, qmem_lessen_op, qmem_free_all },
+      { array_dup_prepare, array_lessen_op, free_all } },
+    { "qmem_duplicate", "malloc and memcpy", MICRO_SIZE_MAX,
+      { nothing, qmem_duplicate_op, qmem_free_all },
+      { nothing, array_duplicate_op, free_all } },
+    { "qmem_vector_append", "array append, realloc doubling", MICRO_SIZE_MAX,
+      { nothing, qmem_vector_append_op, qmem_free_all },
+      { nothing, array_append_op, free_all } },
+    { "qmem_vector_at", "block-list iterator", MICRO_SIZE_MAX,
+      { nothing, qmem_vector_at_op, nothing },
+      { nothing, qmem_iterate_op, nothing } },
+    { "qmem_list_at", "array index", MICRO_SIZE_MAX,
+      { nothing, qmem_list_at_op, nothing },
+      { nothing, array_at_op, nothing } },
+    { "qstr_create", "malloc and memcpy", MICRO_KEYS_MAX,
+      { strs_prepare, qstr_create_op, qstrs_free },
+      { strs_prepare, cstr_create_op, cstrs_free } },
+    { "qstr_append", "char buffer, realloc doubling", MICRO_KEYS_MAX,
+      { nothing, qstr_append_op, qstr_free_all },
+      { nothing, cstr_append_op, free_all } },
+    { "qstr_append_cstr_n", "qstr_push loop", 1000000,
+      { nothing, qstr_append_cstr_n_op, qstr_free_all },
+      { nothing, qstr_push_loop_op, qstr_free_all } },
+    { "qstr_sub", "malloc and memcpy", MICRO_SIZE_MAX,
+      { nothing, qstr_sub_op, nothing },
+      { nothing, cstr_sub_op, nothing } },
+    { "qstr_find_char", "memchr", MICRO_SIZE_MAX,
+      { nothing, qstr_find_char_op, nothing },
+      { nothing, memchr_op, nothing } },
+    { "qstr_find_cstr", "strstr", MICRO_SIZE_MAX,
+      { nothing, qstr_find_cstr_op, nothing },
+      { nothing, strstr_op, nothing } },
+    { "qstr_find_char_old", "per-character iterator loop", 1000000,
+      { nothing, qstr_find_char_op, nothing },
+      { nothing, old_find_char_op, nothing } },
+    { "qstr_find_cstr_old", "naive match by iterators", 1000000,
+      { nothing, qstr_find_cstr_op, nothing },
+      { nothing, old_find_cstr_op, nothing } },
+    { "qstr_comp", "strcmp", MICRO_SIZE_MAX,
+      { nothing, qstr_comp_op, nothing },
+      { nothing, strcmp_op, nothing } },
+    { "qstr_equal_prefix", "per-character compare", MICRO_NAMES_MAX,
+      { nothing, qstr_equal_prefix_op, nothing },
+      { nothing, old_equal_prefix_op, nothing } },
+    { "qcmap_find_prefix", "open addressing table", MICRO_NAMES_MAX,
+      { nothing, qcmap_find_prefix_op, nothing },
+      { nothing, ref_find_prefix_op, nothing } },
+    { "qstr_fmt_int64", "snprintf %lld", 1000000,
+      { nothing, qstr_fmt_int64_op, nothing },
+      { nothing, snprintf_int64_op, nothing } },
+    { "qstr_assign_double", "snprintf %.17g", 1000000,
+      { nothing, qstr_assign_double_op, nothing },
+      { nothing, snprintf_double_op, nothing } },
+    { "qslab_variable", "qalloc_tag and qfree", MICRO_VARS_MAX,
+      { ptrs_prepare, qslab_variable_op, free_all },
+      { ptrs_prepare, qalloc_variable_op, free_all } },
+    { "qslab_expr", "qalloc_tag and qfree", MICRO_EXPRS_MAX,
+      { ptrs_prepare, qslab_expr_op, free_all },
+      { ptrs_prepare, qalloc_expr_op, free_all } },
+    { "backend_malloc", "malloc and free", 1000000,
+      { malloc_backend_prepare, backend_pairs_op, nothing },
+      { nothing, malloc_pairs_op, nothing } },
+    { "backend_arena", "malloc and free", 1000000,
+      { arena_backend_prepare, backend_pairs_op, arena_backend_cleanup },
+      { nothing, malloc_pairs_op, nothing } },
+    { "backend_arena_shared", "malloc and free", 1000000,
+      { shared_arena_backend_prepare, backend_pairs_op, arena_backend_cleanup },
+      { nothing, malloc_pairs_op, nothing } },
+    { "backend_capped", "malloc and free", 1000000,
+      { capped_backend_prepare, backend_pairs_op, nothing },
+      { nothing, malloc_pairs_op, nothing } },
+    { "qmap_add", "open addressing table", 100000,
+      { nothing, qmap_add_op, qmap_free_all },
+      { nothing, ref_add_op, ref_free_all } },
+    { "qmap_fetch", "open addressing table", 100000,
+      { nothing, qmap_fetch_op, nothing },
+      { nothing, ref_fetch_op, nothing } },
+    { "qmap_delete_item", "open addressing table", 100000,
+      { qmap_dup_prepare, qmap_delete_op, qmap_free_all },
+      { ref_dup_prepare, ref_delete_op, ref_free_all } },
+    { "qmap_duplicate", "open addressing table", 100000,
+      { nothing, qmap_duplicate_op, qmap_free_all },
+      { nothing, ref_duplicate_op, ref_free_all } },
+};
+
+#define MICRO_CASES (sizeof(micro_cases) / sizeof(micro_cases[0]))
+
+static double
+micro_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Inputs of every case at size n. The keys are made once for the
+ * largest size and shared.
+ */
+static char  **micro_ckeys;
+static qstr_t *micro_keys;
+static size_t  micro_nkeys;
+
+static void
+micro_env_setup(struct micro_env *env, size_t n, bool with_map, bool with_names)
+{
+    size_t nkeys = n < MICRO_KEYS_MAX ? n : MICRO_KEYS_MAX;
+
+    memset(env, 0, sizeof(*env));
+    env->n = n;
+    env->batch = n >= MICRO_BATCH_ELEMS ? 1 : MICRO_BATCH_ELEMS / n;
+    for (; micro_nkeys < nkeys; ++micro_nkeys) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "key%zu", micro_nkeys);
+        micro_ckeys[micro_nkeys] = ref_strdup(buf);
+        micro_keys[micro_nkeys] = qstr_create(QSTR_INIT_BYCSTR, buf);
+    }
+    env->ckeys = micro_ckeys;
+    env->keys = micro_keys;
+
+    /* "abcab#" is found only at the very end */
+    env->ctext = malloc(n + 1);
+    for (size_t i = 0; i < n; ++i) {
+        env->ctext[i] = "abc"[i % 3];
+    }
+    if (n >= 6) {
+        memcpy(env->ctext + n - 6, "abcab#", 6);
+    }
+    env->ctext[n] = '\0';
+    env->cother = ref_strdup(env->ctext);
+    env->cother[n - 1] = '$';
+    env->text = qstr_create(QSTR_INIT_BYCSTR, env->ctext);
+    env->other = qstr_create(QSTR_INIT_BYCSTR, env->cother);
+
+    env->array = malloc(n * sizeof(int));
+    env->fixed = qmem_create(int);
+    env->vector = qmem_create_vector(int);
+    for (size_t i = 0; i < n; ++i) {
+        env->array[i] = (int)i;
+        qmem_append(env->fixed, (int)i, int);
+        qmem_append(env->vector, (int)i, int);
+    }
+    if (with_map) {
+        env->map = qmap_build(env);
+        env->ref = ref_map_build(env);
+    }
+    if (with_names) {
+        /* As many buckets as the interpreter gives its variables */
+        env->cnames = malloc(n * sizeof(char *));
+        env->names = malloc(n * sizeof(qstr_t));
+        env->queries = malloc(n * sizeof(qstr_t));
+        env->vars = qcmap_create(int);
+        env->refvars = ref_map_create(n);
+        for (size_t i = 0; i < n; ++i) {
+            char buf[48];
+            snprintf(buf, sizeof(buf), "sensor_reading_calibrated_%06zu", i);
+            env->cnames[i] = ref_strdup(buf);
+            env->names[i] = qstr_create(QSTR_INIT_BYCSTR, buf);
+            env->queries[i] = qstr_create(QSTR_INIT_BYCSTR, buf);
+            qcmap_add(env->vars, env->names[i], (int)i, int);
+            ref_map_add(env->refvars, buf, (int)i);
+        }
+    }
+    env->inst = malloc(env->batch * sizeof(void *));
+}
+
+static void
+micro_env_teardown(struct micro_env *env)
+{
+    free(env->ctext);
+    free(env->cother);
+    qstr_free(env->text);
+    qstr_free(env->other);
+    free(env->array);
+    qmem_free(env->fixed);
+    qmem_free(env->vector);
+    if (env->vars != NULL) {
+        for (size_t i = 0; i < env->n; ++i) {
+            free(env->cnames[i]);
+            qstr_free(env->names[i]);
+            qstr_free(env->queries[i]);
+        }
+        free(env->cnames);
+        free(env->names);
+        free(env->queries);
+        qcmap_free(env->vars);
+        ref_map_free(env->refvars);
+    }
+    if (env->map != NULL) {
+        qmap_free(env->map);
+        ref_map_free(env->ref);
+    }
+    free(env->inst);
+}
+
+static int
+micro_double_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Time impl at the size of env, giving ns per element.
+ */
+static void
+micro_measure(struct micro_env *env, const struct micro_impl *impl, double min_time,
+              double *median, double *p99, size_t *samples)
+{
+    static double times[MICRO_MAX_SAMPLES];
+    double        spent = 0;
+    size_t        k = 0;
+
+    for (int i = 0; i < MICRO_WARMUP + MICRO_MAX_SAMPLES; ++i) {
+        impl->prepare(env);
+        double t0 = micro_now();
+        impl->op(env);
+        double t = micro_now() - t0;
+        impl->cleanup(env);
+        if (i < MICRO_WARMUP) {
+            continue;
+        }
+        times[k++] = t * 1e9 / ((double)env->n * env->batch);
+        spent += t;
+        if (k >= MICRO_MIN_SAMPLES && spent >= min_time) {
+            break;
+        }
+    }
+    qsort(times, k, sizeof(double), micro_double_cmp);
+    *median = k % 2 ? times[k / 2] : (times[k / 2 - 1] + times[k / 2]) / 2;
+    /* Nearest rank */
+    *p99 = times[(size_t)(0.99 * k + 0.999999) - 1];
+    *samples = k;
+}
+
+/*
+ * Lookup throughput on several threads. Each thread goes through the
+ * keys from a different start, so they do not walk the same chains in
+ * step.
+ */
+struct micro_scale {
+    qcmap_t           cmap;
+    qmap_t             map;
+    pthread_mutex_t   lock;	/* of map */
+    bool            locked;	/* map under lock instead of cmap */
+    qstr_t           *keys;
+    pthread_barrier_t   go;
+    volatile size_t   sink;
+};
+
+struct micro_scale_worker {
+    struct micro_scale *scale;
+    size_t              start;
+    size_t                sum;	/* keeps results alive */
+    double         began, ended;
+    pthread_t          thread;
+};
+
+static void *
+micro_scale_worker(void *arg)
+{
+    struct micro_scale_worker *w = arg;
+    struct micro_scale        *sc = w->scale;
+    size_t                     sum = 0, k = w->start;
+
+    pthread_barrier_wait(&sc->go);
+    w->began = micro_now();
+    for (size_t i = 0; i < MICRO_SCALE_LOOKUPS; ++i) {
+        if (sc->locked) {
+            pthread_mutex_lock(&sc->lock);
+            sum += qmap_fetch(sc->map, sc->keys[k], int);
+            pthread_mutex_unlock(&sc->lock);
+        } else {
+            sum += qcmap_fetch(sc->cmap, sc->keys[k], int);
+        }
+        k = k + 1 < MICRO_SCALE_KEYS ? k + 1 : 0;
+    }
+    w->ended = micro_now();
+    w->sum = sum;
+    qmem_pool_trim(0);
+    return NULL;
+}
+
+/*
+ * The median over MICRO_SCALE_SAMPLES of lookups per second. A sample
+ * lasts from the first thread starting its lookups to the last one
+ * done, so creating and joining the threads is not timed.
+ */
+static double
+micro_scale_measure(struct micro_scale *sc, unsigned threads, bool locked)
+{
+    struct micro_scale_worker w[MICRO_THREADS_MAX];
+    double rates[MICRO_SCALE_SAMPLES];
+
+    sc->locked = locked;
+    for (int s = 0; s < MICRO_SCALE_SAMPLES; ++s) {
+        double began = 0, ended = 0;
+
+        pthread_barrier_init(&sc->go, NULL, threads);
+        for (unsigned i = 0; i < threads; ++i) {
+            w[i].scale = sc;
+            w[i].start = (size_t)i * MICRO_SCALE_KEYS / threads;
+            if (pthread_create(&w[i].thread, NULL, micro_scale_worker, &w[i]) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            pthread_join(w[i].thread, NULL);
+            sc->sink += w[i].sum;
+            if (i == 0 || w[i].began < began) {
+                began = w[i].began;
+            }
+            if (w[i].ended > ended) {
+                ended = w[i].ended;
+            }
+        }
+        pthread_barrier_destroy(&sc->go);
+        rates[s] = (double)threads * MICRO_SCALE_LOOKUPS / (ended - began);
+    }
+    qsort(rates, MICRO_SCALE_SAMPLES, sizeof(double), micro_double_cmp);
+    return rates[MICRO_SCALE_SAMPLES / 2];
+}
+
+static void
+micro_scale(unsigned max_threads)
+{
+    struct micro_scale sc;
+    double base = 0;
+
+    sc.cmap = qcmap_create(int);
+    sc.map = qmap_create(int);
+    pthread_mutex_init(&sc.lock, NULL);
+    sc.keys = malloc(MICRO_SCALE_KEYS * sizeof(qstr_t));
+    for (size_t i = 0; i < MICRO_SCALE_KEYS; ++i) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "key%zu", i);
+        sc.keys[i] = qstr_create(QSTR_INIT_BYCSTR, buf);
+        qcmap_add(sc.cmap, sc.keys[i], (int)i, int);
+        qmap_add(sc.map, sc.keys[i], (int)i, int);
+    }
+
+    printf("  \"threads\": [\n");
+    for (unsigned t = 1; t <= max_threads; t *= 2) {
+        double rate = micro_scale_measure(&sc, t, false);
+        double ref = micro_scale_measure(&sc, t, true);
+
+        if (t == 1) {
+            base = rate;
+        }
+        printf("%s    { \"name\": \"qcmap_find\", \"threads\": %u, "
+               "\"lookups_per_sec\": %.0f, \"scaling\": %.2f,\n"
+               "      \"ref\": \"qmap_t under one mutex\", \"ref_lookups_per_sec\": %.0f, "
+               "\"ratio\": %.2f }",
+               t == 1 ? "" : ",\n", t, rate, rate / base, ref, ref > 0 ? rate / ref : 0.0);
+        fflush(stdout);
+    }
+    printf("\n  ]");
+
+    for (size_t i = 0; i < MICRO_SCALE_KEYS; ++i) {
+        qstr_free(sc.keys[i]);
+    }
+    free(sc.keys);
+    pthread_mutex_destroy(&sc.lock);
+    qmap_free(sc.map);
+    qcmap_free(sc.cmap);
+}
+
+/*
+ * Bytes of heap in use, -1 where the C library does not tell.
+ */
+static long long
+micro_heap_bytes(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+    return (long long)(mi.uordblks + mi.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Heap taken by count objects of size bytes each, from one slab per
+ * size or from qalloc_tag.
+ */
+static long long
+micro_heap_taken(const size_t *sizes, int kinds, size_t count, bool slab)
+{
+    void    **p = malloc(kinds * count * sizeof(void *));
+    qslab_t   slabs[2];
+    long long before = micro_heap_bytes(), after;
+
+    for (int k = 0; k < kinds; ++k) {
+        slabs[k] = slab ? qslab_create_sized(sizes[k], QALLOC_OBJECT) : NULL;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        for (int k = 0; k < kinds; ++k) {
+            p[kinds * i + k] = slab ? qslab_alloc(slabs[k])
+                                    : qalloc_tag(sizes[k], QALLOC_OBJECT);
+        }
+    }
+    after = micro_heap_bytes();
+    for (size_t i = 0; i < count; ++i) {
+        for (int k = 0; k < kinds; ++k) {
+            if (!slab) {
+                qfree(p[kinds * i + k], sizes[k], QALLOC_OBJECT);
+            }
+        }
+    }
+    for (int k = 0; k < kinds && slab; ++k) {
+        qslab_destroy(slabs[k]);
+    }
+    free(p);
+    return before < 0 ? -1 : after - before;
+}
+
+static void
+micro_slab_memory(void)
+{
+    static const size_t var_sizes[] = {
+        sizeof(struct mvar_struct), sizeof(struct mobject_struct)
+    };
+    static const size_t expr_sizes[] = { sizeof(struct mao_expr_struct) };
+    const struct {
+        const char   *name;
+        const size_t *sizes;
+        int           kinds;
+        size_t        count;
+    } kinds[] = {
+        { "variables", var_sizes, 2, MICRO_VARS_MAX },
+        { "expr_nodes", expr_sizes, 1, MICRO_EXPRS_MAX },
+    };
+
+    printf("  \"memory\": [\n");
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); ++i) {
+        long long slab = micro_heap_taken(kinds[i].sizes, kinds[i].kinds, kinds[i].count, true);
+        long long ref = micro_heap_taken(kinds[i].sizes, kinds[i].kinds, kinds[i].count, false);
+
+        printf("%s    { \"name\": \"qslab_%s\", \"n\": %zu, \"bytes\": %lld, "
+               "\"ref\": \"qalloc_tag\", \"ref_bytes\": %lld, \"ratio\": %.2f }",
+               i == 0 ? "" : ",\n", kinds[i].name, kinds[i].count, slab, ref,
+               ref > 0 ? (double)slab / ref : 0.0);
+        fflush(stdout);
+    }
+    printf("\n  ]");
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--max=N] [--min-time=SECONDS] [--threads=N] [--only=NAME]\n"
+            "--only=qcmap_find runs only the lookups on threads, "
+            "--threads=0 leaves them out\n", name);
+    exit(1);
+}
+
+int main(int argc, const char * argv[])
+{
+    size_t      max = MICRO_SIZE_MAX;
+    double      min_time = 0.2;
+    unsigned    threads = MICRO_THREADS_MAX;
+    const char *only = NULL;
+    bool        first = true;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--max=", 6)) {
+            max = strtoull(argv[i] + 6, NULL, 10);
+        } else if (!strncmp(argv[i], "--min-time=", 11)) {
+            min_time = atof(argv[i] + 11);
+        } else if (!strncmp(argv[i], "--threads=", 10)) {
+            threads = (unsigned)atoi(argv[i] + 10);
+        } else if (!strncmp(argv[i], "--only=", 7)) {
+            only = argv[i] + 7;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (max < 10 || min_time < 0 || threads > MICRO_THREADS_MAX) {
+        usage(argv[0]);
+    }
+    micro_ckeys = malloc(MICRO_KEYS_MAX * sizeof(char *));
+    micro_keys = malloc(MICRO_KEYS_MAX * sizeof(qstr_t));
+
+    printf("{ \"revision\": \"%s\", \"unit\": \"ns per element\", \"min_time\": %g,\n"
+           "  \"results\": [\n", MAO_REVISION, min_time);
+    for (size_t n = 10; n <= max; n *= 10) {
+        struct micro_env env;
+        bool with_map = false, with_names = false, any = false;
+
+        for (size_t c = 0; c < MICRO_CASES; ++c) {
+            if (n <= micro_cases[c].max && (only == NULL || !strcmp(only, micro_cases[c].name))) {
+                any = true;
+                with_map |= !strncmp(micro_cases[c].name, "qmap", 4);
+                with_names |= strstr(micro_cases[c].name, "prefix") != NULL;
+            }
+        }
+        if (!any) {
+            continue;
+        }
+        micro_env_setup(&env, n, with_map, with_names);
+        for (size_t c = 0; c < MICRO_CASES; ++c) {
+            const struct micro_case *mc = &micro_cases[c];
+            double m1, p1, m2, p2;
+            size_t s1, s2;
+
+            if (n > mc->max || (only != NULL && strcmp(only, mc->name))) {
+                continue;
+            }
+            micro_measure(&env, &mc->impl, min_time, &m1, &p1, &s1);
+            micro_measure(&env, &mc->base, min_time, &m2, &p2, &s2);
+            printf("%s    { \"name\": \"%s\", \"n\": %zu, "
+                   "\"median\": %.3f, \"p99\": %.3f, \"samples\": %zu,\n"
+                   "      \"ref\": \"%s\", \"ref_median\": %.3f, \"ref_p99\": %.3f, "
+                   "\"ref_samples\": %zu, \"ratio\": %.2f }",
+                   first ? "" : ",\n", mc->name, n, m1, p1, s1,
+                   mc->ref, m2, p2, s2, m2 > 0 ? m1 / m2 : 0.0);
+            fflush(stdout);
+            first = false;
+        }
+        micro_env_teardown(&env);
+    }
+    printf("\n  ]");
+    if (only == NULL || !strncmp(only, "qslab", 5)) {
+        printf(",\n");
+        micro_slab_memory();
+    }
+    if (threads > 0 && (only == NULL || !strcmp(only, "qcmap_find"))) {
+        printf(",\n");
+        micro_scale(threads);
+    }
+    printf("\n}\n");
+    return 0;
+}
@@ -0,0 +1,573 @@
+/*
+ * parallel.c
+ *
+ * Concurrency checks of Mao. Each case runs the same work on several
+ * threads at once and checks every result it can, so a lost update or
+ * a read of a half-built node shows up as a wrong value, not only as
+ * a crash. Run it under -fsanitize=thread to catch the races that
+ * happen to give right values.
+ *
+ *   qcmap          threads insert, find and delete keys of their own
+ *                  in one qcmap_t, while looking up keys which never
+ *                  change and the keys of the other threads.
+ *   interpreters   threads run a set of scripts through mao_run, each
+ *                  in a mao_state of its own, with and without
+ *                  --pipeline. Some scripts stop on a fatal error, so
+ *                  mao_fail jumps out of them. The output, errors and
+ *                  status of every run must be those of the same script
+ *                  run alone, before any thread is started.
+ *   oom            the same scripts, with the n-th allocation of mao_run
+ *                  failing, for every n or n spread over a long script.
+ *                  The run must stop with an out of memory error, and
+ *                  leave its containers whole: the state is destroyed,
+ *                  and the next run of the thread, on the pooled blocks
+ *                  of the failed one, must give the output of the run
+ *                  alone. Run it under -fsanitize=address too, to catch
+ *                  what is used after being freed.
+ *
+ * The exit status is 1 if any case failed.
+ */
+
+/* For pthread_barrier_t, fmemopen and open_memstream, which -std=c11
+   alone hides */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "infra/qcmap.h"
+#include "infra/qmemory.h"
+#include "infra/qwriter.h"
+#include "error.h"
+#include "mao.h"
+#include "workload.h"
+
+#define PAR_THREADS_MAX     64
+#define PAR_STABLE_KEYS     1000	/* never deleted */
+#define PAR_OWN_KEYS        500	/* of each thread, per round */
+#define PAR_OUT_LEN         4096
+#define PAR_OOM_RUNS        200	/* failing runs of a script, at most */
+
+/* Short scripts with errors, fatal or not, and generated ones without */
+static const char *const par_texts[] = {
+    "int a;\na = 3;\nprint(a);\nprint(a / 0);\nprint(5);\n",
+    "int a;\nprint(a)\n",
+    "int a, b;\na = 1 +;\n",
+    "int a;\na = (1 + 2;\nprint(a);\n",
+    "int a; int a;\n a = 2 $ 3;\nprint(a);\nprint(\"hi\\n\");\n",
+    "int a;\na = 3;\nprint(a);\nb = 4;\nprint(5);\n",
+    "int 3;\n",
+    "double x;\nint i;\nx = 1.5;\ni = 7;\nprint(x * i - 2 / 3);\nprint(i / 2);\n",
+};
+#define PAR_TEXTS       (sizeof(par_texts) / sizeof(par_texts[0]))
+#define PAR_GENERATED   4
+#define PAR_SCRIPTS     (PAR_TEXTS + PAR_GENERATED)
+
+struct par_qcmap {
+    qcmap_t          map;
+    qstr_t       *stable;	/* shared, caches filled by whoever comes first */
+    unsigned     threads;
+    unsigned      rounds;
+    pthread_barrier_t go;
+    atomic_uint   errors;
+};
+
+struct par_worker {
+    void             *shared;	/* the struct of the case */
+    unsigned              id;
+    pthread_t         thread;
+};
+
+static uint64_t
+par_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void
+par_error(atomic_uint *errors, const char *what, const char *key)
+{
+    /* Report the first few only, a broken map fails everywhere */
+    if (atomic_fetch_add(errors, 1) < 10) {
+        fprintf(stderr, "parallel: %s '%s'\n", what, key);
+    }
+}
+
+/*
+ * Key i of thread id maps to id * PAR_OWN_KEYS + i, and stable key i
+ * to i, so any value found can be checked.
+ */
+static qstr_t
+par_own_key(unsigned id, size_t i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "t%u_%zu", id, i);
+    return qstr_create(QSTR_INIT_BYCSTR, buf);
+}
+
+static void
+par_check_stable(struct par_qcmap *p, uint64_t *rng)
+{
+    size_t  i = par_random(rng) % PAR_STABLE_KEYS;
+    size_t *v = qcmap_find(p->map, p->stable[i]);
+
+    if (v == NULL || *v != i) {
+        par_error(&p->errors, "stable key lost or wrong", qstr_data(p->stable[i]));
+    }
+    /* Its UTF-8 state is cached by whoever asks first, like its hash */
+    if (!qstr_is_ascii(p->stable[i])) {
+        par_error(&p->errors, "stable key not ASCII", qstr_data(p->stable[i]));
+    }
+}
+
+static void *
+par_qcmap_worker(void *arg)
+{
+    struct par_worker *w = arg;
+    struct par_qcmap  *p = w->shared;
+    uint64_t         rng = 0x9e3779b97f4a7c15ull * (w->id + 1);
+    qstr_t          keys[PAR_OWN_KEYS];
+
+    for (size_t i = 0; i < PAR_OWN_KEYS; ++i) {
+        keys[i] = par_own_key(w->id, i);
+    }
+    pthread_barrier_wait(&p->go);
+    for (unsigned r = 0; r < p->rounds; ++r) {
+        for (size_t i = 0; i < PAR_OWN_KEYS; ++i) {
+            size_t v = w->id * PAR_OWN_KEYS + i;
+            if (!qcmap_insert(p->map, keys[i], &v)) {
+                par_error(&p->errors, "insert of a new key refused", qstr_data(keys[i]));
+            }
+            par_check_stable(p, &rng);
+        }
+        for (size_t i = 0; i < PAR_OWN_KEYS; ++i) {
+            size_t  v = w->id * PAR_OWN_KEYS + i;
+            size_t *found = qcmap_find(p->map, keys[i]);
+            if (found == NULL || *found != v) {
+                par_error(&p->errors, "own key lost or wrong", qstr_data(keys[i]));
+            }
+            if (qcmap_insert(p->map, keys[i], &v)) {
+                par_error(&p->errors, "insert of a present key accepted", qstr_data(keys[i]));
+            }
+        }
+
+        /* The keys of another thread come and go, but are never wrong */
+        for (size_t i = 0; i < PAR_OWN_KEYS; ++i) {
+            unsigned other = (unsigned)(par_random(&rng) % p->threads);
+            qstr_t   key = par_own_key(other, i);
+            size_t  *found = qcmap_find(p->map, key);
+            if (found != NULL && *found != other * PAR_OWN_KEYS + i) {
+                par_error(&p->errors, "key of another thread wrong", qstr_data(key));
+            }
+            qstr_free(key);
+        }
+
+        for (size_t i = 0; i < PAR_OWN_KEYS; ++i) {
+            qcmap_delete_item(p->map, keys[i]);
+            if (qcmap_find(p->map, keys[i]) != NULL) {
+                par_error(&p->errors, "deleted key still found", qstr_data(keys[i]));
+            }
+            par_check_stable(p, &rng);
+        }
+    }
+    for (size_t i = 0; i < PAR_OWN_KEYS; ++i) {
+        qstr_free(keys[i]);
+    }
+    qmem_pool_trim(0);
+    return NULL;
+}
+
+static unsigned
+par_qcmap(unsigned threads, unsigned rounds)
+{
+    struct par_qcmap  p;
+    struct par_worker w[PAR_THREADS_MAX];
+    unsigned          errors;
+
+    /* Few buckets, so that threads meet on the same chains */
+    p.map = qcmap_create_sized(sizeof(size_t), 64);
+    p.stable = malloc(PAR_STABLE_KEYS * sizeof(qstr_t));
+    p.threads = threads;
+    p.rounds = rounds;
+    pthread_barrier_init(&p.go, NULL, threads);
+    atomic_init(&p.errors, 0);
+    for (size_t i = 0; i < PAR_STABLE_KEYS; ++i) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "stable%zu", i);
+        p.stable[i] = qstr_create(QSTR_INIT_BYCSTR, buf);
+        qcmap_insert(p.map, p.stable[i], &i);
+        /* A fresh copy, so the readers race to fill its caches */
+        qstr_free(p.stable[i]);
+        p.stable[i] = qstr_create(QSTR_INIT_BYCSTR, buf);
+    }
+
+    for (unsigned t = 0; t < threads; ++t) {
+        w[t].shared = &p;
+        w[t].id = t;
+        if (pthread_create(&w[t].thread, NULL, par_qcmap_worker, &w[t]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (unsigned t = 0; t < threads; ++t) {
+        pthread_join(w[t].thread, NULL);
+    }
+
+    /* No lookup is running any more */
+    qcmap_reclaim(p.map);
+    for (size_t i = 0; i < PAR_STABLE_KEYS; ++i) {
+        size_t *v = qcmap_find(p.map, p.stable[i]);
+        if (v == NULL || *v != i) {
+            par_error(&p.errors, "stable key lost at the end", qstr_data(p.stable[i]));
+        }
+        qstr_free(p.stable[i]);
+    }
+    for (unsigned t = 0; t < threads; ++t) {
+        for (size_t i = 0; i < PAR_OWN_KEYS; ++i) {
+            qstr_t key = par_own_key(t, i);
+            if (qcmap_find(p.map, key) != NULL) {
+                par_error(&p.errors, "deleted key found at the end", qstr_data(key));
+            }
+            qstr_free(key);
+        }
+    }
+
+    errors = atomic_load(&p.errors);
+    pthread_barrier_destroy(&p.go);
+    free(p.stable);
+    qcmap_free(p.map);
+    return errors;
+}
+
+/*
+ * All memory comes from this backend, which fails allocation
+ * par_fail_at of the thread, counted from when it is set, 0 for none.
+ */
+static _Thread_local unsigned long par_allocs, par_fail_at;
+static _Thread_local bool          par_failed;
+
+static bool
+par_fail_now(void)
+{
+    if (++par_allocs == par_fail_at) {
+        par_failed = true;
+        return true;
+    }
+    return false;
+}
+
+static void *
+par_oom_alloc(void *ctx, size_t size, size_t align)
+{
+    return par_fail_now() ? NULL : qalloc_malloc_backend.alloc(ctx, size, align);
+}
+
+static void *
+par_oom_realloc(void *ctx, void *src, size_t src_size, size_t dst_size)
+{
+    return par_fail_now() ? NULL :
+           qalloc_malloc_backend.realloc(ctx, src, src_size, dst_size);
+}
+
+static void
+par_oom_free(void *ctx, void *src, size_t size)
+{
+    qalloc_malloc_backend.free(ctx, src, size);
+}
+
+static const qallocator_t par_oom_backend = {
+    par_oom_alloc, par_oom_realloc, par_oom_free, NULL, "parallel"
+};
+
+/* The result of one run of a script */
+struct par_result {
+    char          *out;
+    size_t      outlen;
+    char          *err;
+    size_t      errlen;
+    int         status;
+    unsigned long allocs;	/* made by mao_run */
+    bool        failed;	/* one of them on purpose */
+};
+
+struct par_script {
+    char             *text;
+    size_t             len;
+    struct par_result want;	/* of the run alone */
+};
+
+struct par_interp {
+    struct par_script scripts[PAR_SCRIPTS];
+    unsigned         threads;
+    unsigned          rounds;
+    pthread_barrier_t go;
+    atomic_uint       errors;
+};
+
+/* Run s, failing allocation fail_at of mao_run, or none if 0 */
+static void
+par_run_script(const struct par_script *s, bool pipeline, unsigned long fail_at,
+               struct par_result *r)
+{
+    FILE     *in = fmemopen(s->text, s->len, "r");
+    FILE     *err = open_memstream(&r->err, &r->errlen);
+    qwriter_t out = qwriter_create_sized(QWRITER_MEMORY, PAR_OUT_LEN);
+    mao_state st;
+
+    if (in == NULL || err == NULL) {
+        perror("parallel");
+        exit(1);
+    }
+    st = mao_state_create(err);
+    par_allocs = 0;
+    par_fail_at = fail_at;
+    par_failed = false;
+    r->status = mao_run(st, in, out, pipeline);
+    par_fail_at = 0;
+    r->allocs = par_allocs;
+    r->failed = par_failed;
+    mao_state_destroy(st);
+    fclose(in);
+    fclose(err);
+    r->outlen = out->len;
+    r->out = malloc(out->len + 1);
+    memcpy(r->out, out->buf, out->len);
+    qwriter_free(out);
+}
+
+static void
+par_result_free(struct par_result *r)
+{
+    free(r->out);
+    free(r->err);
+}
+
+static void
+par_check_result(atomic_uint *errors, const struct par_script *s, size_t i,
+                 bool pipeline, const struct par_result *got)
+{
+    char what[64];
+
+    snprintf(what, sizeof(what), "script %zu%s", i, pipeline ? " pipelined" : "");
+    if (got->status != s->want.status) {
+        par_error(errors, "status differs from the run alone of", what);
+    }
+    if (got->outlen != s->want.outlen || memcmp(got->out, s->want.out, got->outlen) != 0) {
+        par_error(errors, "output differs from the run alone of", what);
+    }
+    if (got->errlen != s->want.errlen || memcmp(got->err, s->want.err, got->errlen) != 0) {
+        par_error(errors, "errors differ from the run alone of", what);
+    }
+}
+
+static void *
+par_interp_worker(void *arg)
+{
+    struct par_worker *w = arg;
+    struct par_interp *p = w->shared;
+
+    pthread_barrier_wait(&p->go);
+    for (unsigned r = 0; r < p->rounds; ++r) {
+        for (size_t k = 0; k < 2 * PAR_SCRIPTS; ++k) {
+            /* Each thread starts elsewhere, so that all scripts overlap */
+            size_t                   i = (w->id + k / 2) % PAR_SCRIPTS;
+            const struct par_script *s = &p->scripts[i];
+            struct par_result        got;
+
+            par_run_script(s, k % 2 != 0, 0, &got);
+            par_check_result(&p->errors, s, i, k % 2 != 0, &got);
+            par_result_free(&got);
+        }
+    }
+    qmem_pool_trim(0);
+    return NULL;
+}
+
+static void
+par_scripts_create(struct par_script *scripts)
+{
+    for (size_t i = 0; i < PAR_SCRIPTS; ++i) {
+        struct par_script *s = &scripts[i];
+
+        if (i < PAR_TEXTS) {
+            s->len = strlen(par_texts[i]);
+            s->text = malloc(s->len + 1);
+            memcpy(s->text, par_texts[i], s->len + 1);
+        } else {
+            /* Big enough for the threads to meet in the middle of it */
+            struct workload wl = { "parallel", 50, 300, 1, 3, 30, 10, 30, i };
+            FILE *fp = open_memstream(&s->text, &s->len);
+            workload_write(fp, &wl);
+            fclose(fp);
+        }
+        par_run_script(s, false, 0, &s->want);
+    }
+}
+
+static void
+par_scripts_free(struct par_script *scripts)
+{
+    for (size_t i = 0; i < PAR_SCRIPTS; ++i) {
+        par_result_free(&scripts[i].want);
+        free(scripts[i].text);
+    }
+}
+
+static unsigned
+par_run_workers(struct par_interp *p, unsigned threads, void *(*fn)(void *))
+{
+    struct par_worker w[PAR_THREADS_MAX];
+
+    pthread_barrier_init(&p->go, NULL, threads);
+    atomic_init(&p->errors, 0);
+    for (unsigned t = 0; t < threads; ++t) {
+        w[t].shared = p;
+        w[t].id = t;
+        if (pthread_create(&w[t].thread, NULL, fn, &w[t]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (unsigned t = 0; t < threads; ++t) {
+        pthread_join(w[t].thread, NULL);
+    }
+    pthread_barrier_destroy(&p->go);
+    return atomic_load(&p->errors);
+}
+
+static unsigned
+par_interpreters(unsigned threads, unsigned rounds)
+{
+    struct par_interp p;
+    unsigned          errors;
+
+    par_scripts_create(p.scripts);
+    p.rounds = rounds;
+    errors = par_run_workers(&p, threads, par_interp_worker);
+    par_scripts_free(p.scripts);
+    return errors;
+}
+
+/*
+ * Fail each allocation n of script i, or one in step of a long script,
+ * then run it again on what the failed run gave back to the pools.
+ */
+static void
+par_oom_script(struct par_interp *p, unsigned id, size_t i, bool pipeline)
+{
+    const struct par_script *s = &p->scripts[i];
+    struct par_result        got;
+    unsigned long            allocs, step;
+    char                     what[64];
+
+    snprintf(what, sizeof(what), "script %zu%s", i, pipeline ? " pipelined" : "");
+    par_run_script(s, pipeline, 0, &got);
+    allocs = got.allocs;
+    par_result_free(&got);
+    step = allocs / PAR_OOM_RUNS + 1;
+
+    for (unsigned long n = 1 + id % step; n <= allocs; n += step) {
+        par_run_script(s, pipeline, n, &got);
+        if (!got.failed) {
+            /* Fewer allocations this time, as the pools were fuller */
+            par_check_result(&p->errors, s, i, pipeline, &got);
+        } else if (got.status != 1 || strstr(got.err, "out of memory") == NULL) {
+            par_error(&p->errors, "failed allocation not reported by", what);
+        }
+        par_result_free(&got);
+
+        par_run_script(s, pipeline, 0, &got);
+        par_check_result(&p->errors, s, i, pipeline, &got);
+        par_result_free(&got);
+    }
+}
+
+static void *
+par_oom_worker(void *arg)
+{
+    struct par_worker *w = arg;
+    struct par_interp *p = w->shared;
+
+    pthread_barrier_wait(&p->go);
+    /* The runs are many, so each thread takes its share of them */
+    for (size_t k = w->id; k < 2 * PAR_SCRIPTS; k += p->threads) {
+        par_oom_script(p, w->id, k / 2, k % 2 != 0);
+    }
+    qmem_pool_trim(0);
+    return NULL;
+}
+
+static unsigned
+par_oom(unsigned threads)
+{
+    struct par_interp p;
+    unsigned          errors;
+
+    par_scripts_create(p.scripts);
+    p.threads = threads;
+    errors = par_run_workers(&p, threads, par_oom_worker);
+    par_scripts_free(p.scripts);
+    return errors;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--threads=N] [--rounds=N] [--only=NAME]\n", name);
+    exit(1);
+}
+
+int main(int argc, const char * argv[])
+{
+    unsigned    threads = 8;
+    unsigned    rounds = 20;
+    const char *only = NULL;
+    int         failed = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--threads=", 10)) {
+            threads = (unsigned)atoi(argv[i] + 10);
+        } else if (!strncmp(argv[i], "--rounds=", 9)) {
+            rounds = (unsigned)atoi(argv[i] + 9);
+        } else if (!strncmp(argv[i], "--only=", 7)) {
+            only = argv[i] + 7;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (threads == 0 || threads > PAR_THREADS_MAX || rounds == 0) {
+        usage(argv[0]);
+    }
+    /* Fails nothing until a case asks it to */
+    qalloc_set_backend(&par_oom_backend);
+
+    if (only == NULL || !strcmp(only, "qcmap")) {
+        unsigned errors = par_qcmap(threads, rounds);
+        printf("%-14s %u threads, %u rounds: %s\n", "qcmap", threads, rounds,
+               errors == 0 ? "ok" : "FAILED");
+        failed += errors != 0;
+    }
+    if (only == NULL || !strcmp(only, "interpreters")) {
+        unsigned errors = par_interpreters(threads, rounds);
+        printf("%-14s %u threads, %u rounds: %s\n", "interpreters", threads, rounds,
+               errors == 0 ? "ok" : "FAILED");
+        failed += errors != 0;
+    }
+    if (only == NULL || !strcmp(only, "oom")) {
+        unsigned errors = par_oom(threads);
+        printf("%-14s %u threads: %s\n", "oom", threads,
+               errors == 0 ? "ok" : "FAILED");
+        failed += errors != 0;
+    }
+    if (failed != 0) {
+        printf("parallel: %d case(s) failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * workload.c
+ *
+ * Generator of synthetic Mao programs.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include "workload.h"
+
+/*
+ * splitmix64, small and the same on every platform, unlike rand().
+ */
+static uint64_t
+workload_rand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static unsigned
+workload_below(uint64_t *state, unsigned n)
+{
+    return (unsigned)(workload_rand(state) % n);
+}
+
+#define workload_chance(state, pct) (workload_below(state, 100) < (pct))
+
+static void
+workload_operand(FILE *fp, const struct workload *w, uint64_t *state)
+{
+    if (w->decls == 0 || workload_chance(state, w->literal)) {
+        if (workload_below(state, 2)) {
+            fprintf(fp, "%u", workload_below(state, 1000));
+        } else {
+            fprintf(fp, "%u.%u", workload_below(state, 100), workload_below(state, 100));
+        }
+    } else {
+        fprintf(fp, "v%u", workload_below(state, w->decls));
+    }
+}
+
+/*
+ * Division is only ever by a nonzero literal, so no program stops
+ * on a division by zero.
+ */
+static void
+workload_expr(FILE *fp, const struct workload *w, uint64_t *state, unsigned depth)
+{
+    static const char ops[] = "+-*/";
+    unsigned width = w->width > 0 ? w->width : 1;
+    
+    for (unsigned i = 0; i < width; ++i) {
+        if (i > 0) {
+            char op = ops[workload_below(state, 4)];
+            fprintf(fp, " %c ", op);
+            if (op == '/') {
+                fprintf(fp, "%u", 1 + workload_below(state, 9));
+                continue;
+            }
+        }
+        if (depth > 0) {
+            fputc('(', fp);
+            workload_expr(fp, w, state, depth - 1);
+            fputc(')', fp);
+        } else {
+            workload_operand(fp, w, state);
+        }
+    }
+}
+
+/*
+ * Only C style comments are written. The lexer reports every C++ style
+ * comment as a multi-line comment without an end, and the error
+ * messages would be timed along with the lexing.
+ */
+static void
+workload_comment(FILE *fp, const struct workload *w, uint64_t *state)
+{
+    if (workload_chance(state, w->comment)) {
+        if (workload_below(state, 2)) {
+            fprintf(fp, "/* note %u */\n", workload_below(state, 100000));
+        } else {
+            fprintf(fp, "/* block\n   note %u */\n", workload_below(state, 100000));
+        }
+    }
+}
+
+void
+workload_write(FILE *fp, const struct workload *w)
+{
+    static const char *assign_ops[] = { "=", "=", "=", "+=", "-=", "*=" };
+    uint64_t state = w->seed;
+    unsigned per_line = 8;
+    
+    for (unsigned i = 0; i < w->decls; i += per_line) {
+        workload_comment(fp, w, &state);
+        fputs((i / per_line) % 2 ? "double " : "int ", fp);
+        for (unsigned j = i; j < i + per_line && j < w->decls; ++j) {
+            fprintf(fp, j > i ? ", v%u" : "v%u", j);
+        }
+        fputs(";\n", fp);
+    }
+    for (unsigned i = 0; i < w->assigns; ++i) {
+        unsigned target;
+        
+        workload_comment(fp, w, &state);
+        if (w->decls == 0) {
+            /* Nothing to assign to, the value is computed and dropped */
+            workload_expr(fp, w, &state, w->depth);
+            fputs(";\n", fp);
+            continue;
+        }
+        target = workload_below(&state, w->decls);
+        fprintf(fp, "v%u %s ", target, assign_ops[workload_below(&state, 6)]);
+        workload_expr(fp, w, &state, w->depth);
+        fputs(";\n", fp);
+        if (workload_chance(&state, w->print)) {
+            fprintf(fp, "print(v%u);\nprint(\"\\n\");\n", target);
+        }
+    }
+}
+
+int
+workload_set(struct workload *w, const char *key, const char *value)
+{
+    static const struct {
+        const char *key;
+        size_t   offset;
+    } fields[] = {
+        { "decls",   offsetof(struct workload, decls) },
+        { "assigns", offsetof(struct workload, assigns) },
+        { "depth",   offsetof(struct workload, depth) },
+        { "width",   offsetof(struct workload, width) },
+        { "literal", offsetof(struct workload, literal) },
+        { "comment", offsetof(struct workload, comment) },
+        { "print",   offsetof(struct workload, print) },
+    };
+    char *end;
+    
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (end == value || *end != '\0' || errno != 0) {
+        return -1;
+    }
+    if (!strcmp(key, "seed")) {
+        w->seed = n;
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        if (!strcmp(key, fields[i].key)) {
+            if (n > UINT32_MAX) {
+                return -1;
+            }
+            *(unsigned *)((char *)w + fields[i].offset) = (unsigned)n;
+            return 0;
+        }
+    }
+    return -1;
+}
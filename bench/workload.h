@@ -0,0 +1,42 @@
+/*
+ * workload.h
+ *
+ * Synthetic Mao programs for benchmarking. A workload is a block of
+ * declarations followed by assignments, with prints and comments
+ * mixed in, all chosen by a seeded generator so the same parameters
+ * always give the same program.
+ */
+
+#ifndef MAOLANG_WORKLOAD_H_
+#define MAOLANG_WORKLOAD_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct workload {
+    const char   *name;
+    unsigned     decls;	/* variables declared */
+    unsigned   assigns;	/* assignment statements */
+    unsigned     depth;	/* nesting of parentheses in an expression */
+    unsigned     width;	/* operands in each parenthesized group */
+    unsigned   literal;	/* % of operands which are literals */
+    unsigned   comment;	/* % of statements with a comment before */
+    unsigned     print;	/* % of assignments followed by a print */
+    uint64_t      seed;
+};
+
+#define WORKLOAD_DEFAULT \
+    { "custom", 1000, 10000, 1, 3, 30, 10, 10, 1 }
+
+/*
+ * Write the program described by w to fp.
+ */
+void workload_write(FILE *fp, const struct workload *w);
+
+/*
+ * Set the field named by key ("decls", "depth", ...) from value. Gives
+ * 0 on success and -1 for an unknown key or a malformed value.
+ */
+int  workload_set(struct workload *w, const char *key, const char *value);
+
+#endif //MAOLANG_WORKLOAD_H_
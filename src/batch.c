@@ -0,0 +1,289 @@
+/*
+ * batch.c
+ *
+ * Running many scripts on worker threads, see batch.h.
+ */
+
+/* For getline and open_memstream, which -std=c11 alone hides */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "infra/qwriter.h"
+#include "error.h"
+#include "mao.h"
+#include "batch.h"
+
+/* Most scripts print little, the buffer grows for the others */
+#define BATCH_OUT_LEN 4096
+
+struct batch_script {
+    const char   *path;
+    qwriter_t      out;	/* a memory writer */
+    char          *err;	/* from open_memstream */
+    size_t      errlen;
+    int         status;	/* 0, or 1 if unreadable or stopped */
+    bool          done;	/* under the lock of the batch */
+};
+
+struct batch {
+    struct batch_script *scripts;
+    size_t                 count;
+    atomic_size_t           next;	/* the script to take next */
+    bool                pipeline;
+    bool                   split;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;	/* signalled when a script is done */
+};
+
+/* Where a worker goes when memory runs out outside mao_run */
+struct batch_oom {
+    jmp_buf jump;
+    FILE    *err;	/* of the script */
+};
+
+/*
+ * The paths live as long as the program.
+ */
+int
+mao_batch_manifest(qmem_t paths, const char *file)
+{
+    FILE    *fp = fopen(file, "r");
+    char  *line = NULL;
+    size_t  cap = 0;
+    ssize_t len;
+    int     res;
+
+    if (fp == NULL) {
+        return -1;
+    }
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        char *path;
+
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        path = qalloc(len + 1);
+        memcpy(path, line, len + 1);
+        qmem_append(paths, path, const char *);
+    }
+    res = ferror(fp) ? -1 : 0;
+    free(line);
+    fclose(fp);
+    return res;
+}
+
+static int
+batch_write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t done = write(fd, data, len);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += done;
+        len -= (size_t)done;
+    }
+    return 0;
+}
+
+/*
+ * Write data to path with suffix appended, or remove that file if
+ * len is 0 and keep_empty is false. Gives -1 on failure. Nothing is
+ * allocated, so a script near --mem-limit still gets its files.
+ */
+static int
+batch_write_file(const char *path, const char *suffix, const char *data, size_t len,
+                 bool keep_empty)
+{
+    char name[PATH_MAX];
+    int  res = 0, fd;
+
+    if (snprintf(name, sizeof(name), "%s%s", path, suffix) >= (int)sizeof(name)) {
+        errno = ENAMETOOLONG;
+        res = -1;
+    } else if (len == 0 && !keep_empty) {
+        if (unlink(name) < 0 && errno != ENOENT) {
+            res = -1;
+        }
+    } else if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        res = -1;
+    } else {
+        res = batch_write_all(fd, data, len);
+        if (close(fd) < 0) {
+            res = -1;
+        }
+    }
+    if (res < 0) {
+        /* A single call, so lines of different threads do not mix */
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    }
+    return res;
+}
+
+static _Noreturn void
+batch_out_of_memory(void *arg, const char *msg)
+{
+    struct batch_oom *oom = arg;
+    fputs(msg, oom->err);
+    longjmp(oom->jump, 1);
+}
+
+/*
+ * mao_run handles running out of memory itself. Around it, as in
+ * creating the state, the script fails the same way, and whatever was
+ * being built is left behind.
+ */
+static void
+batch_run_script(struct batch *b, struct batch_script *s)
+{
+    struct batch_oom      oom;
+    struct qalloc_handler outer;
+    FILE *volatile        in = NULL;
+
+    if ((oom.err = open_memstream(&s->err, &s->errlen)) == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+    outer = qalloc_on_fail((struct qalloc_handler) { batch_out_of_memory, &oom });
+    if (setjmp(oom.jump) != 0) {
+        s->status = 1;
+    } else {
+        s->out = qwriter_create_sized(QWRITER_MEMORY, BATCH_OUT_LEN);
+        if ((in = fopen(s->path, "r")) == NULL) {
+            fprintf(oom.err, "%s: %s\n", s->path, strerror(errno));
+            s->status = 1;
+        } else {
+            mao_state st = mao_state_create(oom.err);
+            s->status = mao_run(st, in, s->out, b->pipeline);
+            mao_state_destroy(st);
+        }
+    }
+    qalloc_on_fail(outer);
+    if (in != NULL) {
+        fclose(in);
+    }
+    fclose(oom.err);
+}
+
+static void
+batch_release(struct batch_script *s)
+{
+    qwriter_free(s->out);
+    free(s->err);
+    s->out = NULL;
+    s->err = NULL;
+}
+
+static void *
+batch_worker(void *arg)
+{
+    struct batch *b = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&b->next, 1)) < b->count) {
+        struct batch_script *s = &b->scripts[i];
+
+        batch_run_script(b, s);
+        if (b->split) {
+            if (batch_write_file(s->path, ".out", s->out != NULL ? s->out->buf : NULL,
+                                 s->out != NULL ? s->out->len : 0, true) < 0 ||
+                batch_write_file(s->path, ".err", s->err, s->errlen, false) < 0) {
+                s->status = 1;
+            }
+            batch_release(s);
+            continue;
+        }
+        pthread_mutex_lock(&b->lock);
+        s->done = true;
+        pthread_cond_signal(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+    }
+    qmem_pool_trim(0);
+    return NULL;
+}
+
+/*
+ * Without split, the calling thread writes out each script as soon as
+ * it and all the scripts before it are done.
+ */
+size_t
+mao_batch_run(qmem_t paths, unsigned jobs, bool pipeline, bool split)
+{
+    struct batch b;
+    pthread_t *workers;
+    qwriter_t  out;
+    unsigned   started = 0;
+    size_t     failed = 0, i = 0;
+
+    b.count = qmem_len(paths);
+    b.scripts = qalloc(b.count * sizeof(struct batch_script));
+    for (qmem_iter_t it = qmem_iter_new(paths); !qmem_iter_end(it); qmem_iter_forward(&it)) {
+        b.scripts[i++] = (struct batch_script) {
+            qmem_iter_getval(it, const char *), NULL, NULL, 0, 0, false
+        };
+    }
+    atomic_init(&b.next, 0);
+    b.pipeline = pipeline;
+    b.split = split;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.cond, NULL);
+
+    if (jobs > b.count) {
+        jobs = (unsigned)b.count;
+    }
+    workers = qalloc(jobs * sizeof(pthread_t));
+    /* Before the scripts take all memory there is under --mem-limit */
+    out = split ? NULL : qwriter_create(STDOUT_FILENO);
+    while (started < jobs && pthread_create(&workers[started], NULL, batch_worker, &b) == 0) {
+        ++started;
+    }
+    if (started == 0) {
+        /* Run everything here, then write it out below */
+        batch_worker(&b);
+    }
+
+    if (!split) {
+        for (i = 0; i < b.count; ++i) {
+            struct batch_script *s = &b.scripts[i];
+
+            pthread_mutex_lock(&b.lock);
+            while (!s->done) {
+                pthread_cond_wait(&b.cond, &b.lock);
+            }
+            pthread_mutex_unlock(&b.lock);
+            fwrite(s->err, 1, s->errlen, stderr);
+            if (s->out != NULL) {
+                qwriter_write(out, s->out->buf, s->out->len);
+            }
+            batch_release(s);
+        }
+        qwriter_free(out);
+    }
+    for (unsigned k = 0; k < started; ++k) {
+        pthread_join(workers[k], NULL);
+    }
+    for (i = 0; i < b.count; ++i) {
+        failed += b.scripts[i].status != 0;
+    }
+
+    pthread_cond_destroy(&b.cond);
+    pthread_mutex_destroy(&b.lock);
+    qfree(workers, jobs * sizeof(pthread_t), QALLOC_MISC);
+    qfree(b.scripts, b.count * sizeof(struct batch_script), QALLOC_MISC);
+    return failed;
+}
@@ -0,0 +1,37 @@
+/*
+ * batch.h
+ *
+ * The --jobs mode: many scripts run by a fixed number of worker
+ * threads in one process, each script in a mao_state of its own.
+ *
+ * The output and errors of each script are kept in memory until it is
+ * done, then written to standard output and standard error in the
+ * order the scripts were given, so the result is the same as running
+ * them one after another. With split, they go instead to PATH.out and
+ * PATH.err beside each script, the latter only if there are errors.
+ *
+ * A script which runs out of memory, as under --mem-limit, fails alone
+ * and the others go on. The limit is for the whole process, so the
+ * scripts running at once share it.
+ */
+
+#ifndef MAOLANG_BATCH_H_
+#define MAOLANG_BATCH_H_
+
+#include <stdbool.h>
+#include "infra/qmemory.h"
+
+/*
+ * Append the paths listed in file, one on each line, to paths, a qmem_t
+ * of const char *. Empty lines are skipped. Return -1 if file cannot
+ * be read.
+ */
+int mao_batch_manifest(qmem_t paths, const char *file);
+
+/*
+ * Run the scripts of paths on jobs threads. Return the number of
+ * scripts which could not be read or were stopped by a fatal error.
+ */
+size_t mao_batch_run(qmem_t paths, unsigned jobs, bool pipeline, bool split);
+
+#endif //MAOLANG_BATCH_H_
@@ -2,21 +2,376 @@
  * error.c
  * Qiu Chaofan, 2015/12/21
  *
- * This file defines the `qalloc` function, which added
- * error handling code to `malloc`.
+ * This file defines the `qalloc_tag`, `qrealloc_tag` and
+ * `qalloc_aligned` functions, which added error handling code to the
+ * allocator backend, by default `malloc`, `realloc` and
+ * `aligned_alloc`, and the counting of heap memory behind
+ * `--mem-stats`.
  */
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <sys/resource.h>
 #include "error.h"
 
-int _mao_global_errnum = 0;
+/*
+ * Sizes are counted in power of 2 classes: up to 16 bytes, up to 32,
+ * and so on. The last class takes everything larger.
+ */
+#define QALLOC_HIST         18
+
+struct qalloc_stat {
+    atomic_size_t       allocs;
+    atomic_size_t        frees;
+    atomic_size_t         live;
+    atomic_size_t         peak;
+    atomic_size_t        total;
+    atomic_size_t hist[QALLOC_HIST];
+};
+
+static const char *qalloc_tag_names[QALLOC_TAGS] = {
+    "misc", "string", "token", "container", "map",
+    "object", "expr", "buffer", "pool"
+};
+
+/*
+ * Set once before other threads start, so a plain int is enough. The
+ * thread count alone is much cheaper than the full statistics.
+ */
+#define QALLOC_COUNT_STATS  1
+#define QALLOC_COUNT_THREAD 2
+
+static int                 qalloc_counting = 0;
+static struct qalloc_stat  qalloc_stats[QALLOC_TAGS];
+static atomic_size_t       qalloc_live_all;
+static atomic_size_t       qalloc_peak_all;
+static _Thread_local size_t qalloc_thread_allocs;
+static _Thread_local struct qalloc_handler qalloc_handler;
+
+static void
+qalloc_raise_peak(atomic_size_t *peak, size_t now)
+{
+    size_t old = atomic_load_explicit(peak, memory_order_relaxed);
+    while (now > old &&
+           !atomic_compare_exchange_weak_explicit(peak, &old, now,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+static void
+qalloc_count_live(int tag, size_t size)
+{
+    struct qalloc_stat *st = &qalloc_stats[tag];
+    qalloc_raise_peak(&st->peak,
+                      atomic_fetch_add_explicit(&st->live, size, memory_order_relaxed) + size);
+    qalloc_raise_peak(&qalloc_peak_all,
+                      atomic_fetch_add_explicit(&qalloc_live_all, size, memory_order_relaxed) + size);
+}
+
+static void
+qalloc_count_dead(int tag, size_t size)
+{
+    atomic_fetch_sub_explicit(&qalloc_stats[tag].live, size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&qalloc_live_all, size, memory_order_relaxed);
+}
+
+static int
+qalloc_size_class(size_t size)
+{
+    int cls = 0;
+    while (cls < QALLOC_HIST - 1 && size > ((size_t)16 << cls)) {
+        cls++;
+    }
+    return cls;
+}
+
+static void
+qalloc_count_alloc(int tag, size_t size)
+{
+    struct qalloc_stat *st = &qalloc_stats[tag];
+    qalloc_thread_allocs++;
+    if (!(qalloc_counting & QALLOC_COUNT_STATS)) {
+        return;
+    }
+    atomic_fetch_add_explicit(&st->allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->total, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->hist[qalloc_size_class(size)], 1, memory_order_relaxed);
+    qalloc_count_live(tag, size);
+}
+
+static void
+qalloc_count_free(int tag, size_t size)
+{
+    atomic_fetch_add_explicit(&qalloc_stats[tag].frees, 1, memory_order_relaxed);
+    qalloc_count_dead(tag, size);
+}
+
+static void *
+qalloc_malloc_alloc(void *ctx, size_t size, size_t align)
+{
+    if (align <= _Alignof(max_align_t)) {
+        return malloc(size);
+    }
+    return aligned_alloc(align, size);
+}
 
-void *qalloc(size_t dst_size)
+static void *
+qalloc_malloc_realloc(void *ctx, void *src, size_t src_size, size_t dst_size)
 {
-    void *res = malloc(dst_size);
+    return realloc(src, dst_size);
+}
+
+static void
+qalloc_malloc_free(void *ctx, void *src, size_t size)
+{
+    free(src);
+}
+
+const qallocator_t qalloc_malloc_backend = {
+    qalloc_malloc_alloc, qalloc_malloc_realloc, qalloc_malloc_free, NULL, "malloc"
+};
+
+/*
+ * Read on every call but written only before the first allocation,
+ * like qalloc_counting.
+ */
+static const qallocator_t *qalloc_current = &qalloc_malloc_backend;
+
+void qalloc_set_backend(const qallocator_t *backend)
+{
+    qalloc_current = backend != NULL ? backend : &qalloc_malloc_backend;
+}
+
+const qallocator_t *qalloc_backend(void)
+{
+    return qalloc_current;
+}
+
+struct qalloc_handler qalloc_on_fail(struct qalloc_handler handler)
+{
+    struct qalloc_handler old = qalloc_handler;
+    qalloc_handler = handler;
+    return old;
+}
+
+_Noreturn void qalloc_fail(const char *what, size_t size)
+{
+    char msg[128];
+
+    snprintf(msg, sizeof(msg), "%s of %zu bytes failed: out of memory (%s).\n",
+             what, size, qalloc_current->name);
+    if (qalloc_handler.fn != NULL) {
+        qalloc_handler.fn(qalloc_handler.arg, msg);
+    }
+    fputs(msg, stderr);
+    exit(1);
+}
+
+void *qalloc_try_tag(size_t dst_size, int tag)
+{
+    void *res = qalloc_current->alloc(qalloc_current->ctx, dst_size, 0);
+    if (res != NULL && qalloc_counting) {
+        qalloc_count_alloc(tag, dst_size);
+    }
+    return res;
+}
+
+void *qalloc_tag(size_t dst_size, int tag)
+{
+    void *res = qalloc_try_tag(dst_size, tag);
     if (res == NULL) {
-        fprintf(stderr, "malloc failed: out of memory.\n");
-        exit(1);
+        qalloc_fail("alloc", dst_size);
     }
     return res;
 }
+
+void *qrealloc_tag(void *src, size_t src_size, size_t dst_size, int tag)
+{
+    void *res = src == NULL
+        ? qalloc_current->alloc(qalloc_current->ctx, dst_size, 0)
+        : qalloc_current->realloc(qalloc_current->ctx, src, src_size, dst_size);
+    if (res == NULL) {
+        qalloc_fail("realloc", dst_size);
+    }
+    if (qalloc_counting) {
+        if (src != NULL && (qalloc_counting & QALLOC_COUNT_STATS)) {
+            qalloc_count_free(tag, src_size);
+        }
+        qalloc_count_alloc(tag, dst_size);
+    }
+    return res;
+}
+
+void qfree(void *src, size_t src_size, int tag)
+{
+    if (src == NULL) {
+        return;
+    }
+    if (qalloc_counting & QALLOC_COUNT_STATS) {
+        qalloc_count_free(tag, src_size);
+    }
+    qalloc_current->free(qalloc_current->ctx, src, src_size);
+}
+
+void *qalloc_aligned(size_t align, size_t dst_size, int tag)
+{
+    void *res = qalloc_current->alloc(qalloc_current->ctx, dst_size, align);
+    if (res == NULL) {
+        qalloc_fail("aligned alloc", dst_size);
+    }
+    if (qalloc_counting) {
+        qalloc_count_alloc(tag, dst_size);
+    }
+    return res;
+}
+
+/*
+ * The capped backend reserves the bytes before asking the parent, so
+ * threads racing for the last bytes cannot go over the limit together.
+ */
+static bool
+qalloc_cap_reserve(struct qalloc_cap *cap, size_t size)
+{
+    size_t old = atomic_load_explicit(&cap->inuse, memory_order_relaxed);
+    do {
+        if (size > cap->limit - old) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&cap->inuse, &old, old + size,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+    return true;
+}
+
+static void *
+qalloc_cap_alloc(void *ctx, size_t size, size_t align)
+{
+    struct qalloc_cap *cap = ctx;
+    if (!qalloc_cap_reserve(cap, size)) {
+        return NULL;
+    }
+    void *res = cap->parent->alloc(cap->parent->ctx, size, align);
+    if (res == NULL) {
+        atomic_fetch_sub_explicit(&cap->inuse, size, memory_order_relaxed);
+    }
+    return res;
+}
+
+static void *
+qalloc_cap_realloc(void *ctx, void *src, size_t src_size, size_t dst_size)
+{
+    struct qalloc_cap *cap = ctx;
+    if (dst_size > src_size && !qalloc_cap_reserve(cap, dst_size - src_size)) {
+        return NULL;
+    }
+    void *res = cap->parent->realloc(cap->parent->ctx, src, src_size, dst_size);
+    if (res == NULL) {
+        if (dst_size > src_size) {
+            atomic_fetch_sub_explicit(&cap->inuse, dst_size - src_size, memory_order_relaxed);
+        }
+    } else if (dst_size < src_size) {
+        atomic_fetch_sub_explicit(&cap->inuse, src_size - dst_size, memory_order_relaxed);
+    }
+    return res;
+}
+
+static void
+qalloc_cap_free(void *ctx, void *src, size_t size)
+{
+    struct qalloc_cap *cap = ctx;
+    atomic_fetch_sub_explicit(&cap->inuse, size, memory_order_relaxed);
+    cap->parent->free(cap->parent->ctx, src, size);
+}
+
+qallocator_t qalloc_capped(struct qalloc_cap *cap, const qallocator_t *parent,
+                           size_t limit)
+{
+    cap->parent = parent != NULL ? parent : &qalloc_malloc_backend;
+    cap->limit  = limit;
+    atomic_init(&cap->inuse, 0);
+    return (qallocator_t) {
+        qalloc_cap_alloc, qalloc_cap_realloc, qalloc_cap_free, cap, "capped"
+    };
+}
+
+void qalloc_retag(size_t size, int from, int to)
+{
+    if (!(qalloc_counting & QALLOC_COUNT_STATS) || from == to || size == 0) {
+        return;
+    }
+    struct qalloc_stat *st = &qalloc_stats[to];
+    atomic_fetch_add_explicit(&qalloc_stats[from].frees, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&qalloc_stats[from].live, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->total, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->hist[qalloc_size_class(size)], 1, memory_order_relaxed);
+    qalloc_raise_peak(&st->peak,
+                      atomic_fetch_add_explicit(&st->live, size, memory_order_relaxed) + size);
+}
+
+void qalloc_stats_enable(void)
+{
+    qalloc_counting |= QALLOC_COUNT_STATS;
+}
+
+bool qalloc_stats_enabled(void)
+{
+    return qalloc_counting & QALLOC_COUNT_STATS;
+}
+
+size_t qalloc_stats_live(void)
+{
+    return atomic_load_explicit(&qalloc_live_all, memory_order_relaxed);
+}
+
+void qalloc_stats_thread_enable(void)
+{
+    qalloc_counting |= QALLOC_COUNT_THREAD;
+}
+
+size_t qalloc_stats_thread_allocs(void)
+{
+    return qalloc_thread_allocs;
+}
+
+void qalloc_stats_print(FILE *fp)
+{
+    struct rusage usage;
+    
+    fprintf(fp, "memory stats:\n");
+    fprintf(fp, "%-10s %12s %12s %14s %14s %14s\n",
+            "category", "allocs", "frees", "live bytes", "peak bytes", "total bytes");
+    for (int i = 0; i < QALLOC_TAGS; ++i) {
+        struct qalloc_stat *st = &qalloc_stats[i];
+        fprintf(fp, "%-10s %12zu %12zu %14zu %14zu %14zu\n", qalloc_tag_names[i],
+                atomic_load(&st->allocs), atomic_load(&st->frees), atomic_load(&st->live),
+                atomic_load(&st->peak), atomic_load(&st->total));
+    }
+    fprintf(fp, "%-10s %12s %12s %14zu %14zu\n", "all", "", "",
+            atomic_load(&qalloc_live_all), atomic_load(&qalloc_peak_all));
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(fp, "peak RSS: %ld KiB\n", usage.ru_maxrss);
+    }
+    
+    fprintf(fp, "allocations by size:\n");
+    for (int i = 0; i < QALLOC_TAGS; ++i) {
+        struct qalloc_stat *st = &qalloc_stats[i];
+        if (atomic_load(&st->allocs) == 0) {
+            continue;
+        }
+        fprintf(fp, "%-10s", qalloc_tag_names[i]);
+        for (int j = 0; j < QALLOC_HIST; ++j) {
+            size_t n = atomic_load(&st->hist[j]);
+            if (n == 0) {
+                continue;
+            }
+            if (j == QALLOC_HIST - 1) {
+                fprintf(fp, " >%zu:%zu", (size_t)16 << (j - 1), n);
+            } else {
+                fprintf(fp, " <=%zu:%zu", (size_t)16 << j, n);
+            }
+        }
+        fputc('\n', fp);
+    }
+}
@@ -10,16 +10,138 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 
-extern int _mao_global_errnum;
+/*
+ * Every heap block is counted under one of these categories. The
+ * same size and category must be given again when the block is freed,
+ * so no header has to be kept in front of it.
+ */
+#define QALLOC_MISC         0
+#define QALLOC_STRING       1	/* qstr_t */
+#define QALLOC_TOKEN        2	/* token streams */
+#define QALLOC_CONTAINER    3	/* other qmem_t */
+#define QALLOC_MAP          4	/* hash tables, buckets and values */
+#define QALLOC_OBJECT       5	/* objects and variables */
+#define QALLOC_EXPR         6	/* expression nodes and temporaries */
+#define QALLOC_BUFFER       7	/* queues and output buffers */
+#define QALLOC_POOL         8	/* kept in free lists for reuse */
+#define QALLOC_TAGS         9
+
+/*
+ * Where qalloc takes memory from. Every function gets ctx first. free
+ * is given the size of the block, and may ignore it altogether, as an
+ * arena does. align is 0 for the default alignment of malloc. A
+ * backend returns NULL when it cannot give the memory, and qalloc then
+ * reports the failure and exits, unless the thread has a handler, see
+ * qalloc_on_fail.
+ */
+struct qallocator_struct {
+    void *(*alloc)(void *ctx, size_t size, size_t align);
+    void *(*realloc)(void *ctx, void *src, size_t src_size, size_t dst_size);
+    void  (*free)(void *ctx, void *src, size_t size);
+    void                   *ctx;
+    const char            *name;	/* for error messages */
+};
+
+typedef struct qallocator_struct qallocator_t;
+
+extern const qallocator_t qalloc_malloc_backend;
+
+/*
+ * The backend must be set before anything is allocated, and stay
+ * alive until everything allocated from it is freed. NULL goes back to
+ * qalloc_malloc_backend.
+ */
+void qalloc_set_backend(const qallocator_t *backend);
+const qallocator_t *qalloc_backend(void);
+
+/*
+ * A backend taking memory from parent until limit bytes are in use.
+ * Past that, requests fail as if memory ran out. cap is the state of
+ * the backend and must outlive it.
+ */
+struct qalloc_cap {
+    const qallocator_t   *parent;
+    size_t                 limit;
+    atomic_size_t          inuse;
+};
+
+qallocator_t qalloc_capped(struct qalloc_cap *cap, const qallocator_t *parent,
+                           size_t limit);
+
+/*
+ * What the calling thread does when qalloc cannot get memory: fn is
+ * given arg and the message, and must not return, but may longjmp
+ * out. No lock of this file or of the backends is held then. Without
+ * a handler, as in every new thread, the message goes to stderr and
+ * the process exits. qalloc_on_fail returns the handler it replaces.
+ */
+struct qalloc_handler {
+    void (*fn)(void *arg, const char *msg);
+    void  *arg;
+};
+
+struct qalloc_handler qalloc_on_fail(struct qalloc_handler handler);
+
+void *qalloc_tag(size_t dst_size, int tag);
+
+/*
+ * As qalloc_tag, but give NULL when memory runs out, for a caller
+ * which has something to undo first. It then calls qalloc_fail, which
+ * goes on as qalloc_tag would have: to the handler, or exits.
+ */
+void *qalloc_try_tag(size_t dst_size, int tag);
+_Noreturn void qalloc_fail(const char *what, size_t size);
+
+void *qrealloc_tag(void *src, size_t src_size, size_t dst_size, int tag);
+void  qfree(void *src, size_t src_size, int tag);
+
+#define qalloc(dst_size) qalloc_tag(dst_size, QALLOC_MISC)
+
+/*
+ * dst_size must be a multiple of align, as for aligned_alloc.
+ */
+void *qalloc_aligned(size_t align, size_t dst_size, int tag);
+
+/*
+ * Count one block of size bytes as freed under tag `from` and allocated
+ * under tag `to`, when it changes hands without going back to malloc.
+ */
+void  qalloc_retag(size_t size, int from, int to);
 
-void *qalloc(size_t dst_size);
+/*
+ * Counting is off by default and costs a branch per call. It must be
+ * turned on before anything is allocated, or frees of earlier blocks
+ * would be counted without their allocations.
+ */
+void  qalloc_stats_enable(void);
+bool  qalloc_stats_enabled(void);
+void  qalloc_stats_print(FILE *fp);
+
+/*
+ * Bytes in use in all categories, counted with qalloc_stats_enable.
+ */
+size_t qalloc_stats_live(void);
 
-#define add_err_queue(...) \
+/*
+ * Number of allocations made so far by the calling thread, counted
+ * once either of the enable functions is called.
+ * qalloc_stats_thread_enable counts only this number.
+ */
+void   qalloc_stats_thread_enable(void);
+size_t qalloc_stats_thread_allocs(void);
+
+/*
+ * Count an error of the interpreter st and print its message. The
+ * lexer and the parser threads of st both report errors with
+ * --pipeline, so st->errnum is atomic.
+ */
+#define add_err_queue(st, ...) \
     do { \
-        ++_mao_global_errnum; \
-        /*fprintf(stderr, "Error #%d: ", ++_mao_global_errnum);*/ \
-        fprintf(stderr, __VA_ARGS__); \
+        ++(st)->errnum; \
+        fprintf((st)->err, __VA_ARGS__); \
     } while(0) \
 
 #endif      //MAOLANG_ERROR_H_
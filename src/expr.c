@@ -17,13 +17,22 @@
 
 /* If both child is null, that means the expression is a value, not operator */
 #define SELECT_VAL(x) \
-    (((x)->left_child == NULL && (x)->right_child == NULL) ? (x)->val : mao_expr_calc(x))
+    (((x)->left_child == NULL && (x)->right_child == NULL) ? (x)->val : mao_expr_calc(st, x))
+
+/* Reported in the output of the script, where it used to be */
+static _Noreturn void
+divided_by_zero(mao_state st)
+{
+    static const char msg[] = "divided by ZERO\n";
+    qwriter_write(st->out, msg, sizeof(msg) - 1);
+    mao_fail(st);
+}
 
 /*
  * Calculate expression tree from `mao_parse_expr`
  */
 mobj
-mao_expr_calc(mao_expr src)
+mao_expr_calc(mao_state st, mao_expr src)
 {
     assert(src != NULL);
     mobj tmp;
@@ -32,25 +41,23 @@ mao_expr_calc(mao_expr src)
     } else {
         switch (src->op) {
         case ADD:
-            return mao_obj_add(SELECT_VAL(src->left_child), SELECT_VAL(src->right_child));
+            return mao_obj_add(st, SELECT_VAL(src->left_child), SELECT_VAL(src->right_child));
         case SUB:
-            return mao_obj_sub(SELECT_VAL(src->left_child), SELECT_VAL(src->right_child));
+            return mao_obj_sub(st, SELECT_VAL(src->left_child), SELECT_VAL(src->right_child));
         case MUL:
-            return mao_obj_mul(SELECT_VAL(src->left_child), SELECT_VAL(src->right_child));
+            return mao_obj_mul(st, SELECT_VAL(src->left_child), SELECT_VAL(src->right_child));
         case DIV:
             tmp = SELECT_VAL(src->right_child);
             if (tmp->type == MAO_OBJ_DOUBLE) {
                 if (tmp->dval == 0.0) {
-                    printf("divided by ZERO\n");
-                    exit(1);
+                    divided_by_zero(st);
                 }
             } else {
                 if (tmp->ival == 0) {
-                    printf("divided by ZERO\n");
-                    exit(1);
+                    divided_by_zero(st);
                 }
             }
-            return mao_obj_div(SELECT_VAL(src->left_child), SELECT_VAL(src->right_child));
+            return mao_obj_div(st, SELECT_VAL(src->left_child), SELECT_VAL(src->right_child));
         case ASSIGN:
             return mao_obj_assign(SELECT_VAL(src->left_child), SELECT_VAL(src->right_child));
         case ADD_ASSIGN:
@@ -62,9 +69,9 @@ mao_expr_calc(mao_expr src)
         case DIV_ASSIGN:
             return mao_obj_dive(SELECT_VAL(src->left_child), SELECT_VAL(src->right_child));
         case NEG:
-            return mao_obj_sign(SELECT_VAL(src->left_child), true);
+            return mao_obj_sign(st, SELECT_VAL(src->left_child), true);
         case POS:
-            return mao_obj_sign(SELECT_VAL(src->left_child), false);
+            return mao_obj_sign(st, SELECT_VAL(src->left_child), false);
         default:
             return NULL;
         }
@@ -121,7 +128,7 @@ op_isassign(int op)
  * child is '1', right child is '2'.
  */
 mao_expr
-mao_parse_expr(qmem_iter_t start_pos, qmem_iter_t end_pos)
+mao_parse_expr(mao_state st, qmem_iter_t start_pos, qmem_iter_t end_pos)
 {
     mao_expr           res = NULL;      /* result */
     int              paren = 0;         /* count of parentheses */
@@ -140,16 +147,16 @@ mao_parse_expr(qmem_iter_t start_pos, qmem_iter_t end_pos)
     /* Expression starts with '+' or '-', we fill a zero at the start */
     if (op_rank(TOK_CURTYPE(start_pos)) == 1) {
         tmp_save = qmem_create(struct token);
+        qmem_set_tag(tmp_save, QALLOC_TOKEN);
         qmem_append(tmp_save, emu_tmp, struct token);
-        for (i = start_pos; !qmem_iter_eq(i, end_pos); qmem_iter_forward(&i)) {
-            qmem_append(tmp_save, qmem_iter_getval(i, struct token), struct token);
-        }
+        qmem_append_range(tmp_save, start_pos, end_pos);
         start_pos = qmem_iter_new(tmp_save);
-        for (end_pos = start_pos; !qmem_iter_end(end_pos); qmem_iter_forward(&end_pos));
+        end_pos = start_pos;
+        qmem_iter_seek(&end_pos, qmem_len(tmp_save));
     } else if (op_rank(TOK_CURTYPE(start_pos)) == 2) {
-        add_err_queue("line %u: Unexpected '%c' at beginning of sub-expression.\n",
+        add_err_queue(st, "line %u: Unexpected '%c' at beginning of sub-expression.\n",
                       TOK_CURTOK(start_pos).line, TOK_CURTYPE(start_pos) == TOKEN_OP_MUL ? '*' : '/');
-        exit(1);
+        mao_fail(st);
     }
     
     i = start_pos;
@@ -178,9 +185,9 @@ mao_parse_expr(qmem_iter_t start_pos, qmem_iter_t end_pos)
          */
         if (op_rank(TOK_CURTYPE(i)) == INT_MAX) {
             if (op_rank(psign) == INT_MAX) {
-                add_err_queue("line %u: Expected operator after identifier or number.\n",
+                add_err_queue(st, "line %u: Expected operator after identifier or number.\n",
                               TOK_CURTOK(i).line);
-                exit(1);
+                mao_fail(st);
             }
             obj_found = true;
             
@@ -210,52 +217,52 @@ mao_parse_expr(qmem_iter_t start_pos, qmem_iter_t end_pos)
     
     /* Unmatching parentheses */
     if (paren != 0) {
-        add_err_queue("line %u: Unmatching parentheses.\n", TOK_CURTOK(start_pos).line);
-        exit(1);
+        add_err_queue(st, "line %u: Unmatching parentheses.\n", TOK_CURTOK(start_pos).line);
+        mao_fail(st);
     }
     
     /* The whole expression is an operator */
     if (!obj_found) {
-        add_err_queue("line %u: Too many operators.\n", TOK_CURTOK(start_pos).line);
-        exit(1);
+        add_err_queue(st, "line %u: Too many operators.\n", TOK_CURTOK(start_pos).line);
+        mao_fail(st);
     }
     
     if (once_out_of_paren) {
-        res = qalloc(sizeof(struct mao_expr_struct));
-        global_memory_register(res);
+        res = qslab_alloc(st->expr_slab);
+        global_memory_register(st, res);
         
         /* The whole expr is only an identifier or number */
         if (lowest_op == INT_MAX) {
             res->left_child = res->right_child = NULL;
             switch (TOK_CURTOK(start_pos).type) {
             case TOKEN_IDENTIFIER:
-                if ((res->val = mao_get_variable_obj(TOK_CURTOK(start_pos).name)) == NULL) {
-                    add_err_queue("line %u: Variable '", TOK_CURTOK(start_pos).line);
-                    qstr_print(TOK_CURTOK(start_pos).name, stderr);
-                    fputs("' is undefined.\n", stderr);
-                    exit(1);
+                if ((res->val = mao_get_variable_obj(st, TOK_CURTOK(start_pos).name)) == NULL) {
+                    add_err_queue(st, "line %u: Variable '", TOK_CURTOK(start_pos).line);
+                    qstr_print(TOK_CURTOK(start_pos).name, st->err);
+                    fputs("' is undefined.\n", st->err);
+                    mao_fail(st);
                 }
                 break;
             case TOKEN_NUMBER_INT:
-                res->val = mao_obj_new(OBJ_INIT_INT, TOK_CURTOK(start_pos).ival);
+                res->val = mao_obj_new(st, OBJ_INIT_INT, TOK_CURTOK(start_pos).ival);
                 break;
             case TOKEN_NUMBER_FLOAT:
-                res->val = mao_obj_new(OBJ_INIT_DOUBLE, TOK_CURTOK(start_pos).dval);
+                res->val = mao_obj_new(st, OBJ_INIT_DOUBLE, TOK_CURTOK(start_pos).dval);
                 break;
             default:
                 res->val = NULL;
                 break;
             }
         } else {
-            res->left_child = mao_parse_expr(start_pos, middle);
+            res->left_child = mao_parse_expr(st, start_pos, middle);
             res->op = TOK_CURTYPE(middle);
             qmem_iter_forward(&middle);
-            res->right_child = mao_parse_expr(middle, end_pos);
+            res->right_child = mao_parse_expr(st, middle, end_pos);
         }
     } else {
         qmem_iter_backward(&end_pos);
         qmem_iter_forward(&start_pos);
-        return mao_parse_expr(start_pos, end_pos);
+        return mao_parse_expr(st, start_pos, end_pos);
     }
     if (tmp_save != NULL) {
         qmem_free(tmp_save);
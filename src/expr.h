@@ -35,7 +35,7 @@ struct mao_expr_struct {
 
 typedef struct mao_expr_struct *mao_expr;
 
-mobj mao_expr_calc(mao_expr src);
-mao_expr mao_parse_expr(qmem_iter_t start_pos, qmem_iter_t end_pos);
+mobj mao_expr_calc(mao_state st, mao_expr src);
+mao_expr mao_parse_expr(mao_state st, qmem_iter_t start_pos, qmem_iter_t end_pos);
 
 #endif //MAOLANG_EXPR_H_
@@ -0,0 +1,195 @@
+/*
+ * qarena.c
+ *
+ * Implementations of qarena_t type.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "qarena.h"
+
+#define QARENA_ALIGN        (_Alignof(max_align_t))
+#define QARENA_ROUND(n)     (((n) + QARENA_ALIGN - 1) / QARENA_ALIGN * QARENA_ALIGN)
+#define QARENA_HEADER       QARENA_ROUND(sizeof(struct qarena_chunk))
+
+#define qarena_lock(item) \
+    do { if ((item)->shared) pthread_mutex_lock(&(item)->lock); } while (0)
+#define qarena_unlock(item) \
+    do { if ((item)->shared) pthread_mutex_unlock(&(item)->lock); } while (0)
+
+qarena_t
+qarena_create(const qallocator_t *parent, size_t chunksize, bool shared)
+{
+    if (parent == NULL) {
+        parent = &qalloc_malloc_backend;
+    }
+    qarena_t res = parent->alloc(parent->ctx, sizeof(struct qarena_struct), 0);
+    if (res == NULL) {
+        return NULL;
+    }
+    res->parent = parent;
+    res->chunksize = chunksize != 0 ? chunksize : QARENA_CHUNK_SIZE;
+    res->chunks = NULL;
+    res->bump = res->end = NULL;
+    res->shared = shared;
+    pthread_mutex_init(&res->lock, NULL);
+    return res;
+}
+
+static void
+qarena_release_chunks(qarena_t item, struct qarena_chunk *chunk)
+{
+    while (chunk != NULL) {
+        struct qarena_chunk *next = chunk->next;
+        item->parent->free(item->parent->ctx, chunk, chunk->size);
+        chunk = next;
+    }
+}
+
+void
+qarena_reset(qarena_t item)
+{
+    qarena_lock(item);
+    if (item->chunks != NULL) {
+        qarena_release_chunks(item, item->chunks->next);
+        item->chunks->next = NULL;
+        item->bump = (char *)item->chunks + QARENA_HEADER;
+        item->end = (char *)item->chunks + item->chunks->size;
+    }
+    qarena_unlock(item);
+}
+
+void
+qarena_destroy(qarena_t item)
+{
+    if (item == NULL) {
+        return;
+    }
+    qarena_release_chunks(item, item->chunks);
+    pthread_mutex_destroy(&item->lock);
+    item->parent->free(item->parent->ctx, item, sizeof(struct qarena_struct));
+}
+
+static struct qarena_chunk *
+qarena_new_chunk(qarena_t item, size_t chunksize)
+{
+    struct qarena_chunk *chunk =
+        item->parent->alloc(item->parent->ctx, chunksize, 0);
+    
+    if (chunk != NULL) {
+        chunk->size = chunksize;
+    }
+    return chunk;
+}
+
+static char *
+qarena_align_up(char *p, size_t align)
+{
+    return (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+/*
+ * Called with the lock held. A request larger than a quarter of a
+ * chunk gets a chunk of its own, put behind the newest one so the free
+ * part of that is not lost.
+ */
+static void *
+qarena_cut(qarena_t item, size_t size, size_t align)
+{
+    struct qarena_chunk *chunk;
+    char                  *res;
+    
+    if (align < QARENA_ALIGN) {
+        align = QARENA_ALIGN;
+    }
+    assert((align & (align - 1)) == 0);
+    size = QARENA_ROUND(size);
+    if (item->bump != NULL) {
+        res = qarena_align_up(item->bump, align);
+        if (res <= item->end && (size_t)(item->end - res) >= size) {
+            goto done;
+        }
+    }
+    size_t need = QARENA_HEADER + size + (align > QARENA_ALIGN ? align : 0);
+    if (need > item->chunksize / 4) {
+        if ((chunk = qarena_new_chunk(item, need)) == NULL) {
+            return NULL;
+        }
+        if (item->chunks != NULL) {
+            chunk->next = item->chunks->next;
+            item->chunks->next = chunk;
+        } else {
+            chunk->next = NULL;
+            item->chunks = chunk;
+        }
+        return qarena_align_up((char *)chunk + QARENA_HEADER, align);
+    }
+    if ((chunk = qarena_new_chunk(item, item->chunksize)) == NULL) {
+        return NULL;
+    }
+    chunk->next = item->chunks;
+    item->chunks = chunk;
+    item->end = (char *)chunk + item->chunksize;
+    res = qarena_align_up((char *)chunk + QARENA_HEADER, align);
+done:
+    item->bump = res + size;
+    return res;
+}
+
+void *
+qarena_alloc(qarena_t item, size_t size, size_t align)
+{
+    qarena_lock(item);
+    void *res = qarena_cut(item, size, align);
+    qarena_unlock(item);
+    return res;
+}
+
+static void *
+qarena_backend_alloc(void *ctx, size_t size, size_t align)
+{
+    return qarena_alloc(ctx, size, align);
+}
+
+static void *
+qarena_backend_realloc(void *ctx, void *src, size_t src_size, size_t dst_size)
+{
+    qarena_t item = ctx;
+    void    *res = src;
+    
+    qarena_lock(item);
+    if ((char *)src + QARENA_ROUND(src_size) == item->bump &&
+        (size_t)(item->end - (char *)src) >= QARENA_ROUND(dst_size)) {
+        /* The newest block grows or shrinks in place */
+        item->bump = (char *)src + QARENA_ROUND(dst_size);
+    } else if (dst_size > src_size) {
+        res = qarena_cut(item, dst_size, 0);
+        if (res != NULL) {
+            memcpy(res, src, src_size);
+        }
+    }
+    qarena_unlock(item);
+    return res;
+}
+
+static void
+qarena_backend_free(void *ctx, void *src, size_t size)
+{
+    qarena_t item = ctx;
+    
+    qarena_lock(item);
+    if ((char *)src + QARENA_ROUND(size) == item->bump) {
+        item->bump = src;
+    }
+    qarena_unlock(item);
+}
+
+qallocator_t
+qarena_allocator(qarena_t item)
+{
+    return (qallocator_t) {
+        qarena_backend_alloc, qarena_backend_realloc, qarena_backend_free, item, "arena"
+    };
+}
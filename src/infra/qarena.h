@@ -0,0 +1,65 @@
+/*
+ * qarena.h
+ *
+ * Definition of qarena_t type, a bump allocator. Memory is cut from
+ * large chunks one request after another and given back all at once
+ * by qarena_reset or qarena_destroy. Freeing a single block only
+ * takes effect when it ends where the free part begins, so blocks
+ * freed in the reverse order of allocation are reused, and the newest
+ * buffer grows and shrinks in place.
+ *
+ * An arena can serve as the backend of qalloc, see error.h. A shared
+ * arena takes a lock on each call, as the pipelined parser allocates
+ * from two threads; others are not thread-safe.
+ *
+ * type: qarena_t
+ */
+
+#ifndef MAOLANG_QARENA_H_
+#define MAOLANG_QARENA_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "error.h"
+
+#define QARENA_CHUNK_SIZE   (256 * 1024)
+
+struct qarena_chunk {
+    struct qarena_chunk    *next;
+    size_t                  size;	/* with this header */
+};
+
+struct qarena_struct {
+    const qallocator_t   *parent;
+    size_t             chunksize;
+    struct qarena_chunk  *chunks;	/* newest first */
+    char                   *bump;	/* free part of the newest chunk */
+    char                    *end;
+    bool                  shared;
+    pthread_mutex_t         lock;
+};
+
+typedef struct qarena_struct * qarena_t;
+
+/*
+ * Chunks are taken from parent, or from malloc if it is NULL.
+ * chunksize 0 means QARENA_CHUNK_SIZE. Larger requests get a chunk of
+ * their own.
+ */
+qarena_t qarena_create(const qallocator_t *parent, size_t chunksize, bool shared);
+
+void *qarena_alloc(qarena_t item, size_t size, size_t align);
+
+/*
+ * Forget every block and keep only the newest chunk for reuse.
+ */
+void qarena_reset(qarena_t item);
+void qarena_destroy(qarena_t item);
+
+/*
+ * A qalloc backend cutting from item.
+ */
+qallocator_t qarena_allocator(qarena_t item);
+
+#endif //MAOLANG_QARENA_H_
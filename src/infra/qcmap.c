@@ -0,0 +1,161 @@
+/*
+ * qcmap.c
+ *
+ * Implementations of qcmap_t type, using hash table with sharded locks.
+ */
+
+#include <string.h>
+#include <assert.h>
+#include "qcmap.h"
+#include "error.h"
+
+#define qcmap_shard_of(item, hashcode) \
+    (&(item)->shards[((hashcode) % (item)->totalnum) % QCMAP_SHARDS])
+
+qcmap_t
+qcmap_create_sized(size_t persize, size_t num)
+{
+    qcmap_t res = qalloc_tag(sizeof(struct qcmap_struct), QALLOC_MAP);
+    res->pool = qalloc_tag(num * sizeof(*res->pool), QALLOC_MAP);
+    res->persize  = persize;
+    res->totalnum = num;
+    for (size_t i = 0; i < num; ++i) {
+        atomic_init(&res->pool[i], NULL);
+    }
+    for (size_t i = 0; i < QCMAP_SHARDS; ++i) {
+        pthread_mutex_init(&res->shards[i].lock, NULL);
+        res->shards[i].retired = NULL;
+    }
+    return res;
+}
+
+void *
+qcmap_find(qcmap_t item, qstr_t key)
+{
+    uint64_t hashcode = qstr_hash(key);
+    struct qcmap_node *p =
+        atomic_load_explicit(&item->pool[hashcode % item->totalnum],
+                             memory_order_acquire);
+    for (; p != NULL; p = atomic_load_explicit(&p->next, memory_order_acquire)) {
+        if (p->hash == hashcode && qstr_equal(key, p->key)) {
+            return p->data;
+        }
+    }
+    return NULL;
+}
+
+static void
+qcmap_node_free(qcmap_t item, struct qcmap_node *node)
+{
+    qstr_free(node->key);
+    qfree(node->data, item->persize, QALLOC_MAP);
+    qfree(node, sizeof(struct qcmap_node), QALLOC_MAP);
+}
+
+bool
+qcmap_insert(qcmap_t item, qstr_t key, const void *value)
+{
+    uint64_t hashcode = qstr_hash(key);
+    _Atomic(struct qcmap_node *) *bucket = &item->pool[hashcode % item->totalnum];
+    struct qcmap_shard *shard = qcmap_shard_of(item, hashcode);
+
+    /*
+     * Built before the lock is taken: a thread out of memory may jump
+     * out of qalloc, see qalloc_on_fail, and must not leave it held,
+     * nor the parts it got so far.
+     */
+    qstr_t             dup = qstr_duplicate(key);
+    struct qcmap_node *node = qalloc_try_tag(sizeof(struct qcmap_node), QALLOC_MAP);
+    if (node == NULL) {
+        qstr_free(dup);
+        qalloc_fail("alloc", sizeof(struct qcmap_node));
+    }
+    if ((node->data = qalloc_try_tag(item->persize, QALLOC_MAP)) == NULL) {
+        qfree(node, sizeof(struct qcmap_node), QALLOC_MAP);
+        qstr_free(dup);
+        qalloc_fail("alloc", item->persize);
+    }
+    node->hash = hashcode;
+    node->key  = dup;
+    node->retired = NULL;
+    memcpy(node->data, value, item->persize);
+
+    pthread_mutex_lock(&shard->lock);
+    struct qcmap_node *head = atomic_load_explicit(bucket, memory_order_relaxed);
+    for (struct qcmap_node *p = head; p != NULL;
+         p = atomic_load_explicit(&p->next, memory_order_relaxed)) {
+        if (p->hash == hashcode && qstr_equal(key, p->key)) {
+            pthread_mutex_unlock(&shard->lock);
+            qcmap_node_free(item, node);
+            return false;
+        }
+    }
+    atomic_init(&node->next, head);
+    /* Readers see the node only after it is completely built */
+    atomic_store_explicit(bucket, node, memory_order_release);
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+}
+
+void
+qcmap_delete_item(qcmap_t item, qstr_t key)
+{
+    uint64_t hashcode = qstr_hash(key);
+    _Atomic(struct qcmap_node *) *link = &item->pool[hashcode % item->totalnum];
+    struct qcmap_shard *shard = qcmap_shard_of(item, hashcode);
+
+    pthread_mutex_lock(&shard->lock);
+    for (struct qcmap_node *p = atomic_load_explicit(link, memory_order_relaxed);
+         p != NULL; p = atomic_load_explicit(link, memory_order_relaxed)) {
+        if (p->hash == hashcode && qstr_equal(key, p->key)) {
+            /*
+             * Readers standing on p can still go on through p->next,
+             * so p is kept alive until qcmap_reclaim.
+             */
+            atomic_store_explicit(link,
+                                  atomic_load_explicit(&p->next, memory_order_relaxed),
+                                  memory_order_release);
+            p->retired = shard->retired;
+            shard->retired = p;
+            break;
+        }
+        link = &p->next;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void
+qcmap_reclaim(qcmap_t item)
+{
+    for (size_t i = 0; i < QCMAP_SHARDS; ++i) {
+        struct qcmap_shard *shard = &item->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        struct qcmap_node *p = shard->retired;
+        shard->retired = NULL;
+        pthread_mutex_unlock(&shard->lock);
+        while (p != NULL) {
+            struct qcmap_node *tmp = p;
+            p = p->retired;
+            qcmap_node_free(item, tmp);
+        }
+    }
+}
+
+void
+qcmap_free(qcmap_t item)
+{
+    qcmap_reclaim(item);
+    for (size_t i = 0; i < item->totalnum; ++i) {
+        struct qcmap_node *p = atomic_load_explicit(&item->pool[i], memory_order_relaxed);
+        while (p != NULL) {
+            struct qcmap_node *tmp = p;
+            p = atomic_load_explicit(&p->next, memory_order_relaxed);
+            qcmap_node_free(item, tmp);
+        }
+    }
+    for (size_t i = 0; i < QCMAP_SHARDS; ++i) {
+        pthread_mutex_destroy(&item->shards[i].lock);
+    }
+    qfree(item->pool, item->totalnum * sizeof(*item->pool), QALLOC_MAP);
+    qfree(item, sizeof(struct qcmap_struct), QALLOC_MAP);
+}
@@ -0,0 +1,92 @@
+/*
+ * qcmap.h
+ *
+ * Definition of qcmap_t type, an associative array which can be
+ * shared by several threads.
+ *
+ * Lookups take no lock at all: buckets are singly linked lists whose
+ * links are published with release stores, so a reader always sees a
+ * completely built node. Inserts and deletes take the lock of the
+ * shard owning the bucket, so writers on different shards never meet.
+ *
+ * Deleted nodes are not freed at once, because a reader may still be
+ * walking through them. They wait on a retire list until the owner
+ * calls qcmap_reclaim at a point where no lookup is running, like
+ * the grace period of RCU.
+ */
+
+#ifndef MAOLANG_QCMAP_H_
+#define MAOLANG_QCMAP_H_
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "qstring.h"
+
+#define QCMAP_LEN_DEFAULT   512
+#define QCMAP_SHARDS        16
+#define QCMAP_CACHELINE     64
+
+struct qcmap_node {
+    _Atomic(struct qcmap_node *) next;
+    struct qcmap_node    *retired;	/* link in the retire list */
+    uint64_t                 hash;
+    qstr_t                    key;
+    void                    *data;
+};
+
+/* Padded so that two shard locks never share a cache line */
+struct qcmap_shard {
+    pthread_mutex_t       lock;
+    struct qcmap_node *retired;	/* deleted but maybe still being read */
+    char pad[QCMAP_CACHELINE -
+             (sizeof(pthread_mutex_t) + sizeof(void *)) % QCMAP_CACHELINE];
+};
+
+struct qcmap_struct {
+    _Atomic(struct qcmap_node *) *pool;
+    struct qcmap_shard  shards[QCMAP_SHARDS];
+    size_t             persize;
+    size_t            totalnum;
+};
+
+typedef struct qcmap_struct * qcmap_t;
+
+#define qcmap_create(type) (qcmap_create_sized(sizeof(type), QCMAP_LEN_DEFAULT))
+
+qcmap_t qcmap_create_sized(size_t persize, size_t num);
+
+/*
+ * The key passed in gets its hash code cached (see qstr_hash), which
+ * is safe even if several threads look up the same key at once.
+ */
+void *qcmap_find(qcmap_t item, qstr_t key);
+
+#define qcmap_element_exist(item, key) \
+    (qcmap_find(item, key) != NULL)
+
+#define qcmap_fetch(item, key, type) \
+    (((type*)(qcmap_find(item, key)))[0])
+
+/*
+ * Insert a copy of key and value unless the key already exists.
+ * Return false if the key was there, and the map is left unchanged.
+ */
+bool qcmap_insert(qcmap_t item, qstr_t key, const void *value);
+
+#define qcmap_add(item, _key, value, type) \
+    do { \
+        type _tmp = (value); \
+        qcmap_insert(item, _key, &_tmp); \
+    } while (0)
+
+void qcmap_delete_item(qcmap_t item, qstr_t key);
+
+/*
+ * Free the nodes removed by qcmap_delete_item. The caller must make
+ * sure that no other thread is inside qcmap_find at that time.
+ */
+void qcmap_reclaim(qcmap_t item);
+void qcmap_free(qcmap_t item);
+
+#endif //MAOLANG_QCMAP_H_
@@ -13,8 +13,8 @@
 qmap_t
 qmap_create_sized(size_t persize, size_t num)
 {
-    qmap_t res = qalloc(sizeof(struct qmap_struct));
-    res->pool = qalloc(num * sizeof(qmem_t));
+    qmap_t res = qalloc_tag(sizeof(struct qmap_struct), QALLOC_MAP);
+    res->pool = qalloc_tag(num * sizeof(qmem_t), QALLOC_MAP);
     res->persize  = persize;
     res->totalnum = num;
     memset(res->pool, 0, num * sizeof(qmem_t));
@@ -26,8 +26,8 @@ qmap_duplicate(const qmap_t item)
 {
     qmap_t res;
     assert(item != NULL);
-    res = qalloc(sizeof(struct qmap_struct));
-    res->pool = qalloc(item->totalnum * sizeof(qmem_t));
+    res = qalloc_tag(sizeof(struct qmap_struct), QALLOC_MAP);
+    res->pool = qalloc_tag(item->totalnum * sizeof(qmem_t), QALLOC_MAP);
     res->persize  = item->persize;
     res->totalnum = item->totalnum;
     memcpy(res->pool, item->pool, item->totalnum * sizeof(qmem_t));
@@ -36,10 +36,11 @@ qmap_duplicate(const qmap_t item)
     for (size_t i = 0; i < item->totalnum; ++i) {
         if ((item->pool)[i] != NULL) {
             (res->pool)[i] = qmem_create_sized(sizeof(struct qmap_key_store_struct), 1);
+            qmem_set_tag((res->pool)[i], QALLOC_MAP);
             for (qmem_iter_t j = qmem_iter_new((item->pool)[i]);
                  !qmem_iter_end(j); qmem_iter_forward(&j)) {
                 tmp.key = qstr_duplicate(qmem_iter_getval(j, struct qmap_key_store_struct).key);
-                tmp.data = qalloc(item->persize);
+                tmp.data = qalloc_tag(item->persize, QALLOC_MAP);
                 memcpy(tmp.data, qmem_iter_getval(j, struct qmap_key_store_struct).data, item->persize);
                 qmem_append((res->pool)[i], tmp, struct qmap_key_store_struct);
             }
@@ -49,18 +50,23 @@ qmap_duplicate(const qmap_t item)
 }
 
 /*
- * This is a simple but useful hash algorithm found in the book
- * The C Programming Language.
+ * The hash code is computed once and cached in the key itself,
+ * see qstr_hash in qstring.c.
  */
 static size_t
 qmap_hash(qstr_t key, size_t domain_max)
 {
-    size_t hash = 0;
-    for (qstr_iter_t i = qstr_iter_new(key); !qstr_iter_end(i);
-         qstr_iter_forward(&i)) {
-        hash = hash * 131 + qstr_iter_getval(i);
-    }
-    return hash % domain_max;
+    return qstr_hash(key) % domain_max;
+}
+
+/*
+ * Keys with different hash codes can never be equal, so the full
+ * comparison is done only when the cached codes match.
+ */
+static inline bool
+qmap_key_equal(qstr_t key, qstr_t stored)
+{
+    return qstr_hash(key) == qstr_hash(stored) && qstr_equal(key, stored);
 }
 
 qmem_t
@@ -68,7 +74,8 @@ qmap_get_qmap_plus(qmap_t item, qstr_t key)
 {
     size_t hashcode = qmap_hash(key, item->totalnum);
     if ((item->pool)[hashcode] == NULL) {
-        return (item->pool)[hashcode] = qmem_create_sized(sizeof(struct qmap_key_store_struct), 1);
+        (item->pool)[hashcode] = qmem_create_sized(sizeof(struct qmap_key_store_struct), 1);
+        qmem_set_tag((item->pool)[hashcode], QALLOC_MAP);
     }
     return (item->pool)[hashcode];
 }
@@ -82,7 +89,7 @@ qmap_find_iter_in_qmem(qmap_t item, qstr_t key)
     }
     for (qmem_iter_t i = qmem_iter_new((item->pool)[hashcode]);
          !qmem_iter_end(i); qmem_iter_forward(&i)) {
-        if (!qstr_comp(key, qmem_iter_getval(i, struct qmap_key_store_struct).key)) {
+        if (qmap_key_equal(key, qmem_iter_getval(i, struct qmap_key_store_struct).key)) {
             return qmem_iter_getval(i, struct qmap_key_store_struct).data;
         }
     }
@@ -98,12 +105,13 @@ qmap_delete_item(qmap_t item, qstr_t key)
     }
     for (qmem_iter_t i = qmem_iter_new((item->pool)[hashcode]);
          !qmem_iter_end(i); qmem_iter_forward(&i)) {
-        if (!qstr_comp(key, qmem_iter_getval(i, struct qmap_key_store_struct).key)) {
-            free(qmem_iter_getval(i, struct qmap_key_store_struct).key);
-            free(qmem_iter_getval(i, struct qmap_key_store_struct).data);
+        if (qmap_key_equal(key, qmem_iter_getval(i, struct qmap_key_store_struct).key)) {
+            qstr_free(qmem_iter_getval(i, struct qmap_key_store_struct).key);
+            qfree(qmem_iter_getval(i, struct qmap_key_store_struct).data,
+                  item->persize, QALLOC_MAP);
             qmem_delete_item(i);
             if (qmem_len(i.source) == 0) {
-                free(i.source);
+                qmem_free(i.source);
                 (item->pool)[hashcode] = NULL;
             }
             break;
@@ -119,11 +127,12 @@ qmap_free(qmap_t item)
             for (qmem_iter_t j = qmem_iter_new((item->pool)[i]);
                  !qmem_iter_end(j); qmem_iter_forward(&j)) {
                 qstr_free(qmem_iter_getval(j, struct qmap_key_store_struct).key);
-                free(qmem_iter_getval(j, struct qmap_key_store_struct).data);
+                qfree(qmem_iter_getval(j, struct qmap_key_store_struct).data,
+                      item->persize, QALLOC_MAP);
             }
             qmem_free((item->pool)[i]);
         }
     }
-    free(item->pool);
-    free(item);
+    qfree(item->pool, item->totalnum * sizeof(qmem_t), QALLOC_MAP);
+    qfree(item, sizeof(struct qmap_struct), QALLOC_MAP);
 }
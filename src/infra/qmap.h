@@ -26,7 +26,7 @@ struct qmap_struct {
 typedef struct qmap_struct * qmap_t;
 
 #define QMAP_LEN_DEFAULT 512
-#define qmap_create(type) (qmap_create_sized(sizeof(qmem_t), QMAP_LEN_DEFAULT))
+#define qmap_create(type) (qmap_create_sized(sizeof(type), QMAP_LEN_DEFAULT))
 
 qmap_t qmap_create_sized(size_t persize, size_t num);
 qmap_t qmap_duplicate(const qmap_t item);
@@ -43,7 +43,7 @@ void *qmap_find_iter_in_qmem(qmap_t item, qstr_t key);
         qmem_t rpos = qmap_get_qmap_plus(item, _key); \
         struct qmap_key_store_struct _tmp; \
         _tmp.key = qstr_duplicate(_key); \
-        _tmp.data = qalloc(sizeof(item->persize)); \
+        _tmp.data = qalloc_tag((item)->persize, QALLOC_MAP); \
         ((type*)(_tmp.data))[0] = value; \
         qmem_append(rpos, _tmp, struct qmap_key_store_struct); \
     } while (0)
@@ -9,52 +9,421 @@
 #include <assert.h>
 #include "qmemory.h"
 
+/*
+ * Blocks and nodes released by qmem_lessen are kept in a free list and
+ * handed out again by qmem_extend, instead of going back to malloc.
+ * A container cleared after every statement (global_memory_list) then
+ * reuses the same memory each time.
+ *
+ * Blocks are grouped by their byte size. The lists are per thread, so
+ * no locking is needed, and bounded in bytes; what doesn't fit is
+ * freed at once.
+ *
+ * Both give NULL when memory runs out, see qalloc_try_tag: a container
+ * is only changed once all it needs is there, so a thread jumping out
+ * of qalloc_fail leaves it whole and fit to be freed.
+ */
+struct qmem_pool_class {
+    size_t      size;	    /* byte size of blocks in this class */
+    void       *head;	    /* first free block, linked by its first word */
+};
+
+struct qmem_pool_struct {
+    struct qmem_pool_class cls[QMEM_POOL_CLASSES];
+    struct qmem_node    *nodes;	    /* free nodes, linked by next */
+    size_t             nodenum;
+    size_t               bytes;	    /* bytes held by cached blocks */
+};
+
+static _Thread_local struct qmem_pool_struct qmem_pool;
+
+static void *
+qmem_blk_alloc(size_t size, int tag)
+{
+    for (size_t i = 0; i < QMEM_POOL_CLASSES; ++i) {
+        struct qmem_pool_class *c = &qmem_pool.cls[i];
+        if (c->size == size && c->head != NULL) {
+            void *res = c->head;
+            c->head = *(void **)res;
+            qmem_pool.bytes -= size;
+            qalloc_retag(size, QALLOC_POOL, tag);
+            return res;
+        }
+    }
+    return qalloc_try_tag(size, tag);
+}
+
+static void
+qmem_blk_release(void *v, size_t size, int tag)
+{
+    struct qmem_pool_class *slot = NULL;
+    
+    if (size >= sizeof(void *) && qmem_pool.bytes + size <= QMEM_POOL_BYTES_MAX) {
+        for (size_t i = 0; i < QMEM_POOL_CLASSES; ++i) {
+            struct qmem_pool_class *c = &qmem_pool.cls[i];
+            if (c->size == size) {
+                slot = c;
+                break;
+            }
+            if (slot == NULL && c->head == NULL) {
+                slot = c;
+            }
+        }
+    }
+    if (slot == NULL) {
+        qfree(v, size, tag);
+        return;
+    }
+    slot->size = size;
+    *(void **)v = slot->head;
+    slot->head = v;
+    qmem_pool.bytes += size;
+    qalloc_retag(size, tag, QALLOC_POOL);
+}
+
+static struct qmem_node *
+qmem_node_alloc(int tag)
+{
+    struct qmem_node *res = qmem_pool.nodes;
+    if (res == NULL) {
+        return qalloc_try_tag(sizeof(struct qmem_node), tag);
+    }
+    qmem_pool.nodes = res->next;
+    --(qmem_pool.nodenum);
+    qalloc_retag(sizeof(struct qmem_node), QALLOC_POOL, tag);
+    return res;
+}
+
+static void
+qmem_node_release(struct qmem_node *node, int tag)
+{
+    if (qmem_pool.nodenum >= QMEM_POOL_NODES_MAX) {
+        qfree(node, sizeof(struct qmem_node), tag);
+        return;
+    }
+    node->next = qmem_pool.nodes;
+    qmem_pool.nodes = node;
+    ++(qmem_pool.nodenum);
+    qalloc_retag(sizeof(struct qmem_node), tag, QALLOC_POOL);
+}
+
+void
+qmem_pool_trim(size_t keep_bytes)
+{
+    for (size_t i = 0; i < QMEM_POOL_CLASSES && qmem_pool.bytes > keep_bytes; ++i) {
+        struct qmem_pool_class *c = &qmem_pool.cls[i];
+        while (c->head != NULL && qmem_pool.bytes > keep_bytes) {
+            void *tmp = c->head;
+            c->head = *(void **)tmp;
+            qmem_pool.bytes -= c->size;
+            qfree(tmp, c->size, QALLOC_POOL);
+        }
+    }
+    if (keep_bytes == 0) {
+        while (qmem_pool.nodes != NULL) {
+            struct qmem_node *tmp = qmem_pool.nodes;
+            qmem_pool.nodes = tmp->next;
+            qfree(tmp, sizeof(struct qmem_node), QALLOC_POOL);
+        }
+        qmem_pool.nodenum = 0;
+    }
+}
+
 qmem_t
 qmem_create_sized(size_t persize, size_t per_blk_size)
 {
-    qmem_t        res = qalloc(sizeof(struct qmemory_struct));
+    qmem_t        res = qalloc_tag(sizeof(struct qmemory_struct), QALLOC_CONTAINER);
 
     res->blklen = per_blk_size;
+    res->blkshift = 0;
     res->blknum = 0;
     res->persize = persize;
-    res->unwritten = res->blklen;
+    res->unwritten = 0;
+    res->taillen = 0;
     res->head = NULL;
     res->tail = NULL;
+    res->dir = NULL;
+    res->dircap = 0;
+    res->contiguous = false;
+    res->tag = QALLOC_CONTAINER;
     
     return res;
 }
 
+/*
+ * Bytes taken by the nodes and blocks of item.
+ */
+static void
+qmem_retag_blocks(const qmem_t item, int from, int to)
+{
+    for (size_t i = 0; i < item->blknum; ++i) {
+        qalloc_retag(sizeof(struct qmem_node), from, to);
+        qalloc_retag(item->dir[i]->len * item->persize, from, to);
+    }
+}
+
+void
+qmem_set_tag(qmem_t item, int tag)
+{
+    assert(item != NULL);
+    if (qalloc_stats_enabled()) {
+        qalloc_retag(sizeof(struct qmemory_struct), item->tag, tag);
+        qalloc_retag(item->dircap * sizeof(struct qmem_node *), item->tag, tag);
+        qmem_retag_blocks(item, item->tag, tag);
+    }
+    item->tag = tag;
+}
+
+qmem_t
+qmem_create_vector_sized(size_t persize, size_t init_cap)
+{
+    qmem_t        res = qmem_create_sized(persize, init_cap);
+
+    res->contiguous = true;
+    return res;
+}
+
+qmem_t
+qmem_create_geometric(size_t persize, size_t first_blk_size, size_t max_blk_size)
+{
+    assert(first_blk_size > 0 && max_blk_size >= first_blk_size);
+    qmem_t        res = qmem_create_sized(persize, first_blk_size);
+
+    /* The largest block is first_blk_size * 2^blkshift <= max_blk_size */
+    while ((first_blk_size << (res->blkshift + 1)) <= max_blk_size) {
+        ++(res->blkshift);
+    }
+    return res;
+}
+
+/*
+ * Make sure the directory can hold blknum entries.
+ */
+static void
+qmem_dir_reserve(qmem_t item, size_t blknum)
+{
+    if (blknum <= item->dircap) {
+        return;
+    }
+    size_t cap = item->dircap == 0 ? 4 : item->dircap;
+    while (cap < blknum) {
+        cap *= 2;
+    }
+    item->dir = qrealloc_tag(item->dir, item->dircap * sizeof(struct qmem_node *),
+                             cap * sizeof(struct qmem_node *), item->tag);
+    item->dircap = cap;
+}
+
+void
+qmem_extend(qmem_t item)
+{
+    assert(item != NULL);
+    struct qmem_node *new_tail;
+    
+    /* A vector doubles its only block instead of adding one */
+    if (item->contiguous && item->blknum == 1) {
+        item->head->v = qrealloc_tag(item->head->v, item->persize * item->taillen,
+                                     item->persize * item->taillen * 2, item->tag);
+        item->taillen *= 2;
+        item->head->len = item->taillen;
+        return;
+    }
+    
+    qmem_dir_reserve(item, item->blknum + 1);
+    if ((new_tail = qmem_node_alloc(item->tag)) == NULL) {
+        qalloc_fail("alloc", sizeof(struct qmem_node));
+    }
+    new_tail->len = qmem_blk_len(item, item->blknum);
+    new_tail->v = qmem_blk_alloc(item->persize * new_tail->len, item->tag);
+    if (new_tail->v == NULL) {
+        qmem_node_release(new_tail, item->tag);
+        qalloc_fail("alloc", item->persize * new_tail->len);
+    }
+    if (item->blknum == 0) {
+        new_tail->last = NULL;
+        new_tail->next = NULL;
+        item->head = new_tail;
+        item->tail = new_tail;
+    } else {
+        item->tail->next = new_tail;
+        new_tail->last = item->tail;
+        new_tail->next = NULL;
+        item->tail = new_tail;
+    }
+    item->dir[item->blknum] = new_tail;
+    item->blknum += 1;
+    item->taillen = new_tail->len;
+    item->unwritten = 0;
+}
+
+void
+qmem_append_n(qmem_t dst, const void *src, size_t n)
+{
+    assert(dst != NULL);
+    const char *p = src;
+    
+    while (n > 0) {
+        if (dst->unwritten >= dst->taillen) {
+            qmem_extend(dst);
+        }
+        size_t room = dst->taillen - dst->unwritten;
+        size_t step = n < room ? n : room;
+        memcpy((char *)dst->tail->v + dst->unwritten * dst->persize, p,
+               step * dst->persize);
+        dst->unwritten += step;
+        p += step * dst->persize;
+        n -= step;
+    }
+}
+
+void
+qmem_append_range(qmem_t dst, qmem_iter_t begin, qmem_iter_t end)
+{
+    assert(dst != NULL);
+    assert(begin.source == end.source);
+    assert(begin.source->persize == dst->persize);
+    ptrdiff_t left = qmem_iter_distance(begin, end);
+    struct qmem_node *blk = begin.current_read_blk;
+    size_t seek = begin.current_read_seek;
+    
+    /*
+     * When dst is the source itself, blocks appended now are behind
+     * `end` and never read, so the copy is still correct. Only a
+     * vector can't do this, since growing it moves the elements.
+     */
+    assert(!(dst == begin.source && dst->contiguous));
+    while (left > 0 && blk != NULL) {
+        size_t step = blk->len - seek;
+        if ((ptrdiff_t)step > left) {
+            step = left;
+        }
+        qmem_append_n(dst, (char *)blk->v + seek * dst->persize, step);
+        left -= step;
+        blk = blk->next;
+        seek = 0;
+    }
+}
+
+/*
+ * The blocks of src are about to be moved to dst.
+ */
+static void
+qmem_move_tag(qmem_t dst, qmem_t src)
+{
+    if (dst->tag != src->tag && qalloc_stats_enabled()) {
+        qmem_retag_blocks(src, src->tag, dst->tag);
+    }
+}
+
+void
+qmem_splice(qmem_t dst, qmem_t src)
+{
+    assert(dst != NULL && src != NULL && dst != src);
+    assert(dst->persize == src->persize);
+    
+    if (src->blknum == 0) {
+        return;
+    }
+    if (dst->blknum == 0) {
+        /* dst takes over the blocks and the layout of src */
+        struct qmem_node **dir = dst->dir;
+        size_t dircap = dst->dircap;
+        
+        qmem_move_tag(dst, src);
+        qalloc_retag(src->dircap * sizeof(struct qmem_node *), src->tag, dst->tag);
+        qalloc_retag(dircap * sizeof(struct qmem_node *), dst->tag, src->tag);
+        dst->head = src->head;
+        dst->tail = src->tail;
+        dst->dir = src->dir;
+        dst->dircap = src->dircap;
+        dst->blknum = src->blknum;
+        dst->blklen = src->blklen;
+        dst->blkshift = src->blkshift;
+        dst->unwritten = src->unwritten;
+        dst->taillen = src->taillen;
+        dst->contiguous = src->contiguous;
+        
+        src->head = src->tail = NULL;
+        src->dir = dir;
+        src->dircap = dircap;
+        src->blknum = 0;
+        src->unwritten = src->taillen = 0;
+        return;
+    }
+    if (!dst->contiguous && !src->contiguous &&
+        dst->blkshift == 0 && src->blkshift == 0 &&
+        dst->blklen == src->blklen && dst->unwritten == dst->taillen) {
+        qmem_dir_reserve(dst, dst->blknum + src->blknum);
+        qmem_move_tag(dst, src);
+        memcpy(dst->dir + dst->blknum, src->dir, src->blknum * sizeof(struct qmem_node *));
+        dst->tail->next = src->head;
+        src->head->last = dst->tail;
+        dst->tail = src->tail;
+        dst->blknum += src->blknum;
+        dst->unwritten = src->unwritten;
+        dst->taillen = src->taillen;
+        
+        src->head = src->tail = NULL;
+        src->blknum = 0;
+        src->unwritten = src->taillen = 0;
+        return;
+    }
+    qmem_iter_t end = qmem_iter_new(src);
+    qmem_iter_seek(&end, qmem_len(src));
+    qmem_append_range(dst, qmem_iter_new(src), end);
+    qmem_clear(src);
+}
+
 qmem_t
 qmem_duplicate(const qmem_t item)
 {
     assert(item != NULL);
-    qmem_t res = qalloc(sizeof(struct qmemory_struct));
+    qmem_t res = qalloc_tag(sizeof(struct qmemory_struct), item->tag);
 
-    res->blknum = item->blknum;
+    res->blknum = 0;
     res->blklen = item->blklen;
+    res->blkshift = item->blkshift;
     res->persize = item->persize;
-    res->unwritten = res->blklen;
-    
-    struct qmem_node *p = NULL, *index = NULL;
-    struct qmem_node *dp = item->head;
+    res->contiguous = item->contiguous;
+    res->tag = item->tag;
+    res->head = NULL;
+    res->tail = NULL;
+    res->unwritten = 0;
+    res->taillen = 0;
+    res->dircap = item->blknum;
+    res->dir = item->blknum == 0 ? NULL :
+               qalloc_try_tag(item->blknum * sizeof(struct qmem_node *), res->tag);
+    if (item->blknum != 0 && res->dir == NULL) {
+        res->dircap = 0;
+        qmem_free(res);
+        qalloc_fail("alloc", item->blknum * sizeof(struct qmem_node *));
+    }
     
-    for (size_t i = 0; i < item->blknum && dp != NULL; ++i) {
-        index = qalloc(sizeof(struct qmem_node));
-        index->v = qalloc(res->persize * res->blklen);
-
-        memcpy(index->v, dp->v, res->persize * res->blklen);
-        index->last = p;
-        if (p != NULL) {
-            p->next = index;
+    /* res stays whole after each block, to be freed if the next fails */
+    for (struct qmem_node *dp = item->head; res->blknum < item->blknum; dp = dp->next) {
+        struct qmem_node *index = qmem_node_alloc(res->tag);
+        size_t            size = res->persize * dp->len;
+
+        if (index == NULL || (index->v = qmem_blk_alloc(size, res->tag)) == NULL) {
+            if (index != NULL) {
+                qmem_node_release(index, res->tag);
+            }
+            qmem_free(res);
+            qalloc_fail("alloc", index == NULL ? sizeof(struct qmem_node) : size);
+        }
+        index->len = dp->len;
+        memcpy(index->v, dp->v, size);
+        index->last = res->tail;
+        index->next = NULL;
+        if (res->tail != NULL) {
+            res->tail->next = index;
         } else {
             res->head = index;
         }
-        index->next = NULL;
-        dp = dp->next;
-        p = index;
-        index = index->next;
+        res->tail = index;
+        res->dir[res->blknum++] = index;
+        res->taillen = res->unwritten = index->len;
     }
-    res->tail = p;
     res->unwritten = item->unwritten;
     
     return res;
@@ -68,44 +437,39 @@ qmem_lessen(qmem_t item, size_t dst_len)
     struct qmem_node     *itr;
     struct qmem_node *itr_tmp;
     
-    itr = item->head;
-    
-    if (item->blknum == 0 || dst_len > (item->blknum - 1) * (item->blklen)) {
-        item->unwritten = dst_len % item->blklen;
+    if (item->blknum == 0 || dst_len >= qmem_len(item)) {
         return;
     }
-    dst_blknum =
-    (dst_len / (item->blklen)) + (dst_len % (item->blklen) ==
-                                  0 ? 0 : 1);
     /*
      * Shrink to least blocks able to contain elements at the number of
      * dst_len
      */
-    
-    for (int i = 0; i < dst_blknum; ++i) {
-        itr = itr->next;
+    dst_blknum = dst_len == 0 ? 0 : qmem_blk_find(item, dst_len - 1) + 1;
+    if (dst_blknum == item->blknum) {
+        /* Still ending in the tail block (a vector always does) */
+        item->unwritten = dst_len - qmem_blk_start(item, dst_blknum - 1);
+        return;
     }
+    itr = item->dir[dst_blknum];
     
     item->blknum = dst_blknum;
     if (dst_blknum == 0) {
         item->head = NULL;
         item->tail = NULL;
+        item->taillen = 0;
+        item->unwritten = 0;
     } else {
         itr->last->next = NULL;
         item->tail = itr->last;
+        item->taillen = item->tail->len;
+        item->unwritten = dst_len - qmem_blk_start(item, dst_blknum - 1);
     }
     
     while (itr != NULL) {
         itr_tmp = itr;
         itr = itr->next;
-        free(itr_tmp->v);
-        free(itr_tmp);
-    }
-    
-    if (dst_len == 0 || dst_len % item->blklen == 0) {
-        item->unwritten = item->blklen;
-    } else {
-        item->unwritten = dst_len % item->blklen;
+        qmem_blk_release(itr_tmp->v, item->persize * itr_tmp->len, item->tag);
+        qmem_node_release(itr_tmp, item->tag);
     }
 }
 
@@ -117,6 +481,7 @@ qmem_iter_new(const qmem_t item)
     assert(item != NULL);
     res.current_read_blk = item->head;
     res.current_read_seek = 0;
+    res.current_read_blkno = 0;
     res.source = item;
     
     return res;
@@ -129,9 +494,10 @@ qmem_iter_forward(qmem_iter_t * item)
         return;
     }
     ++(item->current_read_seek);
-    if (item->current_read_seek > item->source->blklen - 1) {
+    if (item->current_read_seek > item->current_read_blk->len - 1) {
         item->current_read_seek = 0;
         item->current_read_blk = item->current_read_blk->next;
+        ++(item->current_read_blkno);
     }
 }
 
@@ -140,17 +506,44 @@ qmem_iter_backward(qmem_iter_t * item)
 {
     if (item->current_read_blk == NULL) {
         item->current_read_blk = item->source->tail;
-        item->current_read_seek = item->source->blklen - 1;
+        item->current_read_seek = item->source->taillen - 1;
+        item->current_read_blkno = item->source->blknum - 1;
         return;
     }
     if (item->current_read_seek == 0) {
-        item->current_read_seek = item->source->blklen - 1;
         item->current_read_blk = item->current_read_blk->last;
+        item->current_read_seek = item->current_read_blk->len - 1;
+        --(item->current_read_blkno);
     } else {
         --(item->current_read_seek);
     }
 }
 
+void
+qmem_iter_seek(qmem_iter_t * item, size_t k)
+{
+    qmem_t src = item->source;
+    size_t len = qmem_len(src);
+    
+    assert(k <= len);
+    if (k == len) {
+        /* The same place qmem_iter_forward stops at */
+        if (src->blknum == 0 || src->unwritten == src->taillen) {
+            item->current_read_blk = NULL;
+            item->current_read_seek = 0;
+            item->current_read_blkno = src->blknum;
+        } else {
+            item->current_read_blk = src->tail;
+            item->current_read_seek = src->unwritten;
+            item->current_read_blkno = src->blknum - 1;
+        }
+        return;
+    }
+    item->current_read_blkno = qmem_blk_find(src, k);
+    item->current_read_blk = src->dir[item->current_read_blkno];
+    item->current_read_seek = k - qmem_blk_start(src, item->current_read_blkno);
+}
+
 void
 qmem_delete_item(qmem_iter_t pos)
 {
@@ -164,11 +557,17 @@ qmem_delete_item(qmem_iter_t pos)
     struct qmem_node *tmp = pos.current_read_blk;
     if (tmp->last != NULL) {
         tmp->last->next = tmp->next;
+    } else {
+        item->head = tmp->next;
     }
     if (tmp->next != NULL) {
         tmp->next->last = tmp->last;
+    } else {
+        item->tail = tmp->last;
     }
-    free(tmp->v);
-    free(tmp);
+    memmove(item->dir + pos.current_read_blkno, item->dir + pos.current_read_blkno + 1,
+            (item->blknum - pos.current_read_blkno - 1) * sizeof(struct qmem_node *));
+    qmem_blk_release(tmp->v, item->persize * tmp->len, item->tag);
+    qmem_node_release(tmp, item->tag);
     --(item->blknum);
 }
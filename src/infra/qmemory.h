@@ -8,6 +8,20 @@
  * Implementation of qmemory is powered by block-list.
  * As a list, qmemory has several nodes which pointing at last and next,
  * but each node has a block containing more than one element.
+ *
+ * A qmemory can also be created as a vector. Then it never has more
+ * than one block, and the block is doubled by realloc when it is full.
+ * Elements of a vector are contiguous and can be reached by qmem_at
+ * at O(1), but their addresses change when the vector grows.
+ *
+ * Blocks of a list may also grow geometrically: each new block is twice
+ * as long as the previous one until it reaches the length cap, so a
+ * large container needs O(log n) blocks before the cap instead of n/16.
+ *
+ * Besides the list, a block list keeps a directory: an array of
+ * pointers to its blocks in order. The block holding element k can
+ * be computed from the block lengths, so iterators can seek to any
+ * element at O(1) while the elements themselves never move.
  */
 
 #ifndef MAOLANG_QMEMORY_H_
@@ -18,32 +32,42 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#include <assert.h>
 #include "error.h"
 
 struct qmem_node {
     struct qmem_node *last;
     struct qmem_node *next;
     void                *v;
+    size_t             len;	    /* number of elements the block holds */
 };
 
 struct qmemory_struct {
     struct qmem_node *head;	    /* head block of list */
     struct qmem_node *tail;	    /* tail block of list */
+    struct qmem_node **dir;	    /* directory of blocks, dir[i] is block i */
+    size_t          dircap;	    /* capacity of dir */
     size_t          blknum;	    /* number of blocks */
-    size_t          blklen;	    /* length of each block */
+    size_t          blklen;	    /* length of the first block */
+    size_t        blkshift;	    /* times a block can double, 0 if fixed */
     size_t         persize;	    /* size of each element */
-    size_t       unwritten;	    /* first position unwritten */
+    size_t       unwritten;	    /* first position unwritten in tail */
+    size_t         taillen;	    /* length of tail block, 0 if empty */
+    bool        contiguous;	    /* vector mode, only one growing block */
+    int                tag;	    /* QALLOC_* category of its memory */
 };
 
 /*
  * The following `iterator` is for an easier reading method.
  * current_read_blk is pointing at the 'current' pointed block.
  * current_read_seek is the 'current' position at current_read_blk
+ * current_read_blkno is the index of current_read_blk in the directory
  */
 struct qmemory_iterator {
     struct qmemory_struct      *source;
     struct qmem_node *current_read_blk;
     size_t           current_read_seek;
+    size_t          current_read_blkno;
 };
 
 typedef struct qmemory_struct *qmemory;
@@ -52,11 +76,87 @@ typedef struct qmemory_iterator qmemory_iterator;
 typedef qmemory_iterator qmem_iter_t;
 
 #define QMEM_LEN_DEFAULT 16
+#define QMEM_LEN_MAX_DEFAULT 4096
 #define qmem_create(type) (qmem_create_sized(sizeof(type), QMEM_LEN_DEFAULT))
+#define qmem_create_vector(type) \
+    (qmem_create_vector_sized(sizeof(type), QMEM_LEN_DEFAULT))
+#define qmem_create_growing(type) \
+    (qmem_create_geometric(sizeof(type), QMEM_LEN_DEFAULT, QMEM_LEN_MAX_DEFAULT))
 
 qmem_t qmem_create_sized(size_t persize, size_t per_blk_size);
+qmem_t qmem_create_vector_sized(size_t persize, size_t init_cap);
+
+/*
+ * Blocks start at first_blk_size elements and double up to
+ * max_blk_size (rounded down to first_blk_size * 2^n).
+ */
+qmem_t qmem_create_geometric(size_t persize, size_t first_blk_size, size_t max_blk_size);
 qmem_t qmem_duplicate(const qmem_t item);
 
+/*
+ * Make room for one more element at the tail, by a new block or,
+ * for vectors, by growing the only block. Called by qmem_append.
+ */
+void qmem_extend(qmem_t item);
+
+#define qmem_empty(item) \
+    ((item) != NULL && (item)->blknum == 0)
+
+/*
+ * Length of block i, and the position of its first element.
+ */
+static inline size_t
+qmem_blk_len(const qmem_t item, size_t i)
+{
+    if (item->contiguous) {
+        return item->blklen;
+    }
+    return item->blklen << (i < item->blkshift ? i : item->blkshift);
+}
+
+static inline size_t
+qmem_blk_start(const qmem_t item, size_t i)
+{
+    if (item->contiguous || i == 0) {
+        return 0;
+    }
+    if (i <= item->blkshift) {
+        return item->blklen * (((size_t)1 << i) - 1);
+    }
+    return item->blklen * (((size_t)1 << item->blkshift) - 1) +
+           (i - item->blkshift) * (item->blklen << item->blkshift);
+}
+
+/*
+ * Index of the block holding element k.
+ */
+static inline size_t
+qmem_blk_find(const qmem_t item, size_t k)
+{
+    if (item->contiguous) {
+        return 0;
+    }
+    size_t grown = item->blklen * (((size_t)1 << item->blkshift) - 1);
+    if (k >= grown) {
+        return item->blkshift + (k - grown) / (item->blklen << item->blkshift);
+    }
+    /* Block i of the growing part starts at blklen * (2^i - 1) */
+    size_t i = 0;
+    for (size_t n = k / item->blklen + 1; n > 1; n >>= 1) {
+        ++i;
+    }
+    return i;
+}
+
+static inline size_t
+qmem_len(const qmem_t item)
+{
+    if (qmem_empty(item)) {
+        return 0;
+    }
+    return qmem_blk_start(item, item->blknum - 1) + item->unwritten;
+}
+
 /*
  * Using macros instead of functions is for generics.
  * We can pass a type parameter for the object to be appended.
@@ -78,41 +178,82 @@ qmem_t qmem_duplicate(const qmem_t item);
  */
 #define qmem_append(dst, item, type) \
     do { \
-        struct qmem_node * new_tail; \
-        if ((dst->unwritten) > (dst->blklen) - 1) { \
-            new_tail = qalloc(sizeof(struct qmem_node)); \
-            new_tail->v = qalloc(sizeof(type)*(dst->blklen)); \
-            memset(new_tail->v, 0, sizeof(type)*(dst->blklen));\
-            if (dst->blknum == 0) { \
-                new_tail->last = NULL; \
-                new_tail->next = NULL; \
-                dst->head = new_tail; \
-                dst->tail = new_tail; \
-            } else { \
-                dst->tail->next = new_tail; \
-                new_tail->last = dst->tail; \
-                new_tail->next = NULL; \
-                dst->tail = new_tail; \
-            } \
-            dst->blknum += 1; \
-            dst->unwritten = 0; \
+        if ((dst->unwritten) >= (dst->taillen)) { \
+            qmem_extend(dst); \
         } \
         ((type *)(dst->tail->v))[(dst->unwritten)++] = item; \
     } while(0)
 
+/*
+ * Bulk versions of qmem_append. They fill the tail block with one
+ * memcpy at a time instead of one element at a time.
+ *
+ * qmem_append_n copies n elements from a plain array.
+ * qmem_append_range copies [begin, end) of another (or the same)
+ * qmemory, both iterators on the same source.
+ */
+void qmem_append_n(qmem_t dst, const void *src, size_t n);
+void qmem_append_range(qmem_t dst, qmem_iter_t begin, qmem_iter_t end);
+
+/*
+ * Move all elements of src to the end of dst, leaving src empty.
+ * Blocks are moved without copying when the layout allows it: dst is
+ * empty, or both use the same fixed block length and the tail of dst
+ * is full. Otherwise the elements are copied block by block.
+ */
+void qmem_splice(qmem_t dst, qmem_t src);
+
 #define qmem_replace(dst, place, item, type) \
     do { \
-        struct qmem_node *itr; \
         if (dst == NULL) { handle_error(ERR_MEM_ACCESS_NULL); break; } \
         if (dst->blknum == 0) { handle_error(ERR_MEM_REPLACE_OUT); break; } \
-        if (place > ((dst->blknum - 1) * (dst->blklen) + (dst->unwritten) - 1)) { handle_error(ERR_MEM_REPLACE_OUT); break; } \
-        itr = dst->head; \
-        for (int i = 0; i < (dst->blknum) - 1; ++i) { itr = itr->next; } \
-        ((type*)(itr->v))[place % (dst->blklen)] = item; \
+        if (place >= qmem_len(dst)) { handle_error(ERR_MEM_REPLACE_OUT); break; } \
+        qmem_at(dst, place, type) = item; \
     } while (0)
 
+/*
+ * Address of the element at `index`, found by the block directory.
+ */
+static inline void *
+qmem_at_ptr(const qmem_t item, size_t index)
+{
+    assert(item != NULL);
+    assert(index < qmem_len(item));
+    size_t blkno = qmem_blk_find(item, index);
+    return (char *)item->dir[blkno]->v +
+           (index - qmem_blk_start(item, blkno)) * item->persize;
+}
+
+#define qmem_at(item, index, type) \
+    (((type *)qmem_at_ptr(item, index))[0])
+
+/*
+ * The whole storage of a vector, NULL if it is empty.
+ */
+static inline void *
+qmem_data(const qmem_t item)
+{
+    assert(item->contiguous);
+    return item->blknum == 0 ? NULL : item->head->v;
+}
+
 void qmem_lessen(qmem_t item, size_t dest_len);
 
+/*
+ * Released blocks and nodes are cached per thread for reuse, up to
+ * QMEM_POOL_BYTES_MAX bytes of blocks in QMEM_POOL_CLASSES different
+ * sizes and QMEM_POOL_NODES_MAX nodes.
+ *
+ * qmem_pool_trim frees cached blocks until at most keep_bytes remain,
+ * and all cached nodes when keep_bytes is 0. A thread should call
+ * qmem_pool_trim(0) before it exits.
+ */
+#define QMEM_POOL_CLASSES       16
+#define QMEM_POOL_BYTES_MAX     (1 << 20)
+#define QMEM_POOL_NODES_MAX     4096
+
+void qmem_pool_trim(size_t keep_bytes);
+
 #define qmem_clear(item) \
     do { \
         qmem_lessen(item, 0); \
@@ -121,20 +262,15 @@ void qmem_lessen(qmem_t item, size_t dest_len);
 #define qmem_free(item) \
     do { \
         qmem_clear(item); \
-        free(item); \
+        qfree((item)->dir, (item)->dircap * sizeof(struct qmem_node *), (item)->tag); \
+        qfree(item, sizeof(struct qmemory_struct), (item)->tag); \
     } while(0)
 
-#define qmem_empty(item) \
-    ((item) != NULL && (item)->blknum == 0)
-
-static inline size_t
-qmem_len(const qmem_t item)
-{
-    if (qmem_empty(item)) {
-        return 0;
-    }
-    return (item->blknum - 1) * item->blklen + item->unwritten;
-}
+/*
+ * Count the memory of item under another QALLOC_* category than
+ * QALLOC_CONTAINER, see error.h.
+ */
+void qmem_set_tag(qmem_t item, int tag);
 
 #define qmem_iter_eq(x, y) \
     ((x).source == (y).source && (x).current_read_blk == (y).current_read_blk && \
@@ -157,6 +293,27 @@ qmem_iter_end(const qmem_iter_t item)
 
 void qmem_iter_backward(qmem_iter_t * item);
 void qmem_iter_forward(qmem_iter_t * item);
+
+/*
+ * Move item to the element at position k, counted from the head.
+ * Seeking to qmem_len gives the same iterator as walking to the end.
+ */
+void qmem_iter_seek(qmem_iter_t * item, size_t k);
+
+/*
+ * Position of an iterator counted from the head of its source.
+ */
+static inline size_t
+qmem_iter_index(const qmem_iter_t item)
+{
+    return qmem_blk_start(item.source, item.current_read_blkno) + item.current_read_seek;
+}
+
+/*
+ * Number of elements from x to y, both in the same qmemory.
+ */
+#define qmem_iter_distance(x, y) \
+    ((ptrdiff_t)qmem_iter_index(y) - (ptrdiff_t)qmem_iter_index(x))
 #define qmem_iter_getval(item, type) \
     (((type*)(((item).current_read_blk)->v))[(item).current_read_seek])
 
@@ -0,0 +1,108 @@
+/*
+ * qqueue.c
+ *
+ * Implementations of qqueue_t type, single-producer single-consumer
+ * ring buffer.
+ */
+
+#include <string.h>
+#include <assert.h>
+#include <sched.h>
+#include "qqueue.h"
+#include "error.h"
+
+qqueue_t
+qqueue_create_sized(size_t persize, size_t capacity)
+{
+    size_t cap = QQUEUE_BATCH;
+    while (cap < capacity) {
+        cap *= 2;
+    }
+    void    *buf = qalloc_tag(cap * persize, QALLOC_BUFFER);
+    qqueue_t res = qalloc_try_tag(sizeof(struct qqueue_struct), QALLOC_BUFFER);
+    if (res == NULL) {
+        qfree(buf, cap * persize, QALLOC_BUFFER);
+        qalloc_fail("alloc", sizeof(struct qqueue_struct));
+    }
+    res->buf = buf;
+    res->mask = cap - 1;
+    res->persize = persize;
+    atomic_init(&res->tail, 0);
+    atomic_init(&res->closed, false);
+    atomic_init(&res->head, 0);
+    res->prod_write = 0;
+    res->prod_head_seen = 0;
+    res->cons_read = 0;
+    res->cons_tail_seen = 0;
+    return res;
+}
+
+void
+qqueue_free(qqueue_t item)
+{
+    qfree(item->buf, (item->mask + 1) * item->persize, QALLOC_BUFFER);
+    qfree(item, sizeof(struct qqueue_struct), QALLOC_BUFFER);
+}
+
+void
+qqueue_flush(qqueue_t item)
+{
+    atomic_store_explicit(&item->tail, item->prod_write, memory_order_release);
+}
+
+void
+qqueue_push(qqueue_t item, const void *value)
+{
+    size_t capacity = item->mask + 1;
+    
+    while (item->prod_write - item->prod_head_seen >= capacity) {
+        /* The consumer may be waiting for what we haven't published */
+        qqueue_flush(item);
+        item->prod_head_seen = atomic_load_explicit(&item->head, memory_order_acquire);
+        if (item->prod_write - item->prod_head_seen >= capacity) {
+            sched_yield();
+        }
+    }
+    memcpy(item->buf + (item->prod_write & item->mask) * item->persize,
+           value, item->persize);
+    ++(item->prod_write);
+    if ((item->prod_write & (QQUEUE_BATCH - 1)) == 0) {
+        qqueue_flush(item);
+    }
+}
+
+void
+qqueue_close(qqueue_t item)
+{
+    qqueue_flush(item);
+    atomic_store_explicit(&item->closed, true, memory_order_release);
+}
+
+bool
+qqueue_pop(qqueue_t item, void *value)
+{
+    while (item->cons_read == item->cons_tail_seen) {
+        /* Give the space back before waiting, the producer may be full */
+        atomic_store_explicit(&item->head, item->cons_read, memory_order_release);
+        item->cons_tail_seen = atomic_load_explicit(&item->tail, memory_order_acquire);
+        if (item->cons_read != item->cons_tail_seen) {
+            break;
+        }
+        if (atomic_load_explicit(&item->closed, memory_order_acquire)) {
+            /* Everything before close is published by now */
+            item->cons_tail_seen = atomic_load_explicit(&item->tail, memory_order_acquire);
+            if (item->cons_read == item->cons_tail_seen) {
+                return false;
+            }
+            break;
+        }
+        sched_yield();
+    }
+    memcpy(value, item->buf + (item->cons_read & item->mask) * item->persize,
+           item->persize);
+    ++(item->cons_read);
+    if ((item->cons_read & (QQUEUE_BATCH - 1)) == 0) {
+        atomic_store_explicit(&item->head, item->cons_read, memory_order_release);
+    }
+    return true;
+}
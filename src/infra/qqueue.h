@@ -0,0 +1,86 @@
+/*
+ * qqueue.h
+ *
+ * Definition of qqueue_t type, a bounded ring queue passing elements
+ * from exactly one producer thread to exactly one consumer thread
+ * without locks.
+ *
+ * Each side works on a private copy of its index and publishes it to
+ * the other side only once every QQUEUE_BATCH elements (or when it
+ * has to wait), so the shared indices bounce between cores rarely.
+ * The private and shared indices live on separate cache lines.
+ */
+
+#ifndef MAOLANG_QQUEUE_H_
+#define MAOLANG_QQUEUE_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define QQUEUE_CACHELINE    64
+#define QQUEUE_BATCH        64
+#define QQUEUE_LEN_DEFAULT  4096
+
+struct qqueue_struct {
+    /* Read-only after creation */
+    char                    *buf;
+    size_t                  mask;	/* capacity - 1, capacity is 2^n */
+    size_t               persize;
+    char pad0[QQUEUE_CACHELINE - 3 * sizeof(size_t)];
+
+    /* Shared, written by the producer */
+    atomic_size_t           tail;
+    atomic_bool           closed;
+    char pad1[QQUEUE_CACHELINE - sizeof(atomic_size_t) - sizeof(atomic_bool)];
+
+    /* Shared, written by the consumer */
+    atomic_size_t           head;
+    char pad2[QQUEUE_CACHELINE - sizeof(atomic_size_t)];
+
+    /* Private to the producer */
+    size_t            prod_write;	/* next slot to write */
+    size_t        prod_head_seen;	/* last head read from the consumer */
+    char pad3[QQUEUE_CACHELINE - 2 * sizeof(size_t)];
+
+    /* Private to the consumer */
+    size_t             cons_read;	/* next slot to read */
+    size_t        cons_tail_seen;	/* last tail read from the producer */
+};
+
+typedef struct qqueue_struct * qqueue_t;
+
+/*
+ * The capacity is rounded up to a power of 2.
+ */
+qqueue_t qqueue_create_sized(size_t persize, size_t capacity);
+
+#define qqueue_create(type) (qqueue_create_sized(sizeof(type), QQUEUE_LEN_DEFAULT))
+
+void qqueue_free(qqueue_t item);
+
+/*
+ * Producer side. qqueue_push waits while the queue is full.
+ * qqueue_flush makes everything pushed so far visible to the consumer,
+ * and qqueue_close flushes and tells the consumer no more will come.
+ */
+void qqueue_push(qqueue_t item, const void *value);
+void qqueue_flush(qqueue_t item);
+void qqueue_close(qqueue_t item);
+
+/*
+ * Consumer side. Wait for the next element and copy it to value.
+ * Return false when the queue is closed and drained.
+ */
+bool qqueue_pop(qqueue_t item, void *value);
+
+/*
+ * Consumer side. Elements flushed by the producer and not popped yet.
+ */
+static inline size_t
+qqueue_waiting(qqueue_t item)
+{
+    return atomic_load_explicit(&item->tail, memory_order_relaxed) - item->cons_read;
+}
+
+#endif //MAOLANG_QQUEUE_H_
@@ -0,0 +1,67 @@
+/*
+ * qslab.c
+ *
+ * Implementations of qslab_t type.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#include "qslab.h"
+#include "error.h"
+
+#define QSLAB_ALIGN         (_Alignof(max_align_t))
+#define QSLAB_ROUND(n)      (((n) + QSLAB_ALIGN - 1) / QSLAB_ALIGN * QSLAB_ALIGN)
+
+qslab_t
+qslab_create_sized(size_t persize, int tag)
+{
+    qslab_t res = qalloc_tag(sizeof(struct qslab_struct), tag);
+    
+    if (persize < sizeof(struct qslab_free)) {
+        persize = sizeof(struct qslab_free);
+    }
+    res->persize = QSLAB_ROUND(persize);
+    assert(res->persize <= QSLAB_SIZE / 8);
+    res->freed = NULL;
+    res->bump = res->end = NULL;
+    res->pages = NULL;
+    res->slabnum = 0;
+    res->live = 0;
+    res->allocs = 0;
+    res->tag = tag;
+    return res;
+}
+
+void
+qslab_destroy(qslab_t item)
+{
+    if (item == NULL) {
+        return;
+    }
+    struct qslab_page *page = item->pages, *next;
+    while (page != NULL) {
+        next = page->next;
+        qfree(page, QSLAB_SIZE, item->tag);
+        page = next;
+    }
+    qfree(item, sizeof(struct qslab_struct), item->tag);
+}
+
+void *
+qslab_grow(qslab_t item)
+{
+    struct qslab_page *page = qalloc_aligned(QSLAB_SIZE, QSLAB_SIZE, item->tag);
+    char              *start = (char *)page + QSLAB_ROUND(sizeof(struct qslab_page));
+    
+    page->owner = item;
+    page->next = item->pages;
+    item->pages = page;
+    item->slabnum++;
+    /* The tail shorter than one object is left unused */
+    item->bump = start + item->persize;
+    item->end = start + (QSLAB_SIZE - (start - (char *)page)) / item->persize * item->persize;
+    item->live++;
+    item->allocs++;
+    return start;
+}
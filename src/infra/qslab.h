@@ -0,0 +1,109 @@
+/*
+ * qslab.h
+ *
+ * Definition of qslab_t type, a pool of fixed-size objects of one
+ * type. Objects are cut from QSLAB_SIZE-byte slabs, so they sit next
+ * to each other without a malloc header each, and freed objects are
+ * kept on a free list of the pool for the next allocation.
+ *
+ * Slabs are aligned to their size and start with a header naming the
+ * pool, so qslab_release can give an object back knowing only its
+ * address. A pool is not thread-safe.
+ *
+ * type: qslab_t
+ */
+
+#ifndef MAOLANG_QSLAB_H_
+#define MAOLANG_QSLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define QSLAB_SIZE          4096
+
+struct qslab_struct;
+
+struct qslab_page {
+    struct qslab_struct   *owner;
+    struct qslab_page      *next;	/* all slabs of the pool */
+};
+
+struct qslab_free {
+    struct qslab_free      *next;
+};
+
+struct qslab_struct {
+    size_t              persize;	/* rounded up to the alignment */
+    struct qslab_free    *freed;	/* objects given back */
+    char                  *bump;	/* never used part of the newest slab */
+    char                   *end;
+    struct qslab_page    *pages;
+    size_t              slabnum;
+    size_t                 live;	/* objects handed out */
+    size_t               allocs;	/* objects ever handed out */
+    int                     tag;	/* QALLOC_* category of the slabs */
+};
+
+typedef struct qslab_struct * qslab_t;
+
+/*
+ * persize can be at most QSLAB_SIZE / 8. The memory is counted under
+ * the QALLOC_* category tag, see error.h.
+ */
+qslab_t qslab_create_sized(size_t persize, int tag);
+
+#define qslab_create(type, tag) (qslab_create_sized(sizeof(type), tag))
+
+/*
+ * Free every slab, including objects not given back yet.
+ */
+void qslab_destroy(qslab_t item);
+
+/*
+ * Take a new slab when both the free list and the newest slab are
+ * used up. Called by qslab_alloc only.
+ */
+void *qslab_grow(qslab_t item);
+
+static inline void *
+qslab_alloc(qslab_t item)
+{
+    void *res;
+    
+    if (item->freed != NULL) {
+        res = item->freed;
+        item->freed = item->freed->next;
+    } else if (item->bump != item->end) {
+        res = item->bump;
+        item->bump += item->persize;
+    } else {
+        return qslab_grow(item);
+    }
+    item->live++;
+    item->allocs++;
+    return res;
+}
+
+static inline void
+qslab_free(qslab_t item, void *ptr)
+{
+    struct qslab_free *node = ptr;
+    
+    node->next = item->freed;
+    item->freed = node;
+    item->live--;
+}
+
+/*
+ * Give ptr back to the pool whose slab it came from.
+ */
+static inline void
+qslab_release(void *ptr)
+{
+    struct qslab_page *page =
+        (struct qslab_page *)((uintptr_t)ptr & ~(uintptr_t)(QSLAB_SIZE - 1));
+    
+    qslab_free(page->owner, ptr);
+}
+
+#endif //MAOLANG_QSLAB_H_
@@ -7,6 +7,12 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "error.h"
 #include "qstring.h"
 
@@ -14,47 +20,21 @@ static void
 va_qstr_assign(qstr_t item, int assign_type, va_list ap)
 {
     assert(item != NULL);
-    if (item->unwritten < item->blklen) {
-        qmem_clear(item);
-    }
+    qstr_clear(item);
     union {
         int   ival;
         char *sval;
         char  cval;
     }   value;
     
-    int       itoa_tmp = 1;
     switch (assign_type) {
         case QSTR_INIT_BYINT:
             value.ival = va_arg(ap, int);
-            if (value.ival == 0) {
-                qstr_push(item, '0');
-            } else {
-                if (value.ival < 0) {
-                    qstr_push(item, '-');
-                    value.ival = -value.ival;
-                }
-                while (itoa_tmp < value.ival) {
-                    itoa_tmp *= 10;
-                }
-                if (itoa_tmp != value.ival) {
-                    itoa_tmp /= 10;
-                }
-                while (itoa_tmp > 0) {
-                    qstr_push(item, (value.ival / itoa_tmp) + '0');
-                    value.ival %= itoa_tmp;
-                    itoa_tmp /= 10;
-                }
-            }
+            qstr_assign_int64(item, value.ival);
             break;
         case QSTR_INIT_BYCSTR:
             value.sval = va_arg(ap, char *);
-            for (size_t i = 0; i < strlen(value.sval); ++i) {
-                qstr_push(item, (value.sval)[i]);
-                /*
-                 * Maybe 'strcpy' works better?
-                 */
-            }
+            qstr_append_cstr_n(item, value.sval, strlen(value.sval));
             break;
         case QSTR_INIT_BYCHAR:
             /*
@@ -71,7 +51,13 @@ va_qstr_assign(qstr_t item, int assign_type, va_list ap)
 qstr_t
 qstr_create(int init_type,...)
 {
-    qstr_t        res = qmem_create(char);
+    qstr_t        res = qalloc_tag(sizeof(struct qstring_struct), QALLOC_STRING);
+    
+    res->len = 0;
+    res->cap = 0;
+    atomic_store_explicit(&res->hashcode, 0, memory_order_relaxed);
+    atomic_store_explicit(&res->utf8, QSTR_UTF8_ASCII, memory_order_relaxed);
+    res->inline_buf[0] = '\0';
     
     va_list        ap;
     va_start(ap, init_type);
@@ -90,28 +76,634 @@ qstr_assign(qstr_t item, int assign_type,...)
     va_end(ap);
 }
 
+static const char qstr_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const uint64_t qstr_pow10[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static int
+qstr_count_digits(uint64_t n)
+{
+    int d = 1;
+    while (d < 20 && n >= qstr_pow10[d]) {
+        d++;
+    }
+    return d;
+}
+
+/*
+ * Write the digits of n so that the last one is just before end,
+ * two at a time.
+ */
+static void
+qstr_write_digits(char *end, uint64_t n)
+{
+    while (n >= 100) {
+        const char *pair = qstr_digit_pairs + (n % 100) * 2;
+        n /= 100;
+        *--end = pair[1];
+        *--end = pair[0];
+    }
+    if (n >= 10) {
+        *--end = qstr_digit_pairs[n * 2 + 1];
+        *--end = qstr_digit_pairs[n * 2];
+    } else {
+        *--end = (char)('0' + n);
+    }
+}
+
+/*
+ * Replace the content of item with the n ASCII characters written to
+ * the returned buffer by the caller.
+ */
+static char *
+qstr_overwrite(qstr_t item, size_t n)
+{
+    qstr_reserve(item, n);
+    char *data = qstr_data(item);
+    data[n] = '\0';
+    item->len = n;
+    atomic_store_explicit(&item->hashcode, 0, memory_order_relaxed);
+    atomic_store_explicit(&item->utf8, QSTR_UTF8_ASCII, memory_order_relaxed);
+    return data;
+}
+
+size_t
+qstr_fmt_int64(char *dst, int64_t value)
+{
+    /*
+     * Negate in unsigned arithmetic so that INT64_MIN works.
+     */
+    uint64_t mag = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    size_t   sign = value < 0;
+    size_t   n = sign + (size_t)qstr_count_digits(mag);
+    
+    if (sign) {
+        dst[0] = '-';
+    }
+    qstr_write_digits(dst + n, mag);
+    return n;
+}
+
+void
+qstr_assign_int64(qstr_t item, int64_t value)
+{
+    assert(item != NULL);
+    qstr_reserve(item, QSTR_FMT_INT_MAX);
+    char *data = qstr_data(item);
+    
+    item->len = qstr_fmt_int64(data, value);
+    data[item->len] = '\0';
+    atomic_store_explicit(&item->hashcode, 0, memory_order_relaxed);
+    atomic_store_explicit(&item->utf8, QSTR_UTF8_ASCII, memory_order_relaxed);
+}
+
+size_t
+qstr_fmt_fixed(char *dst, double value, int prec)
+{
+    assert(prec >= 0 && prec <= QSTR_FMT_PREC_MAX);
+    uint64_t bits, ipart, frac;
+    
+    memcpy(&bits, &value, sizeof(bits));
+    int biased_e = (int)(bits >> 52) & 0x7FF;
+    uint64_t m = bits & ((1ULL << 52) - 1);
+    int e = biased_e != 0 ? biased_e - 1075 : -1074;
+    if (biased_e != 0) {
+        m |= 1ULL << 52;
+    }
+    /*
+     * Infinities, NaNs and integers past 2^64 are rare enough to be
+     * left to the C library.
+     */
+    if (biased_e == 0x7FF || e > 11) {
+        return (size_t)snprintf(dst, QSTR_FMT_FIXED_MAX, "%.*f", prec, value);
+    }
+    
+    if (e >= 0) {
+        ipart = m << e;
+        frac = 0;
+    } else {
+#if defined(__SIZEOF_INT128__)
+        /*
+         * value * 10^prec is m * 10^prec / 2^s exactly. Round it to an
+         * integer, ties to even, the way printf does.
+         */
+        unsigned int       s = (unsigned int)-e;
+        unsigned __int128  p = (unsigned __int128)m * qstr_pow10[prec];
+        unsigned __int128  q = 0;
+        if (s < 100) {
+            unsigned __int128 half = (unsigned __int128)1 << (s - 1);
+            unsigned __int128 r = p & ((half << 1) - 1);
+            q = p >> s;
+            if (r > half || (r == half && (q & 1))) {
+                q++;
+            }
+        }
+        ipart = (uint64_t)(q / qstr_pow10[prec]);
+        frac = (uint64_t)(q % qstr_pow10[prec]);
+#else
+        /* m * 10^prec takes up to 83 bits */
+        return (size_t)snprintf(dst, QSTR_FMT_FIXED_MAX, "%.*f", prec, value);
+#endif
+    }
+    
+    char *p = dst;
+    if (bits >> 63) {
+        *p++ = '-';
+    }
+    size_t nd = (size_t)qstr_count_digits(ipart);
+    qstr_write_digits(p + nd, ipart);
+    p += nd;
+    if (prec > 0) {
+        *p++ = '.';
+        memset(p, '0', (size_t)prec);
+        if (frac != 0) {
+            qstr_write_digits(p + prec, frac);
+        }
+        p += prec;
+    }
+    return (size_t)(p - dst);
+}
+
+/*
+ * Doubles are converted with Grisu3. The value and the midpoints to its
+ * neighbours are scaled by a cached power of ten into a 64-bit window,
+ * and digits are generated until the result falls between the
+ * midpoints. When the error of the scaling leaves it unsure whether
+ * the digits are the shortest, about one value in 200, they are found
+ * with snprintf and strtod instead.
+ */
+typedef struct {
+    uint64_t f;
+    int      e;
+} qstr_diyfp;
+
+#define QSTR_DP_SIGNIFICAND_SIZE  52
+#define QSTR_DP_EXPONENT_BIAS     (0x3FF + QSTR_DP_SIGNIFICAND_SIZE)
+#define QSTR_DP_HIDDEN_BIT        (1ULL << QSTR_DP_SIGNIFICAND_SIZE)
+#define QSTR_DP_SIGNIFICAND_MASK  (QSTR_DP_HIDDEN_BIT - 1)
+
+/*
+ * Normalized 10^k for k = -348, -340, ..., 340.
+ */
+static const struct {
+    uint64_t f;
+    int      e;
+} qstr_cached_pow10[] = {
+    { 0xfa8fd5a0081c0288ULL, -1220 },
+    { 0xbaaee17fa23ebf76ULL, -1193 },
+    { 0x8b16fb203055ac76ULL, -1166 },
+    { 0xcf42894a5dce35eaULL, -1140 },
+    { 0x9a6bb0aa55653b2dULL, -1113 },
+    { 0xe61acf033d1a45dfULL, -1087 },
+    { 0xab70fe17c79ac6caULL, -1060 },
+    { 0xff77b1fcbebcdc4fULL, -1034 },
+    { 0xbe5691ef416bd60cULL, -1007 },
+    { 0x8dd01fad907ffc3cULL,  -980 },
+    { 0xd3515c2831559a83ULL,  -954 },
+    { 0x9d71ac8fada6c9b5ULL,  -927 },
+    { 0xea9c227723ee8bcbULL,  -901 },
+    { 0xaecc49914078536dULL,  -874 },
+    { 0x823c12795db6ce57ULL,  -847 },
+    { 0xc21094364dfb5637ULL,  -821 },
+    { 0x9096ea6f3848984fULL,  -794 },
+    { 0xd77485cb25823ac7ULL,  -768 },
+    { 0xa086cfcd97bf97f4ULL,  -741 },
+    { 0xef340a98172aace5ULL,  -715 },
+    { 0xb23867fb2a35b28eULL,  -688 },
+    { 0x84c8d4dfd2c63f3bULL,  -661 },
+    { 0xc5dd44271ad3cdbaULL,  -635 },
+    { 0x936b9fcebb25c996ULL,  -608 },
+    { 0xdbac6c247d62a584ULL,  -582 },
+    { 0xa3ab66580d5fdaf6ULL,  -555 },
+    { 0xf3e2f893dec3f126ULL,  -529 },
+    { 0xb5b5ada8aaff80b8ULL,  -502 },
+    { 0x87625f056c7c4a8bULL,  -475 },
+    { 0xc9bcff6034c13053ULL,  -449 },
+    { 0x964e858c91ba2655ULL,  -422 },
+    { 0xdff9772470297ebdULL,  -396 },
+    { 0xa6dfbd9fb8e5b88fULL,  -369 },
+    { 0xf8a95fcf88747d94ULL,  -343 },
+    { 0xb94470938fa89bcfULL,  -316 },
+    { 0x8a08f0f8bf0f156bULL,  -289 },
+    { 0xcdb02555653131b6ULL,  -263 },
+    { 0x993fe2c6d07b7facULL,  -236 },
+    { 0xe45c10c42a2b3b06ULL,  -210 },
+    { 0xaa242499697392d3ULL,  -183 },
+    { 0xfd87b5f28300ca0eULL,  -157 },
+    { 0xbce5086492111aebULL,  -130 },
+    { 0x8cbccc096f5088ccULL,  -103 },
+    { 0xd1b71758e219652cULL,   -77 },
+    { 0x9c40000000000000ULL,   -50 },
+    { 0xe8d4a51000000000ULL,   -24 },
+    { 0xad78ebc5ac620000ULL,     3 },
+    { 0x813f3978f8940984ULL,    30 },
+    { 0xc097ce7bc90715b3ULL,    56 },
+    { 0x8f7e32ce7bea5c70ULL,    83 },
+    { 0xd5d238a4abe98068ULL,   109 },
+    { 0x9f4f2726179a2245ULL,   136 },
+    { 0xed63a231d4c4fb27ULL,   162 },
+    { 0xb0de65388cc8ada8ULL,   189 },
+    { 0x83c7088e1aab65dbULL,   216 },
+    { 0xc45d1df942711d9aULL,   242 },
+    { 0x924d692ca61be758ULL,   269 },
+    { 0xda01ee641a708deaULL,   295 },
+    { 0xa26da3999aef774aULL,   322 },
+    { 0xf209787bb47d6b85ULL,   348 },
+    { 0xb454e4a179dd1877ULL,   375 },
+    { 0x865b86925b9bc5c2ULL,   402 },
+    { 0xc83553c5c8965d3dULL,   428 },
+    { 0x952ab45cfa97a0b3ULL,   455 },
+    { 0xde469fbd99a05fe3ULL,   481 },
+    { 0xa59bc234db398c25ULL,   508 },
+    { 0xf6c69a72a3989f5cULL,   534 },
+    { 0xb7dcbf5354e9beceULL,   561 },
+    { 0x88fcf317f22241e2ULL,   588 },
+    { 0xcc20ce9bd35c78a5ULL,   614 },
+    { 0x98165af37b2153dfULL,   641 },
+    { 0xe2a0b5dc971f303aULL,   667 },
+    { 0xa8d9d1535ce3b396ULL,   694 },
+    { 0xfb9b7cd9a4a7443cULL,   720 },
+    { 0xbb764c4ca7a44410ULL,   747 },
+    { 0x8bab8eefb6409c1aULL,   774 },
+    { 0xd01fef10a657842cULL,   800 },
+    { 0x9b10a4e5e9913129ULL,   827 },
+    { 0xe7109bfba19c0c9dULL,   853 },
+    { 0xac2820d9623bf429ULL,   880 },
+    { 0x80444b5e7aa7cf85ULL,   907 },
+    { 0xbf21e44003acdd2dULL,   933 },
+    { 0x8e679c2f5e44ff8fULL,   960 },
+    { 0xd433179d9c8cb841ULL,   986 },
+    { 0x9e19db92b4e31ba9ULL,  1013 },
+    { 0xeb96bf6ebadf77d9ULL,  1039 },
+    { 0xaf87023b9bf0ee6bULL,  1066 },
+};
+
+/*
+ * The upper 64 bits of x.f * y.f, rounded half up.
+ */
+static qstr_diyfp
+qstr_diyfp_mul(qstr_diyfp x, qstr_diyfp y)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 p = (unsigned __int128)x.f * y.f;
+    uint64_t          h = (uint64_t)(p >> 64);
+    
+    if ((uint64_t)p & (1ULL << 63)) {
+        h++;
+    }
+#else
+    uint64_t a = x.f >> 32, b = (uint32_t)x.f;
+    uint64_t c = y.f >> 32, d = (uint32_t)y.f;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t mid = (bd >> 32) + (uint32_t)ad + (uint32_t)bc;
+    
+    /* Adding 2^63 to the product rounds its upper half */
+    mid += 1ULL << 31;
+    uint64_t h = ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+#endif
+    return (qstr_diyfp) { h, x.e + y.e + 64 };
+}
+
+/*
+ * Leading zero bits of a nonzero x.
+ */
+static inline int
+qstr_clz64(uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    for (int step = 32; step > 0; step /= 2) {
+        if (x >> (64 - step) == 0) {
+            x <<= step;
+            n += step;
+        }
+    }
+    return n;
+#endif
+}
+
+static qstr_diyfp
+qstr_diyfp_normalize(qstr_diyfp x)
+{
+    int s = qstr_clz64(x.f);
+    return (qstr_diyfp) { x.f << s, x.e - s };
+}
+
+/*
+ * Move the last digit down while that brings buf closer to w, then
+ * tell whether buf is surely the closest shortest form. Not so when
+ * the error of the scaled values, unit, leaves the choice open.
+ */
+static bool
+qstr_grisu_round(char *buf, int len, uint64_t too_high_w, uint64_t unsafe,
+                 uint64_t rest, uint64_t ten_kappa, uint64_t unit)
+{
+    uint64_t small = too_high_w - unit, big = too_high_w + unit;
+    
+    while (rest < small && unsafe - rest >= ten_kappa &&
+           (rest + ten_kappa < small || small - rest >= rest + ten_kappa - small)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+    if (rest < big && unsafe - rest >= ten_kappa &&
+        (rest + ten_kappa < big || big - rest > rest + ten_kappa - big)) {
+        return false;
+    }
+    return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+/*
+ * Digits of high are generated until the rest falls inside the
+ * interval widened by the error of one unit each side, then trimmed
+ * towards w. Return 0 if the digits may not be the shortest.
+ */
+static int
+qstr_digit_gen(qstr_diyfp low, qstr_diyfp w, qstr_diyfp high, char *buf, int *k)
+{
+    const qstr_diyfp one = { 1ULL << -w.e, w.e };
+    uint64_t         unit = 1;
+    uint64_t         too_high = high.f + unit;
+    uint64_t         unsafe = too_high - (low.f - unit);
+    uint32_t         p1 = (uint32_t)(too_high >> -one.e);
+    uint64_t         p2 = too_high & (one.f - 1);
+    int              kappa = qstr_count_digits(p1);
+    int              len = 0;
+    
+    while (kappa > 0) {
+        uint32_t d = (uint32_t)(p1 / qstr_pow10[kappa - 1]);
+        p1 %= (uint32_t)qstr_pow10[kappa - 1];
+        if (d != 0 || len != 0) {
+            buf[len++] = (char)('0' + d);
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest < unsafe) {
+            *k += kappa;
+            return qstr_grisu_round(buf, len, too_high - w.f, unsafe, rest,
+                                    qstr_pow10[kappa] << -one.e, unit) ? len : 0;
+        }
+    }
+    for (;;) {
+        p2 *= 10;
+        unit *= 10;
+        unsafe *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d != 0 || len != 0) {
+            buf[len++] = (char)('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < unsafe) {
+            *k += kappa;
+            return qstr_grisu_round(buf, len, (too_high - w.f) * unit, unsafe, p2,
+                                    one.f, unit) ? len : 0;
+        }
+    }
+}
+
+/*
+ * Shortest digits of a finite positive value, so that it equals
+ * buf * 10^k. Return the number of digits, or 0 when Grisu3 cannot
+ * be sure of them.
+ */
+static int
+qstr_grisu3(double value, char *buf, int *k)
+{
+    uint64_t   bits;
+    qstr_diyfp v;
+    
+    memcpy(&bits, &value, sizeof(bits));
+    int biased_e = (int)(bits >> QSTR_DP_SIGNIFICAND_SIZE) & 0x7FF;
+    uint64_t sig = bits & QSTR_DP_SIGNIFICAND_MASK;
+    if (biased_e != 0) {
+        v = (qstr_diyfp) { sig + QSTR_DP_HIDDEN_BIT, biased_e - QSTR_DP_EXPONENT_BIAS };
+    } else {
+        v = (qstr_diyfp) { sig, 1 - QSTR_DP_EXPONENT_BIAS };
+    }
+    
+    /*
+     * Midpoints between v and its neighbours, on the same exponent.
+     * The lower gap is half as wide when v is a power of 2.
+     */
+    qstr_diyfp plus = qstr_diyfp_normalize((qstr_diyfp) { (v.f << 1) + 1, v.e - 1 });
+    qstr_diyfp minus = v.f == QSTR_DP_HIDDEN_BIT ?
+                       (qstr_diyfp) { (v.f << 2) - 1, v.e - 2 } :
+                       (qstr_diyfp) { (v.f << 1) - 1, v.e - 1 };
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    
+    /*
+     * Pick 10^-k bringing the exponent of plus into [-60, -32].
+     */
+    double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    int    ck = (int)dk;
+    if (dk - ck > 0.0) {
+        ck++;
+    }
+    int    index = (ck >> 3) + 1;
+    qstr_diyfp c = { qstr_cached_pow10[index].f, qstr_cached_pow10[index].e };
+    *k = -(-348 + index * 8);
+    
+    return qstr_digit_gen(qstr_diyfp_mul(minus, c), qstr_diyfp_mul(qstr_diyfp_normalize(v), c),
+                          qstr_diyfp_mul(plus, c), buf, k);
+}
+
+/*
+ * The fewest digits %.*e needs to read back as value, found by
+ * halving, since a form which reads back stays so with more digits.
+ */
+static int
+qstr_shortest_slow(double value, char *buf, int *k)
+{
+    char out[32];
+    int  lo = 0, hi = 16, len = 0;
+    
+    while (lo < hi) {
+        int prec = (lo + hi) / 2;
+        snprintf(out, sizeof(out), "%.*e", prec, value);
+        if (strtod(out, NULL) == value) {
+            hi = prec;
+        } else {
+            lo = prec + 1;
+        }
+    }
+    snprintf(out, sizeof(out), "%.*e", lo, value);
+    for (const char *p = out; *p != 'e'; ++p) {
+        if (*p != '.') {
+            buf[len++] = *p;
+        }
+    }
+    *k = atoi(strchr(out, 'e') + 1) - (len - 1);
+    while (len > 1 && buf[len - 1] == '0') {
+        len--;
+        ++*k;
+    }
+    return len;
+}
+
+void
+qstr_assign_double(qstr_t item, double value)
+{
+    assert(item != NULL);
+    char  digits[20];
+    char  out[32];
+    char *p = out;
+    int   len, k, point;
+    
+    if (value != value) {
+        qstr_assign(item, QSTR_ASSIGN_BYCSTR, "nan");
+        return;
+    }
+    if (signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+    if (value == 0.0) {
+        *p++ = '0';
+        goto done;
+    }
+    if (isinf(value)) {
+        memcpy(p, "inf", 3);
+        p += 3;
+        goto done;
+    }
+    
+    if ((len = qstr_grisu3(value, digits, &k)) == 0) {
+        len = qstr_shortest_slow(value, digits, &k);
+    }
+    point = len + k;		/* digits before the decimal point */
+    if (len <= point && point <= 21) {
+        memcpy(p, digits, len);
+        memset(p + len, '0', point - len);
+        p += point;
+    } else if (0 < point && point <= 21) {
+        memcpy(p, digits, point);
+        p[point] = '.';
+        memcpy(p + point + 1, digits + point, len - point);
+        p += len + 1;
+    } else if (-6 < point && point <= 0) {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -point);
+        memcpy(p - point, digits, len);
+        p += len - point;
+    } else {
+        int exp = point - 1;
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, len - 1);
+            p += len - 1;
+        }
+        *p++ = 'e';
+        *p++ = exp < 0 ? '-' : '+';
+        exp = exp < 0 ? -exp : exp;
+        size_t ne = (size_t)qstr_count_digits((uint64_t)exp);
+        qstr_write_digits(p + ne, (uint64_t)exp);
+        p += ne;
+    }
+    
+done:
+    memcpy(qstr_overwrite(item, (size_t)(p - out)), out, (size_t)(p - out));
+}
+
+void
+qstr_reserve(qstr_t item, size_t len)
+{
+    assert(item != NULL);
+    size_t room = item->cap != 0 ? item->cap - 1 : QSTR_INLINE_MAX;
+    if (len <= room) {
+        return;
+    }
+    size_t cap = 2 * (QSTR_INLINE_MAX + 1);
+    while (cap < len + 1) {
+        cap *= 2;
+    }
+    if (item->cap != 0) {
+        item->heap = qrealloc_tag(item->heap, item->cap, cap, QALLOC_STRING);
+    } else {
+        char *heap = qalloc_tag(cap, QALLOC_STRING);
+        memcpy(heap, item->inline_buf, item->len + 1);
+        item->heap = heap;
+    }
+    item->cap = cap;
+}
+
+void
+qstr_lessen(qstr_t item, size_t dst_len)
+{
+    assert(item != NULL);
+    if (dst_len >= item->len) {
+        return;
+    }
+    item->len = dst_len;
+    qstr_data(item)[dst_len] = '\0';
+    atomic_store_explicit(&item->hashcode, 0, memory_order_relaxed);
+    /* The cut may split a sequence */
+    if (dst_len == 0) {
+        atomic_store_explicit(&item->utf8, QSTR_UTF8_ASCII, memory_order_relaxed);
+    } else if (atomic_load_explicit(&item->utf8, memory_order_relaxed) != QSTR_UTF8_ASCII) {
+        atomic_store_explicit(&item->utf8, QSTR_UTF8_UNKNOWN, memory_order_relaxed);
+    }
+}
+
+void
+qstr_free(qstr_t item)
+{
+    if (item->cap != 0) {
+        qfree(item->heap, item->cap, QALLOC_STRING);
+    }
+    qfree(item, sizeof(struct qstring_struct), QALLOC_STRING);
+}
+
+qstr_t
+qstr_duplicate(const qstr_t item)
+{
+    assert(item != NULL);
+    qstr_t        res = qstr_create(QSTR_INIT_BYNONE);
+    
+    qstr_append_cstr_n(res, qstr_data(item), item->len);
+    atomic_store_explicit(&res->hashcode,
+                          atomic_load_explicit(&item->hashcode, memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_store_explicit(&res->utf8,
+                          atomic_load_explicit(&item->utf8, memory_order_relaxed),
+                          memory_order_relaxed);
+    return res;
+}
+
+qstr_t
+qstr_create_view(qstr_view_t view)
+{
+    qstr_t        res = qstr_create(QSTR_INIT_BYNONE);
+    
+    return qstr_append_cstr_n(res, view.data, view.len);
+}
+
 qstr_t
 qstr_sub(const qstr_t item, size_t start, size_t length)
 {
     assert(item != NULL);
     qstr_t        res = qstr_create(QSTR_INIT_BYNONE);
-    size_t        i = 0;
-    qstr_iter_t   iter = qstr_iter_new(item);
-    
-    if (length != 0) {
-        if (start != 0) {
-            while (!qstr_iter_end(iter)) {
-                qstr_iter_forward(&iter);
-                if (++i == start) {
-                    break;
-                }
-            }
+    size_t        len = qstr_len(item);
+    
+    if (length != 0 && start < len) {
+        qstr_append_cstr_n(res, qstr_data(item) + start,
+                           length < len - start ? length : len - start);
+        if (atomic_load_explicit(&item->utf8, memory_order_relaxed) == QSTR_UTF8_ASCII) {
+            atomic_store_explicit(&res->utf8, QSTR_UTF8_ASCII, memory_order_relaxed);
         }
-        i = 0;
-        do {
-            qstr_push(res, qstr_iter_getval(iter));
-            qstr_iter_forward(&iter);
-        } while (++i < length && !qstr_iter_end(iter));
     }
     return res;
 }
@@ -124,164 +716,681 @@ qstr_append(qstr_t item, qstr_t str)
     if (qstr_empty(str)) {
         return NULL;
     }
-    qstr_iter_t    striter = qstr_iter_new(str);
-    
-    do {
-        qstr_push(item, qstr_iter_getval(striter));
-        qstr_iter_forward(&striter);
-    } while (!qstr_iter_end(striter));
+    bool ascii = atomic_load_explicit(&item->utf8, memory_order_relaxed) == QSTR_UTF8_ASCII &&
+                 atomic_load_explicit(&str->utf8, memory_order_relaxed) == QSTR_UTF8_ASCII;
+    /* Reserve first: str may be item itself */
+    qstr_reserve(item, item->len + str->len);
+    qstr_append_cstr_n(item, qstr_data(str), qstr_len(str));
+    if (ascii) {
+        atomic_store_explicit(&item->utf8, QSTR_UTF8_ASCII, memory_order_relaxed);
+    }
+    return item;
+}
+
+qstr_t
+qstr_append_cstr_n(qstr_t item, const char *str, size_t n)
+{
+    assert(item != NULL);
+    assert(str != NULL || n == 0);
+    if (n == 0) {
+        return item;
+    }
+    qstr_reserve(item, item->len + n);
+    char *data = qstr_data(item);
+    memcpy(data + item->len, str, n);
+    item->len += n;
+    data[item->len] = '\0';
+    atomic_store_explicit(&item->hashcode, 0, memory_order_relaxed);
+    atomic_store_explicit(&item->utf8, QSTR_UTF8_UNKNOWN, memory_order_relaxed);
     
     return item;
 }
 
+int
+qstr_view_find_char(qstr_view_t text, const char pattern)
+{
+    const char *pos = memchr(text.data, pattern, text.len);
+    
+    return pos == NULL ? -1 : (int)(pos - text.data);
+}
+
 int
 qstr_find_char(const qstr_t item, const char pattern)
 {
     assert(item != NULL);
-    int        i = 0;
-    for (qstr_iter_t iter = qstr_iter_new(item);
-         !qstr_iter_end(iter); qstr_iter_forward(&iter), ++i) {
-        if (qstr_iter_getval(iter) == pattern) {
-            return i;
-        }
-    }
-    
-    return -1;
+    return qstr_view_find_char(qstr_view(item), pattern);
 }
 
 /*
+ * Substring search.
+ *
  * The easiest way in searching substr is to enumerate each character
  * in item and pattern of the complexity O(MN), where M and N stands
- * for the length of item and pattern.
+ * for the length of item and pattern. That is what we used to do.
  *
- * A better algorithm is Knuth-Morris-Pratt(KMP) as well as
- * Boyer-Moore(BM). But I cannot implement those algorithms for now
- * :( I checked how it was implemented in BSD libc - function strstr.
- * And I found it that they code it in the easiest way!
+ * Now patterns up to QSTR_HORSPOOL_MAX characters go through
+ * Boyer-Moore-Horspool: the last character of the window picks how
+ * far to jump, so most of the text is never looked at. Its worst case
+ * is O(MN), but M is small there.
  *
- * So, considering that the item won't be too long, I use the first
- * method until I fully understand BM someday.
+ * Longer patterns use Two-Way (Crochemore and Perrin, 1991), the same
+ * algorithm as glibc's strstr. The pattern is cut at a critical
+ * factorization x = u v: v is matched left to right, then u right to
+ * left, and a mismatch shifts by the period known from the cut. It is
+ * O(N + M) in time and O(1) in space.
  */
-int
-qstr_find_cstr(const qstr_t text, const char *pattern)
+#define QSTR_HORSPOOL_MAX 16
+
+static ptrdiff_t
+search_horspool(const unsigned char *y, size_t n, const unsigned char *x, size_t m)
 {
-    assert(text != NULL);
-    assert(pattern != NULL);
-    if (strlen(pattern) > qstr_len(text)) {
-        return -1;
+    size_t shift[UCHAR_MAX + 1];
+    
+    for (size_t i = 0; i <= UCHAR_MAX; ++i) {
+        shift[i] = m;
     }
-    int        i = 0;
-    for (qstr_iter_t match_tmp, iter = qstr_iter_new(text);
-         !qstr_iter_end(iter); qstr_iter_forward(&iter), ++i) {
-        match_tmp = iter;
-        for (int j = 0; j < strlen(pattern); ++j) {
-            if (qstr_iter_getval(match_tmp) != pattern[j]
-                || qstr_iter_end(match_tmp)) {
-                break;
-            }
-            qstr_iter_forward(&match_tmp);
-            if (j == strlen(pattern) - 1) {
-                return i;
+    for (size_t i = 0; i + 1 < m; ++i) {
+        shift[x[i]] = m - 1 - i;
+    }
+    for (size_t j = 0; j + m <= n; j += shift[y[j + m - 1]]) {
+        if (y[j + m - 1] == x[m - 1] && !memcmp(y + j, x, m - 1)) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Maximal suffix of x by the order `<` (or `>` if reversed), and
+ * the period of that suffix.
+ */
+static ptrdiff_t
+max_suffix(const unsigned char *x, ptrdiff_t m, ptrdiff_t *period, bool reversed)
+{
+    ptrdiff_t ms = -1, j = 0, k = 1, p = 1;
+    
+    while (j + k < m) {
+        unsigned char a = x[j + k], b = x[ms + k];
+        if (reversed ? a > b : a < b) {
+            j += k;
+            k = 1;
+            p = j - ms;
+        } else if (a == b) {
+            if (k != p) {
+                ++k;
+            } else {
+                j += p;
+                k = 1;
             }
+        } else {
+            ms = j;
+            j = ms + 1;
+            k = p = 1;
         }
     }
+    *period = p;
+    return ms;
+}
+
+static ptrdiff_t
+search_two_way(const unsigned char *y, ptrdiff_t n, const unsigned char *x, ptrdiff_t m)
+{
+    ptrdiff_t p, q, ell, per, i, j, memory;
+    ptrdiff_t ms1 = max_suffix(x, m, &p, false);
+    ptrdiff_t ms2 = max_suffix(x, m, &q, true);
+    
+    if (ms1 > ms2) {
+        ell = ms1;
+        per = p;
+    } else {
+        ell = ms2;
+        per = q;
+    }
     
+    if (!memcmp(x, x + per, ell + 1)) {
+        /* x is periodic, remember how much of it matched already */
+        for (j = 0, memory = -1; j <= n - m; ) {
+            i = (ell > memory ? ell : memory) + 1;
+            while (i < m && x[i] == y[i + j]) {
+                ++i;
+            }
+            if (i >= m) {
+                i = ell;
+                while (i > memory && x[i] == y[i + j]) {
+                    --i;
+                }
+                if (i <= memory) {
+                    return j;
+                }
+                j += per;
+                memory = m - per - 1;
+            } else {
+                j += i - ell;
+                memory = -1;
+            }
+        }
+    } else {
+        per = (ell + 1 > m - ell - 1 ? ell + 1 : m - ell - 1) + 1;
+        for (j = 0; j <= n - m; ) {
+            i = ell + 1;
+            while (i < m && x[i] == y[i + j]) {
+                ++i;
+            }
+            if (i >= m) {
+                i = ell;
+                while (i >= 0 && x[i] == y[i + j]) {
+                    --i;
+                }
+                if (i < 0) {
+                    return j;
+                }
+                j += per;
+            } else {
+                j += i - ell;
+            }
+        }
+    }
     return -1;
 }
 
+int
+qstr_view_find(qstr_view_t text, qstr_view_t pattern)
+{
+    const unsigned char *y = (const unsigned char *)text.data;
+    const unsigned char *x = (const unsigned char *)pattern.data;
+    size_t n = text.len, m = pattern.len;
+    const unsigned char *pos;
+    
+    if (m == 0 || m > n) {
+        return -1;
+    }
+    if (m == 1) {
+        pos = memchr(y, x[0], n);
+        return pos == NULL ? -1 : (int)(pos - y);
+    }
+    if (m <= QSTR_HORSPOOL_MAX) {
+        return (int)search_horspool(y, n, x, m);
+    }
+    return (int)search_two_way(y, (ptrdiff_t)n, x, (ptrdiff_t)m);
+}
+
+int
+qstr_find_cstr(const qstr_t text, const char *pattern)
+{
+    assert(text != NULL);
+    assert(pattern != NULL);
+    return qstr_view_find(qstr_view(text), qstr_view_cstr(pattern));
+}
+
 int
 qstr_find_qstr(const qstr_t text, const qstr_t pattern)
 {
     assert(text != NULL);
     assert(pattern != NULL);
-    if (qstr_len(pattern) > qstr_len(text)) {
-        return -1;
+    return qstr_view_find(qstr_view(text), qstr_view(pattern));
+}
+
+/*
+ * Compare n bytes of s1 and s2 a word at a time, giving the difference
+ * of the first different pair as `char`, like the old per-character
+ * loop did. Return 0 if all n are equal.
+ */
+static int
+qstr_memdiff(const char *s1, const char *s2, size_t n)
+{
+    size_t i = 0;
+    
+    if (!memcmp(s1, s2, n)) {
+        return 0;
     }
-    int  i = 0,  j;
-    for (qstr_iter_t pattern_match, match_tmp, iter = qstr_iter_new(text);
-         !qstr_iter_end(iter); qstr_iter_forward(&iter), ++i) {
-        match_tmp = iter;
-        for (pattern_match = qstr_iter_new(pattern), j = 0;
-             !qstr_iter_end(pattern_match);
-             qstr_iter_forward(&pattern_match),
-             qstr_iter_forward(&match_tmp), ++j) {
-            if (qstr_iter_getval(match_tmp) !=
-                qstr_iter_getval(pattern_match)
-                || qstr_iter_end(match_tmp)) {
-                break;
-            }
-            if (j == qstr_len(pattern) - 1) {
-                return i;
-            }
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w1, w2;
+        memcpy(&w1, s1 + i, 8);
+        memcpy(&w2, s2 + i, 8);
+        if (w1 != w2) {
+            break;
         }
-        /*
-         * Ugly code.
-         */
     }
+    while (s1[i] == s2[i]) {
+        ++i;
+    }
+    return s1[i] - s2[i];
+}
+
+/*
+ * Strings of equal length (the common case of a successful lookup)
+ * take one memcmp. Otherwise the common prefix decides, and if one
+ * string is a prefix of the other the shorter one is less.
+ */
+int
+qstr_view_comp(qstr_view_t str1, qstr_view_t str2)
+{
+    size_t n1 = str1.len, n2 = str2.len;
+    int    diff = qstr_memdiff(str1.data, str2.data, n1 < n2 ? n1 : n2);
     
-    return -1;
+    if (diff != 0 || n1 == n2) {
+        return diff;
+    }
+    return n1 < n2 ? -1 : 1;
 }
 
 int
 qstr_comp(const qstr_t str1, const qstr_t str2)
 {
-    qstr_iter_t    str1iter = qstr_iter_new(str1);
-    qstr_iter_t    str2iter = qstr_iter_new(str2);
-    char           c1 = '\0', c2 = '\0';
+    return qstr_view_comp(qstr_view(str1), qstr_view(str2));
+}
+
+int
+qstr_ccomp(const qstr_t str1, const char *str2)
+{
+    return qstr_view_comp(qstr_view(str1), qstr_view_cstr(str2));
+}
+
+void
+qstr_view_print(qstr_view_t item, FILE *fp)
+{
+    assert(fp != NULL);
+    const char *stop = memchr(item.data, '\0', item.len);
     
-    for (; !qstr_iter_end(str1iter) && !qstr_iter_end(str2iter);
-         qstr_iter_forward(&str1iter), qstr_iter_forward(&str2iter)) {
-        c1 = qstr_iter_getval(str1iter), c2 = qstr_iter_getval(str2iter);
-        if (c1 != c2) {
-            return c1 - c2;
-        }
+    fwrite(item.data, 1, stop != NULL ? (size_t)(stop - item.data) : item.len, fp);
+}
+
+void
+qstr_print(const qstr_t item, FILE *fp)
+{
+    assert(item != NULL);
+    qstr_view_print(qstr_view(item), fp);
+}
+
+/*
+ * Hashing of qstr_t.
+ *
+ * The old `hash * 131 + c` recurrence (from The C Programming Language)
+ * maps names like `v000123` and `v000124` to neighbouring buckets, and
+ * anyone who can write a script can fill a single bucket on purpose.
+ *
+ * Here the string is consumed 8 bytes at a time and every word is folded
+ * into the state by a 64x64->128 bit multiply, in the way of wyhash.
+ * The state starts from a random seed, so collisions cannot be planned
+ * ahead.
+ *
+ * Interpreters in different threads hash with the same seed. It is
+ * picked once for all of them, and the flag is set only after the
+ * seed is stored, so a thread seeing the flag sees the seed too.
+ */
+#define QHASH_P0 0xa0761d6478bd642full
+#define QHASH_P1 0xe7037ed1a0b428dbull
+#define QHASH_P2 0x8ebc6af09c88c6e3ull
+
+static _Atomic uint64_t qhash_seed_value = 0;
+static atomic_bool      qhash_seeded = false;
+static pthread_once_t   qhash_seed_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t
+qhash_mix(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, la = (uint32_t)a;
+    uint64_t hb = b >> 32, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+void
+qstr_hash_seed(uint64_t seed)
+{
+    atomic_store_explicit(&qhash_seed_value, seed, memory_order_relaxed);
+    atomic_store_explicit(&qhash_seeded, true, memory_order_release);
+}
+
+static void
+qhash_pick_seed(void)
+{
+    uint64_t entropy = (uint64_t)time(NULL);
+    entropy ^= (uint64_t)(uintptr_t)&entropy;
+    entropy ^= (uint64_t)(uintptr_t)&qhash_seed_value << 16;
+    qstr_hash_seed(qhash_mix(entropy ^ QHASH_P0, QHASH_P1));
+}
+
+static uint64_t
+qhash_get_seed(void)
+{
+    if (!atomic_load_explicit(&qhash_seeded, memory_order_acquire)) {
+        pthread_once(&qhash_seed_once, qhash_pick_seed);
     }
+    return atomic_load_explicit(&qhash_seed_value, memory_order_relaxed);
+}
+
+uint64_t
+qstr_view_hash(qstr_view_t item)
+{
+    uint64_t        h = qhash_get_seed() ^ QHASH_P0;
+    uint64_t     word = 0;
+    size_t      total = item.len;
+    size_t          n = total;
+    const unsigned char *p = (const unsigned char *)item.data;
     
-    if (qstr_len(str1) != qstr_len(str2)) {
-        if (qstr_iter_end(str1iter)) {
-            return 0 - c2;
-        } else {
-            return c1;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = qhash_mix(h ^ w, QHASH_P1);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        word |= (uint64_t)p[i] << (8 * i);
+    }
+    h = qhash_mix(h ^ word ^ QHASH_P2, QHASH_P1 ^ total);
+    h = qhash_mix(h, QHASH_P2);
+    
+    /* 0 is reserved for `not computed yet` */
+    if (h == 0) {
+        h = QHASH_P0;
+    }
+    return h;
+}
+
+uint64_t
+qstr_hash(const qstr_t item)
+{
+    uint64_t h;
+
+    assert(item != NULL);
+    h = atomic_load_explicit(&item->hashcode, memory_order_relaxed);
+    if (h == 0) {
+        h = qstr_view_hash(qstr_view(item));
+        atomic_store_explicit(&item->hashcode, h, memory_order_relaxed);
+    }
+    return h;
+}
+
+/*
+ * Length of the well-formed UTF-8 sequence at p, looking at n bytes at
+ * most, or 0 if it is malformed. The ranges are those of Table 3-7 in
+ * the Unicode Standard.
+ */
+static size_t
+qstr_utf8_decode(const unsigned char *p, size_t n, uint32_t *cp)
+{
+    unsigned char b = p[0], lo = 0x80, hi = 0xBF;
+    
+    if (b < 0x80) {
+        *cp = b;
+        return 1;
+    }
+    if (b < 0xC2 || b > 0xF4) {
+        return 0;
+    }
+    if (b < 0xE0) {
+        if (n < 2 || (p[1] & 0xC0) != 0x80) {
+            return 0;
         }
+        *cp = (uint32_t)(b & 0x1F) << 6 | (p[1] & 0x3F);
+        return 2;
     }
-    return 0;
+    if (b == 0xE0) {
+        lo = 0xA0;
+    } else if (b == 0xED) {
+        hi = 0x9F;
+    } else if (b == 0xF0) {
+        lo = 0x90;
+    } else if (b == 0xF4) {
+        hi = 0x8F;
+    }
+    if (b < 0xF0) {
+        if (n < 3 || p[1] < lo || p[1] > hi || (p[2] & 0xC0) != 0x80) {
+            return 0;
+        }
+        *cp = (uint32_t)(b & 0x0F) << 12 | (uint32_t)(p[1] & 0x3F) << 6 | (p[2] & 0x3F);
+        return 3;
+    }
+    if (n < 4 || p[1] < lo || p[1] > hi ||
+        (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80) {
+        return 0;
+    }
+    *cp = (uint32_t)(b & 0x07) << 18 | (uint32_t)(p[1] & 0x3F) << 12 |
+          (uint32_t)(p[2] & 0x3F) << 6 | (p[3] & 0x3F);
+    return 4;
 }
 
-int
-qstr_ccomp(const qstr_t str1, const char *str2)
+static int
+qstr_utf8_check_scalar(const unsigned char *p, size_t n)
 {
-    qstr_iter_t striter = qstr_iter_new(str1);
-    size_t      j;
-    char        c = '\0';
+    bool     ascii = true;
+    size_t   i = 0, k;
+    uint32_t cp;
     
-    for (j = 0, striter = qstr_iter_new(str1); j < strlen(str2) && !qstr_iter_end(striter);
-         qstr_iter_forward(&striter), ++j) {
-        
-        c = qstr_iter_getval(striter);
-        if (c != str2[j]) {
-            return c - str2[j];
+    while (i < n) {
+        if (i + 8 <= n) {
+            uint64_t w;
+            memcpy(&w, p + i, 8);
+            if ((w & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        if (p[i] < 0x80) {
+            i++;
+            continue;
+        }
+        if ((k = qstr_utf8_decode(p + i, n - i, &cp)) == 0) {
+            return QSTR_UTF8_INVALID;
         }
+        ascii = false;
+        i += k;
     }
+    return ascii ? QSTR_UTF8_ASCII : QSTR_UTF8_VALID;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QSTR_UTF8_SSSE3
+#include <tmmintrin.h>
+
+/*
+ * The lookup algorithm of Keiser and Lemire, "Validating UTF-8 in less
+ * than one instruction per byte". Every error of a byte pair is told
+ * by the high nibble of the first byte, its low nibble and the high
+ * nibble of the second byte. Three table lookups give a bit set for
+ * each and their AND is the errors found. Continuation bytes that must
+ * follow a 3 or 4 byte lead are checked on their own, and a lead byte
+ * at the end of a block is carried to the next one.
+ */
+#define U8_TOO_SHORT        0x01
+#define U8_TOO_LONG         0x02
+#define U8_OVERLONG_3       0x04
+#define U8_TOO_LARGE        0x08
+#define U8_SURROGATE        0x10
+#define U8_OVERLONG_2       0x20
+#define U8_TOO_LARGE_1000   0x40
+#define U8_OVERLONG_4       0x40
+#define U8_TWO_CONTS        0x80
+#define U8_CARRY            (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+#define U8(x) ((char)(x))
+
+__attribute__((target("ssse3")))
+static int
+qstr_utf8_check_ssse3(const unsigned char *p, size_t n)
+{
+    const __m128i byte_1_high = _mm_setr_epi8(
+        U8(U8_TOO_LONG), U8(U8_TOO_LONG), U8(U8_TOO_LONG), U8(U8_TOO_LONG),
+        U8(U8_TOO_LONG), U8(U8_TOO_LONG), U8(U8_TOO_LONG), U8(U8_TOO_LONG),
+        U8(U8_TWO_CONTS), U8(U8_TWO_CONTS), U8(U8_TWO_CONTS), U8(U8_TWO_CONTS),
+        U8(U8_TOO_SHORT | U8_OVERLONG_2),
+        U8(U8_TOO_SHORT),
+        U8(U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE),
+        U8(U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4));
+    const __m128i byte_1_low = _mm_setr_epi8(
+        U8(U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4),
+        U8(U8_CARRY | U8_OVERLONG_2),
+        U8(U8_CARRY),
+        U8(U8_CARRY),
+        U8(U8_CARRY | U8_TOO_LARGE),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        U8(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000));
+    const __m128i byte_2_high = _mm_setr_epi8(
+        U8(U8_TOO_SHORT), U8(U8_TOO_SHORT), U8(U8_TOO_SHORT), U8(U8_TOO_SHORT),
+        U8(U8_TOO_SHORT), U8(U8_TOO_SHORT), U8(U8_TOO_SHORT), U8(U8_TOO_SHORT),
+        U8(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 |
+           U8_TOO_LARGE_1000 | U8_OVERLONG_4),
+        U8(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE),
+        U8(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE),
+        U8(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE),
+        U8(U8_TOO_SHORT), U8(U8_TOO_SHORT), U8(U8_TOO_SHORT), U8(U8_TOO_SHORT));
+    /* Lead bytes too close to the end of a block to be complete */
+    const __m128i incomplete = _mm_setr_epi8(
+        U8(0xFF), U8(0xFF), U8(0xFF), U8(0xFF), U8(0xFF), U8(0xFF), U8(0xFF), U8(0xFF),
+        U8(0xFF), U8(0xFF), U8(0xFF), U8(0xFF), U8(0xFF),
+        U8(0xF0 - 1), U8(0xE0 - 1), U8(0xC0 - 1));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i prev = _mm_setzero_si128(), prev_incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128(), any = _mm_setzero_si128();
+    unsigned char tail[16];
+    size_t  i = 0;
     
-    if (qstr_len(str1) != strlen(str2)) {
-        
-        if (qstr_iter_end(striter)) {
-            return 0 - str2[j];
+    while (i < n) {
+        __m128i in;
+        if (i + 16 <= n) {
+            in = _mm_loadu_si128((const __m128i *)(p + i));
         } else {
-            return c;
+            /* Pad with ASCII, which also shows a cut sequence at the end */
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p + i, n - i);
+            in = _mm_loadu_si128((const __m128i *)tail);
+        }
+        i += 16;
+        any = _mm_or_si128(any, in);
+        if (_mm_movemask_epi8(in) == 0) {
+            error = _mm_or_si128(error, prev_incomplete);
+            prev = in;
+            continue;
         }
+        __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+        __m128i sc = _mm_and_si128(
+            _mm_and_si128(
+                _mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+            _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+        __m128i third = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 14), _mm_set1_epi8(U8(0xE0 - 0x80)));
+        __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13), _mm_set1_epi8(U8(0xF0 - 0x80)));
+        __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(U8(0x80)));
+        error = _mm_or_si128(error, _mm_xor_si128(must23, sc));
+        prev_incomplete = _mm_subs_epu8(in, incomplete);
+        prev = in;
     }
+    error = _mm_or_si128(error, prev_incomplete);
     
-    return 0;
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF) {
+        return QSTR_UTF8_INVALID;
+    }
+    return _mm_movemask_epi8(any) == 0 ? QSTR_UTF8_ASCII : QSTR_UTF8_VALID;
+}
+#endif
+
+int
+qstr_view_utf8_check(qstr_view_t view)
+{
+    const unsigned char *p = (const unsigned char *)view.data;
+    
+#ifdef QSTR_UTF8_SSSE3
+    if (view.len >= 16 && __builtin_cpu_supports("ssse3")) {
+        return qstr_utf8_check_ssse3(p, view.len);
+    }
+#endif
+    return qstr_utf8_check_scalar(p, view.len);
+}
+
+size_t
+qstr_utf8_len(const qstr_t item)
+{
+    const unsigned char *p = (const unsigned char *)qstr_data(item);
+    size_t   n = item->len, res = 0, i = 0, k;
+    uint32_t cp;
+    
+    switch (qstr_utf8_kind(item)) {
+        case QSTR_UTF8_ASCII:
+            return n;
+        case QSTR_UTF8_VALID:
+            for (; i < n; ++i) {
+                res += (p[i] & 0xC0) != 0x80;
+            }
+            return res;
+        default:
+            while (i < n) {
+                k = qstr_utf8_decode(p + i, n - i, &cp);
+                i += k != 0 ? k : 1;
+                res++;
+            }
+            return res;
+    }
+}
+
+uint32_t
+qstr_iter_next_cp(qstr_iter_t *iter)
+{
+    const unsigned char *p = (const unsigned char *)qstr_data((qstr_t)iter->source);
+    size_t   n = iter->source->len, k;
+    uint32_t cp;
+    
+    if (iter->pos >= n) {
+        return QSTR_UTF8_REPLACEMENT;
+    }
+    if (p[iter->pos] < 0x80) {
+        return p[iter->pos++];
+    }
+    if ((k = qstr_utf8_decode(p + iter->pos, n - iter->pos, &cp)) == 0) {
+        iter->pos++;
+        return QSTR_UTF8_REPLACEMENT;
+    }
+    iter->pos += k;
+    return cp;
 }
 
 void
-qstr_print(const qstr_t item, FILE *fp)
+qstr_push_cp(qstr_t item, uint32_t cp)
 {
-    assert(item != NULL);
-    assert(fp != NULL);
-    for (qstr_iter_t i = qstr_iter_new(item);
-         !qstr_iter_end(i) && qstr_iter_getval(i) != '\0'; qstr_iter_forward(&i)) {
-        fputc(qstr_iter_getval(i), fp);
+    char buf[4];
+    
+    if (cp < 0x80) {
+        qstr_push(item, (char)cp);
+        return;
+    }
+    if ((cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+        cp = QSTR_UTF8_REPLACEMENT;
+    }
+    int  kind = atomic_load_explicit(&item->utf8, memory_order_relaxed);
+    bool valid = kind == QSTR_UTF8_ASCII || kind == QSTR_UTF8_VALID;
+    if (cp < 0x800) {
+        buf[0] = (char)(0xC0 | cp >> 6);
+        buf[1] = (char)(0x80 | (cp & 0x3F));
+        qstr_append_cstr_n(item, buf, 2);
+    } else if (cp < 0x10000) {
+        buf[0] = (char)(0xE0 | cp >> 12);
+        buf[1] = (char)(0x80 | (cp >> 6 & 0x3F));
+        buf[2] = (char)(0x80 | (cp & 0x3F));
+        qstr_append_cstr_n(item, buf, 3);
+    } else {
+        buf[0] = (char)(0xF0 | cp >> 18);
+        buf[1] = (char)(0x80 | (cp >> 12 & 0x3F));
+        buf[2] = (char)(0x80 | (cp >> 6 & 0x3F));
+        buf[3] = (char)(0x80 | (cp & 0x3F));
+        qstr_append_cstr_n(item, buf, 4);
+    }
+    if (valid) {
+        atomic_store_explicit(&item->utf8, QSTR_UTF8_VALID, memory_order_relaxed);
     }
 }
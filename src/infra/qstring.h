@@ -2,9 +2,10 @@
  * qstring.h
  * Qiu Chaofan, 2015/11/25
  *
- * Dynamic string powered by qmemory. No utf-8 support so far.
+ * Dynamic string with small-string storage. Characters are bytes;
+ * UTF-8 text can be validated and walked by codepoint.
  *
- * type: qstr_t, qstr_iter_t
+ * type: qstr_t, qstr_iter_t, qstr_view_t
  */
 
 #ifndef MAOLANG_QSTRING_H_
@@ -13,6 +14,9 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
 #include "qmemory.h"
 
 #define QSTR_INIT_BYINT     1
@@ -23,40 +27,132 @@
 #define QSTR_ASSIGN_BYCSTR  QSTR_INIT_BYCSTR
 #define QSTR_ASSIGN_BYCHAR  QSTR_INIT_BYCHAR
 
-typedef qmemory qstring;
-typedef qmemory_iterator qstring_iterator;
-typedef qmem_t  qstr_t;
-typedef qmem_iter_t qstr_iter_t;
+/*
+ * A qstring keeps its characters contiguously with the length in
+ * front, and always ends them with '\0'. Strings up to
+ * QSTR_INLINE_MAX characters live inside the structure itself, so a
+ * short identifier costs a single allocation. Longer ones move to a
+ * heap buffer which grows by doubling.
+ */
+#define QSTR_INLINE_MAX     22
+
+/*
+ * What the bytes of a string are as UTF-8. The state is cached in the
+ * string like the hash code. Appending ASCII characters keeps it, so
+ * ASCII text is never scanned.
+ */
+#define QSTR_UTF8_UNKNOWN   0
+#define QSTR_UTF8_ASCII     1
+#define QSTR_UTF8_VALID     2	/* valid, not all ASCII */
+#define QSTR_UTF8_INVALID   3
+
+struct qstring_struct {
+    size_t             len;	    /* number of characters */
+    size_t             cap;	    /* bytes of heap buffer, 0 if inline */
+    _Atomic uint64_t hashcode;	    /* cached hash, 0 if none */
+    _Atomic unsigned char utf8;	    /* QSTR_UTF8_*, cached */
+    union {
+        char         *heap;
+        char        inline_buf[QSTR_INLINE_MAX + 2];
+    };
+};
+
+struct qstring_iterator {
+    const struct qstring_struct *source;
+    size_t                          pos;
+};
+
+typedef struct qstring_struct *qstring;
+typedef struct qstring_iterator qstring_iterator;
+typedef qstring qstr_t;
+typedef qstring_iterator qstr_iter_t;
 
 qstr_t qstr_create(int init_type, ...);
 void   qstr_assign(qstr_t item, int assign_type, ...);
 qstr_t qstr_sub(const qstr_t item, size_t start, size_t length);
+qstr_t qstr_duplicate(const qstr_t item);
+
+/*
+ * Replace the content of item with the decimal form of value.
+ * Doubles are written in the shortest form reading back to the same
+ * value, with an exponent only when very large or small, e.g. "0.1",
+ * "1e+21", "-inf", "nan".
+ */
+void   qstr_assign_int64(qstr_t item, int64_t value);
+void   qstr_assign_double(qstr_t item, double value);
+
+/*
+ * Write value to dst without '\0' and return the number of characters.
+ * qstr_fmt_fixed gives the same text as printf("%.*f", prec, value).
+ * dst must have room for QSTR_FMT_INT_MAX or QSTR_FMT_FIXED_MAX bytes.
+ */
+#define QSTR_FMT_INT_MAX    20
+#define QSTR_FMT_PREC_MAX   9
+#define QSTR_FMT_FIXED_MAX  (1 + 309 + 1 + QSTR_FMT_PREC_MAX + 1)
+
+size_t qstr_fmt_int64(char *dst, int64_t value);
+size_t qstr_fmt_fixed(char *dst, double value, int prec);
+
+/*
+ * Raw characters of item, ended with '\0'.
+ */
+static inline char *
+qstr_data(const qstr_t item)
+{
+    return item->cap != 0 ? item->heap : (char *)item->inline_buf;
+}
 
-#define qstr_duplicate(item) \
-qmem_duplicate(item)
+/*
+ * Make item able to hold len characters without growing again.
+ */
+void qstr_reserve(qstr_t item, size_t len);
 
 /*
  * Append a copy of str to the end of item.
  */
 qstr_t qstr_append(qstr_t item, qstr_t str);
 
-#define qstr_push(item, ch) \
-qmem_append(item, ch, char)
+/*
+ * Append the first n characters of str to the end of item.
+ */
+qstr_t qstr_append_cstr_n(qstr_t item, const char *str, size_t n);
 
-#define qstr_len(item) \
-qmem_len(item)
+/*
+ * Every function changing the content of a qstr_t must drop the
+ * cached hash code, see qstr_hash below, and the UTF-8 state unless it
+ * is known to stay the same.
+ */
+static inline void
+qstr_push(qstr_t item, char ch)
+{
+    size_t room = item->cap != 0 ? item->cap - 1 : QSTR_INLINE_MAX;
+    if (item->len >= room) {
+        qstr_reserve(item, item->len + 1);
+    }
+    char *data = qstr_data(item);
+    data[item->len++] = ch;
+    data[item->len] = '\0';
+    atomic_store_explicit(&item->hashcode, 0, memory_order_relaxed);
+    if ((unsigned char)ch >= 0x80) {
+        atomic_store_explicit(&item->utf8, QSTR_UTF8_UNKNOWN, memory_order_relaxed);
+    }
+}
 
-#define qstr_lessen(item, dst_len) \
-qmem_lessen(item, dst_len)
+static inline size_t
+qstr_len(const qstr_t item)
+{
+    return item->len;
+}
+
+void qstr_lessen(qstr_t item, size_t dst_len);
 
 #define qstr_empty(item) \
-qmem_empty(item)
+((item) != NULL && (item)->len == 0)
 
 #define qstr_clear(item) \
-qmem_clear(item)
+qstr_lessen(item, 0)
 
-#define qstr_free(item) \
-qmem_free(item)
+void qstr_free(qstr_t item);
 
 /*
  * If no pattern is found, these functions return -1
@@ -66,23 +162,172 @@ int qstr_find_cstr(const qstr_t text, const char *pattern);
 int qstr_find_qstr(const qstr_t text, const qstr_t pattern);
 
 /*
- * The function returns difference of first different position
+ * The function returns difference of first different position, or
+ * -1/1 when str1 is a proper prefix of str2 or the other way round.
  */
 int qstr_comp(const qstr_t str1, const qstr_t str2);
 int qstr_ccomp(const qstr_t str1, const char * str2);
 
+/*
+ * Whether str1 and str2 hold the same characters. Strings of different
+ * lengths are told apart without looking at the characters.
+ */
+static inline bool
+qstr_equal(const qstr_t str1, const qstr_t str2)
+{
+    return str1->len == str2->len &&
+           !memcmp(qstr_data(str1), qstr_data(str2), str1->len);
+}
+
 void qstr_print(const qstr_t item, FILE *fp);
 
-#define qstr_iter_new(dst) \
-qmem_iter_new(dst)
+/*
+ * Seeded hash of the whole string, consuming a 64-bit word each step.
+ * The result is cached in the string until it is modified, so keys
+ * stored in a qmap are hashed only once.
+ *
+ * Threads may hash the same string at once: the cache is atomic, and
+ * all of them store the same value. The string must not be modified
+ * meanwhile, as for any other reader.
+ *
+ * The seed is picked at random on first use, by whichever thread
+ * hashes first. Call qstr_hash_seed before hashing any string, and
+ * before starting other threads, to get reproducible values.
+ */
+uint64_t qstr_hash(const qstr_t item);
+void     qstr_hash_seed(uint64_t seed);
+
+static inline qstr_iter_t
+qstr_iter_new(const qstr_t dst)
+{
+    return (qstr_iter_t) { dst, 0 };
+}
 
 #define qstr_iter_getval(item) \
-qmem_iter_getval(item, char)
+(qstr_data((qstr_t)(item).source)[(item).pos])
 
 #define qstr_iter_end(item) \
-qmem_iter_end(item)
+((item).pos >= (item).source->len)
 
 #define qstr_iter_forward(item) \
-qmem_iter_forward(item)
+((item)->pos += (item)->pos < (item)->source->len)
+
+#define qstr_iter_seek(item, k) \
+((item)->pos = (k))
+
+/*
+ * A qstr_view_t is a read-only window of characters owned by someone
+ * else: a qstr_t, a C string or any mapped buffer. Making one, or a
+ * sub-view of one, copies nothing. A view of a qstr_t is valid until
+ * the string is modified or freed.
+ */
+typedef struct {
+    const char *data;
+    size_t       len;
+} qstr_view_t;
+
+static inline qstr_view_t
+qstr_view(const qstr_t item)
+{
+    return (qstr_view_t) { qstr_data(item), item->len };
+}
+
+static inline qstr_view_t
+qstr_view_n(const char *data, size_t len)
+{
+    return (qstr_view_t) { data, len };
+}
+
+static inline qstr_view_t
+qstr_view_cstr(const char *str)
+{
+    return (qstr_view_t) { str, strlen(str) };
+}
+
+/*
+ * Like qstr_sub, the part out of range is cut.
+ */
+static inline qstr_view_t
+qstr_view_sub(qstr_view_t view, size_t start, size_t length)
+{
+    if (start >= view.len) {
+        return (qstr_view_t) { view.data + view.len, 0 };
+    }
+    if (length > view.len - start) {
+        length = view.len - start;
+    }
+    return (qstr_view_t) { view.data + start, length };
+}
+
+static inline bool
+qstr_view_equal(qstr_view_t str1, qstr_view_t str2)
+{
+    return str1.len == str2.len && !memcmp(str1.data, str2.data, str1.len);
+}
+
+/*
+ * The same as the qstr_t versions above. qstr_view_hash gives the
+ * same value as qstr_hash for the same characters, but caches nothing.
+ */
+int      qstr_view_find_char(qstr_view_t text, const char pattern);
+int      qstr_view_find(qstr_view_t text, qstr_view_t pattern);
+int      qstr_view_comp(qstr_view_t str1, qstr_view_t str2);
+uint64_t qstr_view_hash(qstr_view_t item);
+void     qstr_view_print(qstr_view_t item, FILE *fp);
+
+/*
+ * Copy the characters of a view into a new string.
+ */
+qstr_t   qstr_create_view(qstr_view_t view);
+
+/*
+ * Check the bytes of view as UTF-8, giving QSTR_UTF8_ASCII,
+ * QSTR_UTF8_VALID or QSTR_UTF8_INVALID. Overlong forms, surrogates and
+ * codepoints past U+10FFFF are invalid. On x86 with SSSE3, 16 bytes
+ * are checked each step.
+ */
+int      qstr_view_utf8_check(qstr_view_t view);
+
+/*
+ * Threads may ask for the kind of the same string at once, as for its
+ * hash: the cache is atomic, and all of them store the same value.
+ */
+static inline int
+qstr_utf8_kind(const qstr_t item)
+{
+    int kind = atomic_load_explicit(&item->utf8, memory_order_relaxed);
+    if (kind == QSTR_UTF8_UNKNOWN) {
+        kind = qstr_view_utf8_check(qstr_view(item));
+        atomic_store_explicit(&item->utf8, (unsigned char)kind, memory_order_relaxed);
+    }
+    return kind;
+}
+
+#define qstr_is_ascii(item) \
+(qstr_utf8_kind(item) == QSTR_UTF8_ASCII)
+
+#define qstr_utf8_valid(item) \
+(qstr_utf8_kind(item) != QSTR_UTF8_INVALID)
+
+/*
+ * Number of codepoints in item. Bytes of a malformed sequence count
+ * one each, the same as qstr_iter_next_cp steps over them.
+ */
+size_t   qstr_utf8_len(const qstr_t item);
+
+/*
+ * Decode the codepoint at iter and move past it. A malformed sequence
+ * gives QSTR_UTF8_REPLACEMENT and moves one byte only. Returns
+ * QSTR_UTF8_REPLACEMENT at the end as well, check qstr_iter_end first.
+ */
+#define QSTR_UTF8_REPLACEMENT 0xFFFD
+
+uint32_t qstr_iter_next_cp(qstr_iter_t *iter);
+
+/*
+ * Append the UTF-8 form of codepoint cp, or of QSTR_UTF8_REPLACEMENT if
+ * cp is a surrogate or out of range.
+ */
+void     qstr_push_cp(qstr_t item, uint32_t cp);
 
 #endif				// MAOLANG_QSTR_H_
@@ -0,0 +1,172 @@
+/*
+ * qwriter.c
+ *
+ * Implementations of qwriter_t type.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "qwriter.h"
+#include "error.h"
+
+qwriter_t
+qwriter_create_sized(int fd, size_t capacity)
+{
+    qwriter_t res = qalloc_tag(sizeof(struct qwriter_struct), QALLOC_BUFFER);
+    /*
+     * Leave room for any single formatted number.
+     */
+    if (capacity < QSTR_FMT_FIXED_MAX) {
+        capacity = QSTR_FMT_FIXED_MAX;
+    }
+    res->fd = fd;
+    res->len = 0;
+    res->cap = capacity;
+    res->buf = qalloc_tag(capacity, QALLOC_BUFFER);
+    res->observer = NULL;
+    return res;
+}
+
+void
+qwriter_free(qwriter_t item)
+{
+    if (item == NULL) {
+        return;
+    }
+    qwriter_flush(item);
+    qfree(item->buf, item->cap, QALLOC_BUFFER);
+    qfree(item, sizeof(struct qwriter_struct), QALLOC_BUFFER);
+}
+
+/*
+ * Write all of iov, going on after short writes and signals.
+ */
+static int
+qwriter_writev_all(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t done = writev(fd, iov, cnt);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (cnt > 0 && (size_t)done >= iov->iov_len) {
+            done -= (ssize_t)iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= (size_t)done;
+        }
+    }
+    return 0;
+}
+
+static int
+qwriter_send(qwriter_t item, struct iovec *iov, int cnt)
+{
+    size_t bytes = 0;
+    int    res;
+    
+    if (item->observer == NULL) {
+        return qwriter_writev_all(item->fd, iov, cnt);
+    }
+    for (int i = 0; i < cnt; ++i) {
+        bytes += iov[i].iov_len;
+    }
+    item->observer(bytes, false);
+    res = qwriter_writev_all(item->fd, iov, cnt);
+    item->observer(bytes, true);
+    return res;
+}
+
+/*
+ * Grow the buffer of a memory writer to hold n more bytes.
+ */
+static void
+qwriter_grow(qwriter_t item, size_t n)
+{
+    size_t cap = item->cap;
+    
+    while (cap - item->len < n) {
+        cap *= 2;
+    }
+    item->buf = qrealloc_tag(item->buf, item->cap, cap, QALLOC_BUFFER);
+    item->cap = cap;
+}
+
+int
+qwriter_flush(qwriter_t item)
+{
+    assert(item != NULL);
+    if (item->fd == QWRITER_MEMORY) {
+        /* Called for room, which is all a memory writer needs */
+        if (item->cap - item->len < QSTR_FMT_FIXED_MAX) {
+            qwriter_grow(item, QSTR_FMT_FIXED_MAX);
+        }
+        return 0;
+    }
+    struct iovec iov = { item->buf, item->len };
+    int          res = item->len != 0 ? qwriter_send(item, &iov, 1) : 0;
+    
+    item->len = 0;
+    return res;
+}
+
+void
+qwriter_write(qwriter_t item, const char *data, size_t n)
+{
+    assert(item != NULL);
+    if (n <= item->cap - item->len) {
+        memcpy(item->buf + item->len, data, n);
+        item->len += n;
+        return;
+    }
+    if (item->fd == QWRITER_MEMORY) {
+        qwriter_grow(item, n);
+        memcpy(item->buf + item->len, data, n);
+        item->len += n;
+        return;
+    }
+    struct iovec iov[2] = {
+        { item->buf, item->len },
+        { (void *)data, n }
+    };
+    qwriter_send(item, item->len != 0 ? iov : iov + 1, item->len != 0 ? 2 : 1);
+    item->len = 0;
+}
+
+void
+qwriter_write_qstr(qwriter_t item, const qstr_t str)
+{
+    assert(str != NULL);
+    const char *data = qstr_data(str);
+    const char *stop = memchr(data, '\0', qstr_len(str));
+    
+    qwriter_write(item, data, stop != NULL ? (size_t)(stop - data) : qstr_len(str));
+}
+
+void
+qwriter_int64(qwriter_t item, int64_t value)
+{
+    if (item->cap - item->len < QSTR_FMT_INT_MAX) {
+        qwriter_flush(item);
+    }
+    item->len += qstr_fmt_int64(item->buf + item->len, value);
+}
+
+void
+qwriter_fixed(qwriter_t item, double value, int prec)
+{
+    if (item->cap - item->len < QSTR_FMT_FIXED_MAX) {
+        qwriter_flush(item);
+    }
+    item->len += qstr_fmt_fixed(item->buf + item->len, value, prec);
+}
@@ -0,0 +1,85 @@
+/*
+ * qwriter.h
+ *
+ * Definition of qwriter_t type, a buffered writer on a file
+ * descriptor. Output is gathered in a large user-space buffer and
+ * handed to write(2) only when the buffer is full or on
+ * qwriter_flush, without the locking and format parsing of stdio.
+ * Numbers are formatted straight into the buffer.
+ *
+ * A writer is not thread-safe, and nothing is written before
+ * qwriter_flush or qwriter_free unless the buffer fills up.
+ *
+ * A writer on QWRITER_MEMORY writes nothing: its buffer grows instead,
+ * and everything written stays in buf.
+ *
+ * type: qwriter_t
+ */
+
+#ifndef MAOLANG_QWRITER_H_
+#define MAOLANG_QWRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "qstring.h"
+
+#define QWRITER_LEN_DEFAULT 65536
+#define QWRITER_MEMORY      (-1)
+
+struct qwriter_struct {
+    int                    fd;
+    size_t                len;	/* bytes waiting in buf */
+    size_t                cap;
+    char                 *buf;
+    /*
+     * If set, called just before each write(2) with done false and
+     * just after it with done true, for tracing.
+     */
+    void (*observer)(size_t bytes, bool done);
+};
+
+typedef struct qwriter_struct * qwriter_t;
+
+qwriter_t qwriter_create_sized(int fd, size_t capacity);
+
+#define qwriter_create(fd) (qwriter_create_sized(fd, QWRITER_LEN_DEFAULT))
+
+/*
+ * Flush, then free the writer. The descriptor is left open.
+ */
+void qwriter_free(qwriter_t item);
+
+/*
+ * Write everything buffered so far. Return -1 if write(2) failed, in
+ * which case the buffered bytes are dropped.
+ */
+int  qwriter_flush(qwriter_t item);
+
+/*
+ * Data longer than the free room is sent together with the buffered
+ * bytes in one writev(2) instead of being copied.
+ */
+void qwriter_write(qwriter_t item, const char *data, size_t n);
+
+static inline void
+qwriter_putc(qwriter_t item, char ch)
+{
+    if (item->len == item->cap) {
+        qwriter_flush(item);
+    }
+    item->buf[item->len++] = ch;
+}
+
+/*
+ * Characters of str up to its first '\0', like qstr_print.
+ */
+void qwriter_write_qstr(qwriter_t item, const qstr_t str);
+
+/*
+ * The same text as printf("%lld") and printf("%.*f").
+ */
+void qwriter_int64(qwriter_t item, int64_t value);
+void qwriter_fixed(qwriter_t item, double value, int prec);
+
+#endif //MAOLANG_QWRITER_H_
@@ -14,88 +14,150 @@
 #include "error.h"
 #include "lex.h"
 
-static int line_count = 1;
 static const char * ops = "+-*=";   /* operators */
 static const char * pcs = "(),;";   /* punctuations */
 
-static struct token lex_identifier (FILE *fp, char ch);
-static void         lex_comment    (FILE *fp, char ch, bool singlelined);
-static struct token lex_string     (FILE *fp, char ch);
-static struct token lex_operator   (FILE *fp, char ch);
-static struct token lex_number     (FILE *fp, char ch);
-static struct token lex_punctuation(FILE *fp, char ch);
-static void         lex_unknown    (char ch);
+static struct token lex_identifier (mao_state st, FILE *fp, int ch);
+static void         lex_comment    (mao_state st, FILE *fp, int ch, bool singlelined);
+static struct token lex_string     (mao_state st, FILE *fp, int ch);
+static struct token lex_operator   (mao_state st, FILE *fp, int ch);
+static struct token lex_number     (mao_state st, FILE *fp, int ch);
+static struct token lex_punctuation(mao_state st, FILE *fp, int ch);
+static void         lex_unknown    (mao_state st, char ch);
 static char         escape         (char ch);
 
+/*
+ * Bytes from 0x80 up belong to UTF-8 sequences, which are allowed in
+ * identifiers and checked when the identifier is complete.
+ */
+#define is_ident_start(ch) \
+(isalpha((unsigned char)(ch)) || (ch) == '_' || (unsigned char)(ch) >= 0x80)
+
+#define is_ident_char(ch) \
+(isalnum((unsigned char)(ch)) || (ch) == '_' || (unsigned char)(ch) >= 0x80)
+
 /*
  * Main function of scanner.
  * It chooses the right function considering the first character of
  * each token, using `ungetc` for backtracking.
+ *
+ * Each call returns the next token, and a TOKEN_END token when the
+ * input is over.
  */
-qmem_t
-mao_lex_analyze(FILE *fp)
+struct token
+mao_lex_next(mao_state st, FILE *fp)
 {
-    char tmp, ch;
-    qmem_t res = qmem_create(struct token);
+    int  tmp, ch;
     
     while ((ch = fgetc(fp)) != EOF) {
         
-        if (isalpha(ch) || ch == '_') {
-            qmem_append(res, lex_identifier(fp, ch), struct token);
+        if (is_ident_start(ch)) {
+            return lex_identifier(st, fp, ch);
             
         } else if (ch == '/') {
             tmp = fgetc(fp);
             if (tmp == '*') {
-                lex_comment(fp, fgetc(fp), false);
+                lex_comment(st, fp, fgetc(fp), false);
             } else if (tmp == '/') {
-                lex_comment(fp, fgetc(fp), true);
+                lex_comment(st, fp, fgetc(fp), true);
             } else {
                 ungetc(tmp, fp);
-                qmem_append(res, lex_operator(fp, ch), struct token);
+                return lex_operator(st, fp, ch);
             }
             
         } else if (strchr(ops, ch)) {
-            qmem_append(res, lex_operator(fp, ch), struct token);
+            return lex_operator(st, fp, ch);
             
         } else if (ch == '\"') {
-            qmem_append(res, lex_string(fp, fgetc(fp)), struct token);
+            return lex_string(st, fp, fgetc(fp));
             
         } else if (strchr(pcs, ch)) {
-            qmem_append(res, lex_punctuation(fp, ch), struct token);
+            return lex_punctuation(st, fp, ch);
             
-        } else if (ch == '.' || isdigit(ch)) {
-            qmem_append(res, lex_number(fp, ch), struct token);
+        } else if (ch == '.' || isdigit((unsigned char)ch)) {
+            return lex_number(st, fp, ch);
             
         } else if (ch == '\n') {
-            ++line_count;
+            ++st->line_count;
 
-        } else if (!isspace(ch)) {
-            lex_unknown(ch);
+        } else if (!isspace((unsigned char)ch)) {
+            lex_unknown(st, ch);
         }
     }
     /* End flag */
-    struct token tmp_end;
-    tmp_end.type = TOKEN_END;
-    qmem_append(res, tmp_end, struct token);
+    return (struct token) {
+        TOKEN_END, st->line_count, .name = NULL
+    };
+}
+
+/*
+ * Scan the whole input into a token stream.
+ */
+qmem_t
+mao_lex_analyze(mao_state st, FILE *fp)
+{
+    qmem_t res = qmem_create_growing(struct token);
+    qmem_set_tag(res, QALLOC_TOKEN);
+    mao_lex_append(st, fp, res);
     return res;
 }
 
+void
+mao_lex_append(mao_state st, FILE *fp, qmem_t stream)
+{
+    struct token tok;
+    
+    do {
+        tok = mao_lex_next(st, fp);
+        qmem_append(stream, tok, struct token);
+    } while (tok.type != TOKEN_END);
+}
+
+void
+mao_lex_free_token(struct token tok)
+{
+    if (tok.type == TOKEN_IDENTIFIER || tok.type == TOKEN_LITERAL) {
+        qstr_free(tok.name);
+    }
+}
+
+void
+mao_lex_clear(qmem_t stream)
+{
+    for (qmem_iter_t i = qmem_iter_new(stream); !qmem_iter_end(i); qmem_iter_forward(&i)) {
+        mao_lex_free_token(qmem_iter_getval(i, struct token));
+    }
+    qmem_clear(stream);
+}
+
+void
+mao_lex_free(qmem_t stream)
+{
+    mao_lex_clear(stream);
+    qmem_free(stream);
+}
+
 /*
  * Saving identifiers and judge whether it is a keyword.
  */
 static struct token
-lex_identifier(FILE *fp, char ch)
+lex_identifier(mao_state st, FILE *fp, int ch)
 {
     qstr_t  currentname;
     int     currenttype;
     bool    iskeyword;
     
     currentname = qstr_create(QSTR_INIT_BYNONE);
-    while (ch != EOF && (isalnum(ch) || ch == '_')) {
+    while (ch != EOF && is_ident_char(ch)) {
         qstr_push(currentname, ch);
         ch = fgetc(fp);
     }
     
+    /* Costs nothing for ASCII names, see QSTR_UTF8_ASCII */
+    if (!qstr_utf8_valid(currentname)) {
+        add_err_queue(st, "line %u: Identifier is not valid UTF-8.\n", st->line_count);
+    }
+    
     iskeyword = true;
     
     if (!qstr_ccomp(currentname, "int")) {
@@ -116,13 +178,13 @@ lex_identifier(FILE *fp, char ch)
     ungetc(ch, fp);
     
     return (struct token) {
-        currenttype, line_count, .name = currentname
+        currenttype, st->line_count, .name = currentname
     };
 }
 
 /* Mao supports both C and C++ style comments. */
 static void
-lex_comment(FILE *fp, char ch, bool singlelined)
+lex_comment(mao_state st, FILE *fp, int ch, bool singlelined)
 {
     bool comment_end = false;
     if (singlelined) {
@@ -133,7 +195,7 @@ lex_comment(FILE *fp, char ch, bool singlelined)
         } while ((ch = fgetc(fp)) != EOF);
         
     } else {
-        char tmp;
+        int  tmp;
         do {
             if (ch == '*') {
                 tmp = fgetc(fp);
@@ -149,7 +211,7 @@ lex_comment(FILE *fp, char ch, bool singlelined)
     
     /* When the multi-line comment doesn't end validly */
     if (!comment_end) {
-        add_err_queue("line %u: Multi-line comment doesn't have an end.\n", line_count);
+        add_err_queue(st, "line %u: Multi-line comment doesn't have an end.\n", st->line_count);
     }
 }
 
@@ -182,7 +244,7 @@ escape(char ch)
 
 /* Parse string literal between " in source code. */
 static struct token
-lex_string(FILE *fp, char ch)
+lex_string(mao_state st, FILE *fp, int ch)
 {
     qstr_t  currentname = qstr_create(QSTR_INIT_BYNONE);
     bool string_end = false;
@@ -199,18 +261,21 @@ lex_string(FILE *fp, char ch)
     } while ((ch = fgetc(fp)) != EOF && ch != '\n');
     
     if (!string_end) {
-        add_err_queue("line %u: Multirow string literal is not valid.\n", line_count);
+        add_err_queue(st, "line %u: Multirow string literal is not valid.\n", st->line_count);
+    }
+    if (!qstr_utf8_valid(currentname)) {
+        add_err_queue(st, "line %u: String literal is not valid UTF-8.\n", st->line_count);
     }
     
     return (struct token) {
-        TOKEN_LITERAL, line_count, .name = currentname
+        TOKEN_LITERAL, st->line_count, .name = currentname
     };
 }
 
 static struct token
-lex_operator(FILE *fp, char ch)
+lex_operator(mao_state st, FILE *fp, int ch)
 {
-    char tmp         = fgetc(fp);
+    int  tmp         = fgetc(fp);
     int  currenttype = TOKEN_UNKNOWN;
     
     switch (ch) {
@@ -237,7 +302,7 @@ lex_operator(FILE *fp, char ch)
     }
     
     return (struct token) {
-        currenttype, line_count, .name = NULL
+        currenttype, st->line_count, .name = NULL
     };
 }
 
@@ -253,14 +318,14 @@ lex_operator(FILE *fp, char ch)
  * as a single operator. That will be parsed in the parsing process.
  */
 static struct token
-lex_number(FILE *fp, char ch)
+lex_number(mao_state st, FILE *fp, int ch)
 {
-    static char buf[31];
+    char      *buf = st->number_buf;
     bool   isfloat = false;
     bool    hasexp = false;
     size_t   index = 0;
     
-    while (ch != EOF && isdigit(ch)) {
+    while (ch != EOF && isdigit((unsigned char)ch)) {
         if (index <= 30) {
             buf[index++] = ch;
         }
@@ -274,7 +339,7 @@ lex_number(FILE *fp, char ch)
                 buf[index++] = ch;
             }
             ch = fgetc(fp);
-        } while (ch != EOF && isdigit(ch));
+        } while (ch != EOF && isdigit((unsigned char)ch));
     }
     
     if (ch == 'E' || ch == 'e') {
@@ -292,7 +357,7 @@ lex_number(FILE *fp, char ch)
     }
     
     if (hasexp) {
-        while (ch != EOF && isdigit(ch)) {
+        while (ch != EOF && isdigit((unsigned char)ch)) {
             if (index <= 30) {
                 buf[index++] = ch;
             }
@@ -301,7 +366,7 @@ lex_number(FILE *fp, char ch)
     }
     if (index >= 30) {
         buf[30] = '\0';
-        add_err_queue("line %u: Lengthy number will be cut as '%s' and result is undefined.\n", line_count,buf);
+        add_err_queue(st, "line %u: Lengthy number will be cut as '%s' and result is undefined.\n", st->line_count,buf);
     } else {
         buf[index] = '\0';
     }
@@ -309,17 +374,17 @@ lex_number(FILE *fp, char ch)
     
     if (isfloat) {
         return (struct token) {
-            TOKEN_NUMBER_FLOAT, line_count, .dval = atof(buf)
+            TOKEN_NUMBER_FLOAT, st->line_count, .dval = atof(buf)
         };
     } else {
         return (struct token) {
-            TOKEN_NUMBER_INT, line_count, .ival = atoi(buf)
+            TOKEN_NUMBER_INT, st->line_count, .ival = atoi(buf)
         };
     }
 }
 
 static struct token
-lex_punctuation(FILE *fp, char ch)
+lex_punctuation(mao_state st, FILE *fp, int ch)
 {
     int currenttype = TOKEN_UNKNOWN;
     switch (ch) {
@@ -339,12 +404,12 @@ lex_punctuation(FILE *fp, char ch)
             break;
     }
     return (struct token) {
-        currenttype, line_count, .name = NULL
+        currenttype, st->line_count, .name = NULL
     };
 }
 
 static void
-lex_unknown(char ch)
+lex_unknown(mao_state st, char ch)
 {
-    add_err_queue("line %u: Unknown character '%c'.\n", line_count, ch);
+    add_err_queue(st, "line %u: Unknown character '%c'.\n", st->line_count, ch);
 }
@@ -9,6 +9,8 @@
 #define MAOLANG_LEX_H_
 
 #include "infra/qstring.h"
+#include "infra/qwriter.h"
+#include "runtime.h"
 
 #define TOKEN_TYPE_INT      0x001
 #define TOKEN_TYPE_DOUBLE   0x002
@@ -45,8 +47,6 @@
 #define TOKEN_COMMA         0x0C7
 #define TOKEN_SEMICOLON     0x0CA
 
-qmem_t mao_lex_analyze(FILE *fp);
-
 struct token {
     int type;
     unsigned line;
@@ -57,6 +57,36 @@ struct token {
     };
 };
 
-int mao_parse(qmem_t stream, FILE *fp);
+struct token mao_lex_next(mao_state st, FILE *fp);
+qmem_t mao_lex_analyze(mao_state st, FILE *fp);
+
+/*
+ * As mao_lex_analyze, into a stream of the caller, which keeps what was
+ * lexed if a fatal error jumps out in the middle.
+ */
+void   mao_lex_append(mao_state st, FILE *fp, qmem_t stream);
+
+/*
+ * Free the name of tok, if it has one.
+ */
+void mao_lex_free_token(struct token tok);
+
+/*
+ * Free the names of the tokens in stream, and then empty it or free
+ * it altogether.
+ */
+void mao_lex_clear(qmem_t stream);
+void mao_lex_free(qmem_t stream);
+
+/*
+ * Run the statements of stream, printing to st->out.
+ */
+int mao_parse(mao_state st, qmem_t stream);
+
+/*
+ * Lex in a thread of its own and parse each statement as soon as its
+ * tokens arrive. The output is the same as mao_parse(mao_lex_analyze()).
+ */
+int mao_parse_pipelined(mao_state st, FILE *in);
 
 #endif      //MAOLANG_LEX_H_
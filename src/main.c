@@ -7,34 +7,215 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "infra/qmemory.h"
+#include "infra/qarena.h"
 #include "lex.h"
-#include "runtime.h"
-#include "expr.h"
+#include "mao.h"
+#include "batch.h"
+#include "profile.h"
 
-qmem_t global_memory_list;
-qmap_t variable_list;
+/*
+ * The output is flushed from an atexit handler, so it is all out
+ * before the report of --profile or the trace is written.
+ */
+static qwriter_t out_writer;
+
+static void
+flush_output(void)
+{
+    qwriter_flush(out_writer);
+}
+
+static void
+print_mem_stats(void)
+{
+    qalloc_stats_print(stderr);
+}
+
+static void
+print_profile(void)
+{
+    mao_prof_report(stderr);
+}
+
+/*
+ * Registered before flush_output, so it runs after it and the last
+ * flush is in the trace.
+ */
+static int trace_fd = -1;
+
+static void
+write_trace(void)
+{
+    mao_prof_trace_write(trace_fd);
+    close(trace_fd);
+}
+
+/*
+ * The allocator backend chosen on the command line lives as long as
+ * the program.
+ */
+static qallocator_t     arena_backend;
+static qallocator_t     capped_backend;
+static struct qalloc_cap mem_cap;
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--pipeline] [--mem-stats] [--arena] "
+            "[--mem-limit=BYTES] [--profile[=TOP]] [--trace=FILE] [file]\n"
+            "       %s --jobs N [--pipeline] [--mem-stats] [--arena] [--mem-limit=BYTES] "
+            "[--split] [--manifest=FILE] [file]...\n", name, name);
+    exit(1);
+}
 
 int main(int argc, const char * argv[])
 {
-    global_memory_list = qmem_create(void*);
-    variable_list      = qmap_create(mvar);
-    FILE *out_fp       = stdout;
-    FILE *fp;
+    FILE *fp           = stdin;
+    const char *path   = NULL;
+    mao_state st;
+    bool pipeline      = false;
+    bool arena         = false;
+    size_t mem_limit   = 0;
+    unsigned prof_top  = 0;
+    const char *trace_path = NULL;
+    unsigned jobs      = 0;
+    bool split         = false;
+    const char *manifest = NULL;
+    int files          = 0;
 
-    if (argc == 1) {
-        fp = stdin;
-    } else {
-        if ((fp = fopen(argv[1], "r")) == NULL) {
-            perror(argv[1]);
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--pipeline")) {
+            pipeline = true;
+        } else if (!strcmp(argv[i], "--mem-stats")) {
+            /* Before anything is allocated, see error.h */
+            qalloc_stats_enable();
+            atexit(print_mem_stats);
+        } else if (!strcmp(argv[i], "--profile") || !strncmp(argv[i], "--profile=", 10)) {
+            int top = argv[i][9] == '=' ? atoi(argv[i] + 10) : 20;
+            if (top <= 0) {
+                usage(argv[0]);
+            }
+            prof_top = (unsigned)top;
+        } else if (!strncmp(argv[i], "--trace=", 8) && argv[i][8] != '\0') {
+            if (trace_path != NULL) {
+                usage(argv[0]);
+            }
+            trace_path = argv[i] + 8;
+        } else if (!strcmp(argv[i], "--jobs") || !strncmp(argv[i], "--jobs=", 7)) {
+            const char *value = argv[i][6] == '=' ? argv[i] + 7 : i + 1 < argc ? argv[++i] : "";
+            int n = atoi(value);
+            if (n <= 0) {
+                usage(argv[0]);
+            }
+            jobs = (unsigned)n;
+        } else if (!strcmp(argv[i], "--split")) {
+            split = true;
+        } else if (!strncmp(argv[i], "--manifest=", 11) && argv[i][11] != '\0') {
+            manifest = argv[i] + 11;
+        } else if (!strcmp(argv[i], "--arena")) {
+            arena = true;
+        } else if (!strncmp(argv[i], "--mem-limit=", 12)) {
+            char *end;
+            mem_limit = strtoull(argv[i] + 12, &end, 10);
+            if (end == argv[i] + 12 || *end != '\0' || mem_limit == 0) {
+                usage(argv[0]);
+            }
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            usage(argv[0]);
+        } else if (path == NULL) {
+            path = argv[i];
+            ++files;
+        } else {
+            ++files;
+        }
+    }
+
+    /*
+     * The profile and the trace follow one interpreter, and the other
+     * options are for --jobs.
+     */
+    if (jobs == 0 ? files > 1 || split || manifest != NULL :
+        prof_top != 0 || trace_path != NULL) {
+        usage(argv[0]);
+    }
+    if (prof_top != 0) {
+        mao_prof_enable(prof_top);
+        atexit(print_profile);
+    }
+    if (trace_path != NULL) {
+        if ((trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            perror(trace_path);
             exit(1);
         }
+        mao_prof_trace_enable();
+        atexit(write_trace);
+    }
+
+    if (arena) {
+        arena_backend = qarena_allocator(qarena_create(NULL, 0, pipeline || jobs != 0));
+        qalloc_set_backend(&arena_backend);
+    }
+    if (mem_limit != 0) {
+        capped_backend = qalloc_capped(&mem_cap, qalloc_backend(), mem_limit);
+        qalloc_set_backend(&capped_backend);
     }
 
-    qmem_t res = mao_lex_analyze(fp);
-    mao_parse(res, out_fp);
+    if (jobs != 0) {
+        qmem_t paths = qmem_create(const char *);
+
+        for (int i = 1; i < argc; ++i) {
+            if (argv[i][0] == '-' && argv[i][1] == '-') {
+                i += !strcmp(argv[i], "--jobs");
+            } else {
+                qmem_append(paths, argv[i], const char *);
+            }
+        }
+        if (manifest != NULL && mao_batch_manifest(paths, manifest) < 0) {
+            perror(manifest);
+            exit(1);
+        }
+        if (qmem_len(paths) == 0) {
+            usage(argv[0]);
+        }
+        return mao_batch_run(paths, jobs, pipeline, split) != 0;
+    }
+
+    if (path != NULL) {
+        if ((fp = fopen(path, "r")) == NULL) {
+            perror(path);
+            exit(1);
+        }
+    }
+
+    /* Never destroyed, so --mem-stats sees what the script left */
+    st = mao_state_create(stderr);
+    out_writer = qwriter_create(STDOUT_FILENO);
+    if (trace_fd >= 0) {
+        out_writer->observer = mao_prof_flush;
+    }
+    atexit(flush_output);
+
+    /*
+     * Not through mao_run: a fatal error ends the program with exit(1)
+     * from mao_fail, and the tokens are left for the exit to reclaim
+     * instead of freeing every name of a large script one by one.
+     */
+    st->out = out_writer;
+    if (pipeline) {
+        mao_parse_pipelined(st, fp);
+    } else {
+        qmem_t res = mao_lex_analyze(st, fp);
+        mao_prof_mark(PROF_LEX);
+        mao_prof_tokens(qmem_len(res));
+        mao_parse(st, res);
+    }
 
-    if (argc != 1) {
+    if (path != NULL) {
         fclose(fp);
     }
 
@@ -0,0 +1,107 @@
+/*
+ * mao.c
+ *
+ * Creating, running and destroying interpreters, see mao.h.
+ */
+
+#include <stdlib.h>
+#include <setjmp.h>
+#include "infra/qmemory.h"
+#include "infra/qcmap.h"
+#include "infra/qslab.h"
+#include "error.h"
+#include "lex.h"
+#include "expr.h"
+#include "mao.h"
+#include "profile.h"
+
+mao_state
+mao_state_create(FILE *err)
+{
+    mao_state st = qalloc(sizeof(struct mao_state_struct));
+
+    st->global_memory_list = qmem_create(void*);
+    qmem_set_tag(st->global_memory_list, QALLOC_EXPR);
+    st->variable_list      = qcmap_create(mvar);
+    st->object_slab        = qslab_create(struct mobject_struct, QALLOC_OBJECT);
+    st->variable_slab      = qslab_create(struct mvar_struct, QALLOC_OBJECT);
+    st->expr_slab          = qslab_create(struct mao_expr_struct, QALLOC_EXPR);
+    atomic_init(&st->var_id_list, 1);
+    atomic_init(&st->errnum, 0);
+    st->line_count         = 1;
+    st->err                = err;
+    st->out                = NULL;
+    st->fail               = NULL;
+    return st;
+}
+
+void
+mao_state_destroy(mao_state st)
+{
+    qcmap_free(st->variable_list);
+    qslab_destroy(st->object_slab);
+    qslab_destroy(st->variable_slab);
+    qslab_destroy(st->expr_slab);
+    qmem_free(st->global_memory_list);
+    qfree(st, sizeof(struct mao_state_struct), QALLOC_MISC);
+}
+
+void
+mao_fail(mao_state st)
+{
+    if (st->fail == NULL) {
+        exit(1);
+    }
+    longjmp(*st->fail, 1);
+}
+
+/* Only this script stops, the others of a batch go on */
+static _Noreturn void
+mao_out_of_memory(void *arg, const char *msg)
+{
+    mao_state st = arg;
+    add_err_queue(st, "%s", msg);
+    mao_fail(st);
+}
+
+int
+mao_run(mao_state st, FILE *in, qwriter_t out, bool pipeline)
+{
+    jmp_buf fail;
+    qmem_t volatile stream = NULL;
+    int volatile status = 0;
+    struct qalloc_handler outer = qalloc_on_fail((struct qalloc_handler) {
+        mao_out_of_memory, st
+    });
+
+    st->out = out;
+    st->line_count = 1;
+    st->fail = &fail;
+    if (setjmp(fail) != 0) {
+        status = 1;
+    } else if (pipeline) {
+        mao_parse_pipelined(st, in);
+    } else {
+        /* Made here, so that it is freed below if lexing fails */
+        stream = qmem_create_growing(struct token);
+        qmem_set_tag(stream, QALLOC_TOKEN);
+        mao_lex_append(st, in, stream);
+        mao_prof_mark(PROF_LEX);
+        mao_prof_tokens(qmem_len(stream));
+        mao_parse(st, stream);
+    }
+    st->fail = NULL;
+    qalloc_on_fail(outer);
+    /* A fatal error may leave temporaries of its statement */
+    global_memory_clean(st);
+    if (stream != NULL) {
+        mao_lex_free(stream);
+    }
+    return status;
+}
+
+int
+mao_errors(mao_state st)
+{
+    return atomic_load(&st->errnum);
+}
@@ -0,0 +1,47 @@
+/*
+ * mao.h
+ *
+ * Mao as a library. Each mao_state is an interpreter of its own, with
+ * its own variables and output, and interpreters share nothing, so
+ * several of them can run at once in different threads. A state is
+ * used by one thread at a time.
+ *
+ * The allocator backend (see error.h) and the hash seed (see
+ * qstring.h) are for the whole process, and must be set before the
+ * first state is created.
+ */
+
+#ifndef MAOLANG_MAO_H_
+#define MAOLANG_MAO_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "infra/qwriter.h"
+#include "runtime.h"
+
+/*
+ * Error messages of the interpreter go to err.
+ */
+mao_state mao_state_create(FILE *err);
+
+/*
+ * Run the script read from in, printing to out, which is not flushed.
+ * Variables stay in st from one call to the next. With pipeline, in is
+ * lexed by a thread of its own.
+ *
+ * Return 0, or 1 if the script was stopped by a fatal error. Errors
+ * that are not fatal are only counted, see mao_errors. Running out of
+ * memory, as under a capped backend, is a fatal error of the script
+ * rather than the end of the process; what the script was building
+ * at that moment may not be given back.
+ */
+int mao_run(mao_state st, FILE *in, qwriter_t out, bool pipeline);
+
+/*
+ * Errors reported so far, fatal or not.
+ */
+int mao_errors(mao_state st);
+
+void mao_state_destroy(mao_state st);
+
+#endif //MAOLANG_MAO_H_
@@ -44,12 +44,12 @@
 
 #define make_operation_functions(name, op) \
     mobj \
-    mao_obj_##name(mobj o1, mobj o2) \
+    mao_obj_##name(mao_state st, mobj o1, mobj o2) \
     { \
         assert(o1 != NULL); \
         assert(o2 != NULL); \
-        mobj res = qalloc(sizeof(struct mobject_struct)); \
-        global_memory_register(res); \
+        mobj res = qslab_alloc(st->object_slab); \
+        global_memory_register(st, res); \
         res->type = MAO_GET_TYPE(o1->type, o2->type); \
         (TYPE_ASSIGN(res, op(TYPE_SELECT(o1), TYPE_SELECT(o2)))); \
         return res; \
@@ -81,15 +81,15 @@ make_assignment_functions(dive, MAO_DIV)
  * Calculate sign operator: '-' or '+'
  */
 mobj
-mao_obj_sign(mobj item, bool negative)
+mao_obj_sign(mao_state st, mobj item, bool negative)
 {
     assert(item != NULL);
     
     if (!negative) {
         return item;
     }
-    mobj res = qalloc(sizeof(struct mobject_struct));
-    global_memory_register(res);
+    mobj res = qslab_alloc(st->object_slab);
+    global_memory_register(st, res);
     switch (item->type) {
         case MAO_OBJ_INT:
             res->type = MAO_OBJ_INT;
@@ -110,11 +110,11 @@ mao_obj_sign(mobj item, bool negative)
  * Create a new object and choosing init type.
  */
 mobj
-mao_obj_new(int init_type, ...)
+mao_obj_new(mao_state st, int init_type, ...)
 {
     assert(init_type == OBJ_INIT_INT || init_type == OBJ_INIT_DOUBLE);
-    mobj res = qalloc(sizeof(struct mobject_struct));
-    global_memory_register(res);
+    mobj res = qslab_alloc(st->object_slab);
+    global_memory_register(st, res);
     va_list ap;
     va_start(ap, init_type);
     if (init_type == OBJ_INIT_INT) {
@@ -129,13 +129,15 @@ mao_obj_new(int init_type, ...)
 }
 
 void
-print_obj(mobj item, FILE *fp)
+print_obj(mobj item, qwriter_t out)
 {
     assert(item != NULL);
     if (item->type == MAO_OBJ_INT) {
-        fprintf(fp, "%d\n", item->ival);
+        qwriter_int64(out, item->ival);
+        qwriter_putc(out, '\n');
     } else if (item->type == MAO_OBJ_DOUBLE) {
-        fprintf(fp, "%.6lf\n", item->dval);
+        qwriter_fixed(out, item->dval, 6);
+        qwriter_putc(out, '\n');
     }
 }
 
@@ -143,11 +145,11 @@ print_obj(mobj item, FILE *fp)
  * Clean the temporary list.
  */
 void
-global_memory_clean(void)
+global_memory_clean(mao_state st)
 {
-    for (qmem_iter_t iter = qmem_iter_new(global_memory_list);
+    for (qmem_iter_t iter = qmem_iter_new(st->global_memory_list);
          !qmem_iter_end(iter); qmem_iter_forward(&iter)) {
-        free(qmem_iter_getval(iter, void*));
+        qslab_release(qmem_iter_getval(iter, void*));
     }
-    qmem_clear(global_memory_list);
+    qmem_clear(st->global_memory_list);
 }
@@ -5,19 +5,23 @@
  * Main parsing function for Mao statements.
  */
 
+#include <pthread.h>
+#include <setjmp.h>
 #include "infra/qmemory.h"
+#include "infra/qqueue.h"
 #include "runtime.h"
 #include "expr.h"
 #include "lex.h"
+#include "profile.h"
 
 #define CURTOK(x) (qmem_iter_getval(x, struct token))
 
-static int parse_declaration(qmem_iter_t *stream_pos);
-static int parse_expression(qmem_iter_t *stream_pos);
-static int parse_function(qmem_iter_t *stream_pos, FILE *fp);
+static int parse_declaration(mao_state st, qmem_iter_t *stream_pos);
+static int parse_expression(mao_state st, qmem_iter_t *stream_pos);
+static int parse_function(mao_state st, qmem_iter_t *stream_pos);
 
 int
-mao_parse(qmem_t stream, FILE *fp)
+mao_parse(mao_state st, qmem_t stream)
 {
     int status = 0;
     for (qmem_iter_t stream_pos = qmem_iter_new(stream);
@@ -25,7 +29,10 @@ mao_parse(qmem_t stream, FILE *fp)
         switch (CURTOK(stream_pos).type) {
         case TOKEN_TYPE_INT:
         case TOKEN_TYPE_DOUBLE:
-            status += parse_declaration(&stream_pos);
+            mao_prof_stmt_begin(st, CURTOK(stream_pos).line);
+            status += parse_declaration(st, &stream_pos);
+            mao_prof_mark(PROF_DECLARE);
+            mao_prof_stmt_end(st);
             break;
         case TOKEN_IDENTIFIER:
         case TOKEN_LPAREN:
@@ -33,10 +40,14 @@ mao_parse(qmem_t stream, FILE *fp)
         case TOKEN_OP_SUB:
         case TOKEN_NUMBER_INT:
         case TOKEN_NUMBER_FLOAT:
-            status += parse_expression(&stream_pos);
+            mao_prof_stmt_begin(st, CURTOK(stream_pos).line);
+            status += parse_expression(st, &stream_pos);
+            mao_prof_stmt_end(st);
             break;
         case TOKEN_FUNC_PRINT:
-            status += parse_function(&stream_pos, fp);
+            mao_prof_stmt_begin(st, CURTOK(stream_pos).line);
+            status += parse_function(st, &stream_pos);
+            mao_prof_stmt_end(st);
             break;
         default:
             break;
@@ -45,8 +56,118 @@ mao_parse(qmem_t stream, FILE *fp)
     return status;
 }
 
+struct lex_thread_arg {
+    mao_state  st;
+    FILE      *fp;
+    qqueue_t queue;
+    atomic_bool stop;	/* the parser failed, the rest is not needed */
+    atomic_bool failed;	/* the lexer ran out of memory */
+    jmp_buf     oom;
+};
+
+/* The parser sees the queue end early, and fails in its turn */
+static _Noreturn void
+lex_out_of_memory(void *arg, const char *msg)
+{
+    struct lex_thread_arg *la = arg;
+    add_err_queue(la->st, "%s", msg);
+    atomic_store_explicit(&la->failed, true, memory_order_relaxed);
+    longjmp(la->oom, 1);
+}
+
+static void *
+lex_thread(void *arg)
+{
+    struct lex_thread_arg *la = arg;
+    struct token tok;
+    
+    qalloc_on_fail((struct qalloc_handler) { lex_out_of_memory, la });
+    if (setjmp(la->oom) == 0) {
+        do {
+            tok = mao_lex_next(la->st, la->fp);
+            qqueue_push(la->queue, &tok);
+        } while (tok.type != TOKEN_END &&
+                 !atomic_load_explicit(&la->stop, memory_order_relaxed));
+    }
+    qqueue_close(la->queue);
+    qmem_pool_trim(0);
+    return NULL;
+}
+
+/*
+ * Every statement ends with ';', so the tokens are collected until a
+ * ';' (or the end) arrives and then parsed as a stream of their own.
+ * Statements run in the same order as in mao_parse, so does output.
+ *
+ * A fatal error stops the lexer thread and comes back here to join it
+ * before it goes on to the caller. The tokens left in the queue are
+ * freed one by one, since memory may have run out.
+ */
+int
+mao_parse_pipelined(mao_state st, FILE *in)
+{
+    int status = 0;
+    struct token tok;
+    pthread_t lexer;
+    jmp_buf fail;
+    jmp_buf *volatile outer = st->fail;
+    struct lex_thread_arg la = { st, in, NULL, false, false };
+    qmem_t statement = qmem_create_growing(struct token);
+    qmem_set_tag(statement, QALLOC_TOKEN);
+
+    if (setjmp(fail) != 0) {
+        /* No memory for the queue */
+        mao_lex_free(statement);
+        st->fail = outer;
+        mao_fail(st);
+    }
+    st->fail = &fail;
+    la.queue = qqueue_create(struct token);
+    st->fail = outer;
+    
+    if (pthread_create(&lexer, NULL, lex_thread, &la) != 0) {
+        /* Not an error of the script, so not counted in st->errnum */
+        fputs("Cannot start the lexer thread, run without pipeline.\n", st->err);
+        qqueue_free(la.queue);
+        qmem_free(statement);
+        statement = mao_lex_analyze(st, in);
+        status = mao_parse(st, statement);
+        mao_lex_free(statement);
+        return status;
+    }
+    if (setjmp(fail) != 0) {
+        atomic_store_explicit(&la.stop, true, memory_order_relaxed);
+        while (qqueue_pop(la.queue, &tok)) {
+            mao_lex_free_token(tok);
+        }
+        pthread_join(lexer, NULL);
+        qqueue_free(la.queue);
+        mao_lex_free(statement);
+        st->fail = outer;
+        mao_fail(st);
+    }
+    st->fail = &fail;
+    while (qqueue_pop(la.queue, &tok)) {
+        qmem_append(statement, tok, struct token);
+        if (tok.type == TOKEN_SEMICOLON || tok.type == TOKEN_END) {
+            mao_prof_mark(PROF_LEX);
+            mao_prof_tokens(qmem_len(statement) + qqueue_waiting(la.queue));
+            status += mao_parse(st, statement);
+            mao_lex_clear(statement);
+        }
+    }
+    if (atomic_load_explicit(&la.failed, memory_order_relaxed)) {
+        mao_fail(st);
+    }
+    st->fail = outer;
+    pthread_join(lexer, NULL);
+    qqueue_free(la.queue);
+    mao_lex_free(statement);
+    return status;
+}
+
 static int
-parse_declaration(qmem_iter_t *stream_pos)
+parse_declaration(mao_state st, qmem_iter_t *stream_pos)
 {
     int status = 0;
     int type = CURTOK(*stream_pos).type == TOKEN_TYPE_INT ?
@@ -55,11 +176,11 @@ parse_declaration(qmem_iter_t *stream_pos)
 
     while (!qmem_iter_end(*stream_pos)) {
         if (CURTOK(*stream_pos).type != TOKEN_IDENTIFIER) {
-            add_err_queue("line %u: Expected identifier after typeword '%s'.\n",
+            add_err_queue(st, "line %u: Expected identifier after typeword '%s'.\n",
                     CURTOK(*stream_pos).line, type == MAO_OBJ_INT ? "int" : "double");
-            exit(status = 1);
+            mao_fail(st);
         }
-        mao_register_variable(type, CURTOK(*stream_pos).name);
+        mao_register_variable(st, type, CURTOK(*stream_pos).name);
         qmem_iter_forward(stream_pos);
         if (!qmem_iter_end(*stream_pos)) {
             if (CURTOK(*stream_pos).type == TOKEN_COMMA) {
@@ -67,9 +188,9 @@ parse_declaration(qmem_iter_t *stream_pos)
             } else if (CURTOK(*stream_pos).type == TOKEN_SEMICOLON) {
                 break;
             } else {
-                add_err_queue("line %u: Expected ',' or ';' after identifier.\n",
+                add_err_queue(st, "line %u: Expected ',' or ';' after identifier.\n",
                         CURTOK(*stream_pos).line);
-                exit(status = 1);
+                mao_fail(st);
             }
         }
     }
@@ -77,7 +198,7 @@ parse_declaration(qmem_iter_t *stream_pos)
 }
 
 static int
-parse_expression(qmem_iter_t *stream_pos)
+parse_expression(mao_state st, qmem_iter_t *stream_pos)
 {
     int  status    = 0;
     bool semicolon = false;
@@ -93,22 +214,26 @@ parse_expression(qmem_iter_t *stream_pos)
 
     /* No semicolon found */
     if (!semicolon) {
-        add_err_queue("end line: Expected ';' at end of a statement.\n");
-        exit(status = 1);
+        add_err_queue(st, "end line: Expected ';' at end of a statement.\n");
+        mao_fail(st);
     }
 
-    mao_expr_calc(mao_parse_expr(*stream_pos, probe));
+    mao_expr expr = mao_parse_expr(st, *stream_pos, probe);
+    mao_prof_mark(PROF_PARSE);
+    mao_expr_calc(st, expr);
+    mao_prof_mark(PROF_CALC);
     /* 
      * Every time when an expression is parsed, the temporary
      * memory list will be released.
      */
-    global_memory_clean();
+    global_memory_clean(st);
+    mao_prof_mark(PROF_CLEAN);
     *stream_pos = probe;
     return status;
 }
 
 static int
-parse_function(qmem_iter_t *stream_pos, FILE *fp)
+parse_function(mao_state st, qmem_iter_t *stream_pos)
 {
     int status = 0;
     qmem_iter_t probe = *stream_pos;
@@ -131,11 +256,16 @@ parse_function(qmem_iter_t *stream_pos, FILE *fp)
             qmem_iter_forward(stream_pos);
             qmem_iter_forward(stream_pos);
             if (qmem_iter_getval(*stream_pos, struct token).type == TOKEN_LITERAL) {
-                qstr_print(qmem_iter_getval(*stream_pos, struct token).name, fp);
+                qwriter_write_qstr(st->out, qmem_iter_getval(*stream_pos, struct token).name);
             } else {
-                print_obj(mao_expr_calc(mao_parse_expr(*stream_pos, probe)), fp);
+                mao_expr expr = mao_parse_expr(st, *stream_pos, probe);
+                mao_prof_trace_mark(PROF_PARSE);
+                mobj value = mao_expr_calc(st, expr);
+                mao_prof_trace_mark(PROF_CALC);
+                print_obj(value, st->out);
                 *stream_pos = probe;
             }
+            mao_prof_mark(PROF_PRINT);
             qmem_iter_forward(stream_pos);
             break;
         default:
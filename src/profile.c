@@ -0,0 +1,425 @@
+/*
+ * profile.c
+ *
+ * Timers of the --profile and --trace modes.
+ */
+
+/* For clock_gettime, which -std=c11 alone hides */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "profile.h"
+#include "runtime.h"
+#include "error.h"
+#include "infra/qwriter.h"
+
+bool mao_profiling = false;
+bool mao_prof_tracing = false;
+
+/*
+ * Laps are measured in ticks of prof_ticks, and turned into time with
+ * the monotonic clock only in the report.
+ */
+struct prof_phase {
+    uint64_t            laps;
+    uint64_t           ticks;
+};
+
+struct prof_line {
+    unsigned            line;
+    uint64_t           count;
+    uint64_t           ticks;
+    uint64_t          allocs;
+};
+
+static const char *prof_phase_names[PROF_PHASES] = {
+    "lex", "declare", "parse", "calc", "print", "clean"
+};
+
+/*
+ * Statements are run by one thread, even with --pipeline, so none of
+ * this needs a lock.
+ *
+ * Mao has no jumps, so statements run in the order of their lines and
+ * those of one line run one after another. A line is added up in
+ * prof_cur until the next one begins, then offered to prof_top, a
+ * min-heap of the slowest lines. Memory stays bounded by the size of
+ * the report, however long the script is.
+ */
+static struct prof_phase   prof_phases[PROF_PHASES];
+static struct prof_line    prof_cur;
+static struct prof_line   *prof_top;
+static unsigned            prof_topcap;
+static unsigned            prof_toplen;
+static uint64_t            prof_start;
+static uint64_t            prof_start_ns;
+static uint64_t            prof_last;	/* end of the last lap */
+static uint64_t            prof_stmt_start;
+static uint64_t            prof_stmt_allocs;
+
+/*
+ * The trace is a list of chunks of 64-bit words. Each record begins
+ * with a word holding its kind in the top bits and a time in ticks
+ * since prof_start in the rest:
+ *
+ *     lap         phase | end      (it began where the lap before ended)
+ *     statement   PROF_EV_STMT | begin, end, line | live objects << 32,
+ *                 live bytes
+ *     flush       PROF_EV_FLUSH | begin, end, bytes
+ *     tokens      PROF_EV_TOKENS | time, count
+ *
+ * A record never spans two chunks. This is about 7 words for each
+ * statement, so a million statements take some 56 MB.
+ */
+#define PROF_KIND_SHIFT     59
+#define PROF_TICKS_MASK     (((uint64_t)1 << PROF_KIND_SHIFT) - 1)
+#define PROF_EV_STMT        PROF_PHASES
+#define PROF_EV_FLUSH       (PROF_PHASES + 1)
+#define PROF_EV_TOKENS      (PROF_PHASES + 2)
+#define PROF_CHUNK_WORDS    (1 << 16)
+
+struct prof_chunk {
+    struct prof_chunk   *next;
+    size_t                len;
+    uint64_t   words[PROF_CHUNK_WORDS];
+};
+
+static struct prof_chunk  *prof_chunks;
+static struct prof_chunk  *prof_chunk_last;
+static size_t              prof_chunk_count;
+static uint64_t            prof_flush_start;
+
+static uint64_t
+prof_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+ * On x86 the time stamp counter is read, a few times faster than
+ * clock_gettime, which matters with several laps in each statement.
+ * It ticks at a constant rate on every CPU of this century.
+ */
+static uint64_t
+prof_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return prof_clock_ns();
+#endif
+}
+
+/*
+ * Objects, variables and expression nodes come from slabs and never
+ * reach qalloc, so they are counted from the slabs.
+ */
+static uint64_t
+prof_allocs(mao_state st)
+{
+    return qalloc_stats_thread_allocs() + st->object_slab->allocs +
+        st->variable_slab->allocs + st->expr_slab->allocs;
+}
+
+/*
+ * Shared by both modes, the clock starts with the first of them.
+ */
+static void
+prof_start_clock(void)
+{
+    if (mao_profiling) {
+        return;
+    }
+    mao_profiling = true;
+    prof_start_ns = prof_clock_ns();
+    prof_start = prof_last = prof_ticks();
+}
+
+void
+mao_prof_enable(unsigned top)
+{
+    qalloc_stats_thread_enable();
+    prof_topcap = top;
+    prof_top = qalloc(top * sizeof(struct prof_line));
+    prof_start_clock();
+}
+
+void
+mao_prof_trace_enable(void)
+{
+    qalloc_stats_enable();
+    mao_prof_tracing = true;
+    prof_start_clock();
+}
+
+static struct prof_chunk *
+prof_trace_grow(void)
+{
+    struct prof_chunk *res = qalloc_tag(sizeof(struct prof_chunk), QALLOC_BUFFER);
+    
+    res->next = NULL;
+    res->len = 0;
+    if (prof_chunk_last != NULL) {
+        prof_chunk_last->next = res;
+    } else {
+        prof_chunks = res;
+    }
+    prof_chunk_count++;
+    return prof_chunk_last = res;
+}
+
+/*
+ * Room for a record of n words, the first of them filled in.
+ */
+static inline uint64_t *
+prof_record(unsigned n, int kind, uint64_t ticks)
+{
+    struct prof_chunk *c = prof_chunk_last;
+    uint64_t        *res;
+    
+    if (c == NULL || c->len + n > PROF_CHUNK_WORDS) {
+        c = prof_trace_grow();
+    }
+    res = c->words + c->len;
+    c->len += n;
+    res[0] = (uint64_t)kind << PROF_KIND_SHIFT | (ticks - prof_start);
+    return res;
+}
+
+void
+mao_prof_mark_(int phase)
+{
+    uint64_t now = prof_ticks();
+    prof_phases[phase].laps++;
+    prof_phases[phase].ticks += now - prof_last;
+    prof_last = now;
+    if (mao_prof_tracing) {
+        prof_record(1, phase, now);
+    }
+}
+
+static void
+prof_top_sift(unsigned i)
+{
+    struct prof_line tmp = prof_top[i];
+    
+    for (unsigned child; (child = 2 * i + 1) < prof_toplen; i = child) {
+        if (child + 1 < prof_toplen && prof_top[child + 1].ticks < prof_top[child].ticks) {
+            ++child;
+        }
+        if (tmp.ticks <= prof_top[child].ticks) {
+            break;
+        }
+        prof_top[i] = prof_top[child];
+    }
+    prof_top[i] = tmp;
+}
+
+static void
+prof_top_offer(const struct prof_line *item)
+{
+    if (item->count == 0) {
+        return;
+    }
+    if (prof_toplen < prof_topcap) {
+        /* Sift up */
+        unsigned i = prof_toplen++;
+        while (i > 0 && prof_top[(i - 1) / 2].ticks > item->ticks) {
+            prof_top[i] = prof_top[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        prof_top[i] = *item;
+    } else if (prof_topcap != 0 && item->ticks > prof_top[0].ticks) {
+        prof_top[0] = *item;
+        prof_top_sift(0);
+    }
+}
+
+void
+mao_prof_stmt_begin_(mao_state st, unsigned line)
+{
+    if (line != prof_cur.line) {
+        prof_top_offer(&prof_cur);
+        prof_cur = (struct prof_line) { line, 0, 0, 0 };
+    }
+    prof_stmt_start = prof_last;
+    prof_stmt_allocs = prof_allocs(st);
+}
+
+void
+mao_prof_stmt_end_(mao_state st)
+{
+    prof_cur.count++;
+    prof_cur.ticks += prof_last - prof_stmt_start;
+    prof_cur.allocs += prof_allocs(st) - prof_stmt_allocs;
+    if (mao_prof_tracing) {
+        uint64_t *rec = prof_record(4, PROF_EV_STMT, prof_stmt_start);
+        uint64_t objects = st->object_slab->live + st->variable_slab->live +
+            st->expr_slab->live;
+
+        rec[1] = prof_last - prof_start;
+        rec[2] = prof_cur.line | objects << 32;
+        /* The trace itself is not counted */
+        rec[3] = qalloc_stats_live() - prof_chunk_count * sizeof(struct prof_chunk);
+    }
+}
+
+void
+mao_prof_tokens_(size_t count)
+{
+    if (mao_prof_tracing) {
+        prof_record(2, PROF_EV_TOKENS, prof_ticks())[1] = count;
+    }
+}
+
+void
+mao_prof_flush(size_t bytes, bool done)
+{
+    if (!done) {
+        prof_flush_start = prof_ticks();
+    } else {
+        uint64_t *rec = prof_record(3, PROF_EV_FLUSH, prof_flush_start);
+        rec[1] = prof_ticks() - prof_start;
+        rec[2] = bytes;
+    }
+}
+
+static int
+prof_line_cmp(const void *a, const void *b)
+{
+    const struct prof_line *la = a, *lb = b;
+    return (la->ticks < lb->ticks) - (la->ticks > lb->ticks);
+}
+
+void
+mao_prof_report(FILE *fp)
+{
+    uint64_t total = prof_ticks() - prof_start;
+    double   ms = total != 0 ? (prof_clock_ns() - prof_start_ns) / 1e6 / total : 0;
+    uint64_t other = total;
+    
+    fprintf(fp, "profile: %.3f ms in total\n", total * ms);
+    fprintf(fp, "%-10s %12s %14s %7s\n", "phase", "laps", "time ms", "%");
+    for (int i = 0; i < PROF_PHASES; ++i) {
+        fprintf(fp, "%-10s %12llu %14.3f %7.2f\n", prof_phase_names[i],
+                (unsigned long long)prof_phases[i].laps, prof_phases[i].ticks * ms,
+                total != 0 ? 100.0 * prof_phases[i].ticks / total : 0.0);
+        other -= prof_phases[i].ticks;
+    }
+    /* Setting up, and the statements' own dispatching */
+    fprintf(fp, "%-10s %12s %14.3f %7.2f\n", "other", "",
+            other * ms, total != 0 ? 100.0 * other / total : 0.0);
+    
+    prof_top_offer(&prof_cur);
+    prof_cur.count = 0;
+    if (prof_toplen == 0) {
+        return;
+    }
+    qsort(prof_top, prof_toplen, sizeof(struct prof_line), prof_line_cmp);
+    
+    fprintf(fp, "top statements by time:\n");
+    fprintf(fp, "%8s %12s %14s %12s %12s %7s\n",
+            "line", "count", "time ms", "mean us", "allocs", "%");
+    for (unsigned i = 0; i < prof_toplen; ++i) {
+        const struct prof_line *l = &prof_top[i];
+        fprintf(fp, "%8u %12llu %14.3f %12.3f %12llu %7.2f\n",
+                l->line, (unsigned long long)l->count, l->ticks * ms,
+                l->ticks * ms * 1e3 / l->count, (unsigned long long)l->allocs,
+                total != 0 ? 100.0 * l->ticks / total : 0.0);
+    }
+}
+
+#define prof_puts(out, str) qwriter_write(out, str, strlen(str))
+
+/*
+ * Begin a Chrome trace event, up to the point where its args go.
+ * Times are in microseconds.
+ */
+static void
+prof_trace_event(qwriter_t out, const char *name, const char *ph, uint64_t ticks, double us)
+{
+    prof_puts(out, ",\n{\"name\":\"");
+    prof_puts(out, name);
+    prof_puts(out, "\",\"ph\":\"");
+    prof_puts(out, ph);
+    prof_puts(out, "\",\"pid\":1,\"tid\":1,\"ts\":");
+    qwriter_fixed(out, ticks * us, 3);
+}
+
+static void
+prof_trace_span(qwriter_t out, const char *name, uint64_t begin, uint64_t end, double us)
+{
+    prof_trace_event(out, name, "X", begin, us);
+    prof_puts(out, ",\"dur\":");
+    qwriter_fixed(out, (end - begin) * us, 3);
+}
+
+static void
+prof_trace_arg(qwriter_t out, const char *sep, const char *key, uint64_t value)
+{
+    prof_puts(out, sep);
+    prof_puts(out, key);
+    prof_puts(out, "\":");
+    qwriter_int64(out, (int64_t)value);
+}
+
+void
+mao_prof_trace_write(int fd)
+{
+    uint64_t  total = prof_ticks() - prof_start;
+    double    us = total != 0 ? (prof_clock_ns() - prof_start_ns) / 1e3 / total : 0;
+    uint64_t  lap_begin = 0;
+    qwriter_t out = qwriter_create(fd);
+    
+    prof_puts(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+              "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+              "\"args\":{\"name\":\"statements\"}}");
+    for (struct prof_chunk *c = prof_chunks; c != NULL; c = c->next) {
+        for (size_t i = 0; i < c->len; ) {
+            const uint64_t *rec = c->words + i;
+            int       kind = (int)(rec[0] >> PROF_KIND_SHIFT);
+            uint64_t ticks = rec[0] & PROF_TICKS_MASK;
+            
+            switch (kind) {
+            case PROF_EV_STMT:
+                prof_trace_span(out, "statement", ticks, rec[1], us);
+                prof_trace_arg(out, ",\"args\":{\"", "line", (uint32_t)rec[2]);
+                prof_puts(out, "}}");
+                prof_trace_event(out, "live", "C", rec[1], us);
+                prof_trace_arg(out, ",\"args\":{\"", "heap bytes", rec[3]);
+                prof_trace_arg(out, ",\"", "slab objects", rec[2] >> 32);
+                prof_puts(out, "}}");
+                i += 4;
+                break;
+            case PROF_EV_FLUSH:
+                prof_trace_span(out, "flush", ticks, rec[1], us);
+                prof_trace_arg(out, ",\"args\":{\"", "bytes", rec[2]);
+                prof_puts(out, "}}");
+                i += 3;
+                break;
+            case PROF_EV_TOKENS:
+                prof_trace_event(out, "tokens", "C", ticks, us);
+                prof_trace_arg(out, ",\"args\":{\"", "tokens", rec[1]);
+                prof_puts(out, "}}");
+                i += 2;
+                break;
+            default:
+                prof_trace_span(out, prof_phase_names[kind], lap_begin, ticks, us);
+                prof_puts(out, "}");
+                lap_begin = ticks;
+                i += 1;
+                break;
+            }
+        }
+    }
+    prof_puts(out, "\n]}\n");
+    qwriter_free(out);
+}
@@ -0,0 +1,95 @@
+/*
+ * profile.h
+ *
+ * The --profile mode. Time is measured in laps: each mark closes the
+ * lap begun by the one before and adds it to a phase, so the phases
+ * never overlap and one clock reading serves two of them. Statements
+ * are timed from the end of the lap before them to the end of their
+ * last lap, and counted under the line they begin on.
+ *
+ * The --trace mode records the same laps and statements one by one,
+ * in memory, and writes them out as a timeline at exit.
+ *
+ * With both off, each mark costs a test of mao_profiling.
+ *
+ * Some laps are split only when tracing, where the timeline shows
+ * them: with --profile alone, the parsing and calculation of what is
+ * printed are counted under PROF_PRINT, as a clock reading costs much
+ * of what such short laps take.
+ *
+ * Both modes keep one clock and one record for the process, so they
+ * are for a program running a single interpreter.
+ */
+
+#ifndef MAOLANG_PROFILE_H_
+#define MAOLANG_PROFILE_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "runtime.h"
+
+#define PROF_LEX            0	/* lexing, or waiting for the lexer thread */
+#define PROF_DECLARE        1	/* mao_register_variable */
+#define PROF_PARSE          2	/* mao_parse_expr */
+#define PROF_CALC           3	/* mao_expr_calc */
+#define PROF_PRINT          4	/* print_obj and string output, see above */
+#define PROF_CLEAN          5	/* global_memory_clean */
+#define PROF_PHASES         6
+
+extern bool mao_profiling;
+extern bool mao_prof_tracing;
+
+/*
+ * Start the clock and keep the top slowest source lines for the
+ * report. Allocations are counted through qalloc, so this must be
+ * called before anything is allocated.
+ */
+void mao_prof_enable(unsigned top);
+
+/*
+ * Start the clock and record every lap, statement, output flush and
+ * count of tokens for mao_prof_trace_write. Memory is counted through
+ * qalloc, so this too must be called before anything is allocated.
+ */
+void mao_prof_trace_enable(void);
+
+void mao_prof_mark_(int phase);
+void mao_prof_stmt_begin_(mao_state st, unsigned line);
+void mao_prof_stmt_end_(mao_state st);
+void mao_prof_tokens_(size_t count);
+
+#define mao_prof_mark(phase) \
+    do { if (mao_profiling) mao_prof_mark_(phase); } while (0)
+
+/* A mark closing a lap of its own only when tracing */
+#define mao_prof_trace_mark(phase) \
+    do { if (mao_prof_tracing) mao_prof_mark_(phase); } while (0)
+
+#define mao_prof_stmt_begin(st, line) \
+    do { if (mao_profiling) mao_prof_stmt_begin_(st, line); } while (0)
+
+#define mao_prof_stmt_end(st) \
+    do { if (mao_profiling) mao_prof_stmt_end_(st); } while (0)
+
+/* Tokens held in memory, lexed and not parsed yet or kept for later */
+#define mao_prof_tokens(count) \
+    do { if (mao_profiling) mao_prof_tokens_(count); } while (0)
+
+/*
+ * The observer of the output writer when tracing, see qwriter.h.
+ */
+void mao_prof_flush(size_t bytes, bool done);
+
+/*
+ * Print the time of each phase and the top lines by total time.
+ */
+void mao_prof_report(FILE *fp);
+
+/*
+ * Write what was recorded to fd in the Chrome trace event format, read
+ * by chrome://tracing and Perfetto.
+ */
+void mao_prof_trace_write(int fd);
+
+#endif //MAOLANG_PROFILE_H_
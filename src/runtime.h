@@ -10,11 +10,17 @@
 #ifndef MAOLANG_RUNTIME_H_
 #define MAOLANG_RUNTIME_H_
 
+#include <stdio.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <setjmp.h>
 #include <assert.h>
 #include "infra/qmemory.h"
 #include "infra/qstring.h"
 #include "infra/qmap.h"
+#include "infra/qcmap.h"
+#include "infra/qwriter.h"
+#include "infra/qslab.h"
 
 #define MAO_OBJ_CONFLICT 0  /* 000 */
 #define MAO_OBJ_INT      1  /* 001 */
@@ -37,23 +43,56 @@ struct mvar_struct {
 
 typedef struct mvar_struct * mvar;
 
-mvar mao_register_variable(int type, qstr_t var_name);
-mobj mao_get_variable_obj(qstr_t name);
+/*
+ * Everything one interpreter works on. Interpreters share nothing, so
+ * each can run in a thread of its own. With --pipeline, the lexer
+ * thread of an interpreter touches only line_count, number_buf and
+ * errnum.
+ */
+struct mao_state_struct {
+    qmem_t    global_memory_list;	/* temporaries of the statement */
+    qcmap_t        variable_list;
+    /*
+     * Objects, variables and expression nodes are cut from these
+     * pools instead of being malloc'ed one by one.
+     */
+    qslab_t          object_slab;
+    qslab_t        variable_slab;
+    qslab_t            expr_slab;
+    atomic_int       var_id_list;	/* id of the next variable */
+    atomic_int            errnum;
+    unsigned          line_count;	/* of the lexer */
+    char          number_buf[31];	/* of the lexer */
+    FILE                    *err;	/* error messages */
+    qwriter_t                out;	/* output of print */
+    jmp_buf                *fail;	/* where mao_fail goes, or NULL */
+};
+
+typedef struct mao_state_struct * mao_state;
+
+/*
+ * Stop the script after a fatal error: go back to mao_run, or end the
+ * program if the script is not run by mao_run.
+ */
+_Noreturn void mao_fail(mao_state st);
+
+mvar mao_register_variable(mao_state st, int type, qstr_t var_name);
+mobj mao_get_variable_obj(mao_state st, qstr_t name);
 
 #define OBJ_INIT_INT    1
 #define OBJ_INIT_DOUBLE 2
 
-mobj mao_obj_new(int init_type, ...);
-void print_obj(mobj item, FILE *fp);
+mobj mao_obj_new(mao_state st, int init_type, ...);
+void print_obj(mobj item, qwriter_t out);
 
 /*
  * basic arithmetic operators:
  * + - * /
  */
-mobj mao_obj_add(mobj o1, mobj o2);
-mobj mao_obj_sub(mobj o1, mobj o2);
-mobj mao_obj_mul(mobj o1, mobj o2);
-mobj mao_obj_div(mobj o1, mobj o2);
+mobj mao_obj_add(mao_state st, mobj o1, mobj o2);
+mobj mao_obj_sub(mao_state st, mobj o1, mobj o2);
+mobj mao_obj_mul(mao_state st, mobj o1, mobj o2);
+mobj mao_obj_div(mao_state st, mobj o1, mobj o2);
 
 /*
  * assignment operators:
@@ -64,13 +103,15 @@ mobj mao_obj_adde(mobj dst, mobj src);
 mobj mao_obj_sube(mobj dst, mobj src);
 mobj mao_obj_mule(mobj dst, mobj src);
 mobj mao_obj_dive(mobj dst, mobj src);
-mobj mao_obj_sign(mobj item, bool negative);
-
-extern qmem_t global_memory_list;
-extern qmap_t variable_list;
+mobj mao_obj_sign(mao_state st, mobj item, bool negative);
 
-#define global_memory_register(address) qmem_append(global_memory_list, address, void*)
-void global_memory_clean(void);
+/*
+ * Temporary objects and expression nodes live until the statement
+ * is done. Only memory from the slabs of st can be registered.
+ */
+#define global_memory_register(st, address) \
+    qmem_append((st)->global_memory_list, address, void*)
+void global_memory_clean(mao_state st);
 
 #endif //MAOLANG_RUNTIME_H_
 
@@ -5,21 +5,20 @@
 
 #include "infra/qmemory.h"
 #include "infra/qstring.h"
-#include "infra/qmap.h"
+#include "infra/qcmap.h"
 #include "runtime.h"
 #include "error.h"
 
 mvar
-mao_register_variable(int type, qstr_t var_name)
+mao_register_variable(mao_state st, int type, qstr_t var_name)
 {
-    static int var_id_list = 1;
-    if (qmap_element_exist(variable_list, var_name)) {
-        add_err_queue("Redefinition of variable.\n");
+    if (qcmap_element_exist(st->variable_list, var_name)) {
+        add_err_queue(st, "Redefinition of variable.\n");
         return NULL;
     }
-    mvar res = qalloc(sizeof(struct mvar_struct));
-    res->id = var_id_list++;
-    res->vobj = qalloc(sizeof(struct mobject_struct));
+    mvar res = qslab_alloc(st->variable_slab);
+    res->id = atomic_fetch_add(&st->var_id_list, 1);
+    res->vobj = qslab_alloc(st->object_slab);
     res->vobj->type = type;
     
     if (type == MAO_OBJ_INT) {
@@ -28,15 +27,22 @@ mao_register_variable(int type, qstr_t var_name)
         res->vobj->dval = 0.0;
     }
 
-    qmap_add(variable_list, var_name, res, mvar);
+    if (!qcmap_insert(st->variable_list, var_name, &res)) {
+        /* Another thread registered the same name in the meantime */
+        qslab_free(st->object_slab, res->vobj);
+        qslab_free(st->variable_slab, res);
+        add_err_queue(st, "Redefinition of variable.\n");
+        return NULL;
+    }
     return res;
 }
 
 mobj
-mao_get_variable_obj(qstr_t name)
+mao_get_variable_obj(mao_state st, qstr_t name)
 {
-    if (!qmap_element_exist(variable_list, name)) {
+    mvar *res = qcmap_find(st->variable_list, name);
+    if (res == NULL) {
         return NULL;
     }
-    return qmap_fetch(variable_list, name, mvar)->vobj;
+    return (*res)->vobj;
 }